@@ -18,7 +18,10 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := cashsvr.c cash_input_common.c cashsvr_input_tof.c cashsvr_input_rgbc.c expatparser.c
-LOCAL_SRC_FILES += cashsvr_input_miscta_params.c
+LOCAL_SRC_FILES += cashsvr_input_miscta_params.c cashsvr_shm.c cash_sample_ring.c \
+	cashsvr_calcache.c cash_input_discovery.c \
+	cashsvr_sensor_vl53l0.c cashsvr_sensor_vl53l5.c cashsvr_sensor_tcs3490.c \
+	cashsvr_color.c cashsvr_flicker.c
 LOCAL_C_INCLUDES := external/expat/lib
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/include/cashsvr
 LOCAL_SHARED_LIBRARIES := liblog libcutils libexpat libpolyreg
@@ -47,4 +50,14 @@ LOCAL_PROPRIETARY_MODULE := true
 
 include $(BUILD_SHARED_LIBRARY)
 
+include $(CLEAR_VARS)
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/include/cashsvr
+LOCAL_SRC_FILES := cash_seqlock_test.c
+LOCAL_MODULE := cash_seqlock_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_MODULE_OWNER := sony
+LOCAL_PROPRIETARY_MODULE := true
+LOCAL_GTEST := false
+include $(BUILD_NATIVE_TEST)
+
 endif
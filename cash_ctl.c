@@ -24,11 +24,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdbool.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
 
 #include <cutils/android_filesystem_config.h>
 #include <hardware/hardware.h>
@@ -38,16 +44,37 @@
 #include "cash_ext.h"
 #include "cash_private.h"
 
-static int32_t send_cashsvr_data(struct cash_params params, struct cash_response *cash_resp)
+/*
+ * Persistent session state: when a session is open, every request is
+ * sent over the same SOCK_SEQPACKET connection instead of paying for
+ * socket()+connect()+close() at each call.
+ */
+static pthread_mutex_t cashctl_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool cashctl_session = false;
+static int cashctl_sock = -1;
+
+/*
+ * Shared memory snapshot, mapped read-only. An old mapping is never
+ * unmapped, as other threads may still be reading it: this happens
+ * only when the server gets restarted.
+ */
+#define CASH_SHM_READ_TRIES	16
+
+static const struct cash_shm_snapshot *_Atomic cashctl_shm;
+static int64_t cashctl_shm_retry_ns;
+
+/*
+ * cashsvr_connect - Opens a new connection to the CASH Server
+ *
+ * \return Returns the connected socket or negative errno.
+ */
+static int cashsvr_connect(void)
 {
-	register int sock;
-	int ret, len = sizeof(struct sockaddr_un);
-	fd_set receivefd;
+	int sock, ret, len = sizeof(struct sockaddr_un);
 	struct sockaddr_un server_address;
-	struct timeval timeout;
 
 	/* Get socket in the UNIX domain */
-	sock = socket(PF_UNIX, SOCK_SEQPACKET, 0);
+	sock = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
 	if (sock < 0) {
 		ALOGE("Could not get the CASH Server from client");
 		return -EPROTO;
@@ -63,14 +90,41 @@ static int32_t send_cashsvr_data(struct cash_params params, struct cash_response
 	ret = connect(sock, (struct sockaddr*)&server_address, len);
 	if (ret < 0) {
 		ALOGE("Cannot connect to CASH Server socket");
-		goto end;
+		close(sock);
+		return -ECONNREFUSED;
 	}
 
+	return sock;
+}
+
+/*
+ * cashsvr_xfer - Sends one request and waits for its reply
+ *
+ * \param fd_out - If not NULL, gets the descriptor passed along with
+ *		   the reply, or -1
+ *
+ * \return Returns the number of bytes received, -EPIPE if the server
+ *	   is gone or another negative errno.
+ */
+static int32_t cashsvr_xfer(int sock, struct cash_params *params,
+			    struct cash_response *cash_resp, int *fd_out)
+{
+	int ret;
+	fd_set receivefd;
+	struct timeval timeout;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctrl;
+
 	/* Send the filled struct */
-	ret = send(sock, &params, sizeof(struct cash_params), 0);
+	ret = send(sock, params, sizeof(struct cash_params), MSG_NOSIGNAL);
 	if (ret < 0) {
 		ALOGE("Cannot send data to CASH Server");
-		goto end;
+		return -EPIPE;
 	}
 
 	/* Setup for receiving server reply (handle) */
@@ -89,29 +143,140 @@ static int32_t send_cashsvr_data(struct cash_params params, struct cash_response
 	ret = select(sock+1, &receivefd, NULL, NULL, &timeout);
 	if (ret < 0) {
 		ALOGE("Socket error. Cannot continue.");
-		if (ret == -1) {
-			ALOGE("Socket not ready: timed out");
-			ret = -ETIMEDOUT;
-		}
-		goto end;
+		return -EINVAL;
+	} else if (ret == 0) {
+		ALOGE("Socket not ready: timed out");
+		return -ETIMEDOUT;
 	}
 
 	/* New FD is set and the socket is ready to receive data */
-	ret = recv(sock, cash_resp, sizeof(struct cash_response), 0);
-	if (ret == -1) {
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = cash_resp;
+	iov.iov_len = sizeof(struct cash_response);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd_out) {
+		*fd_out = -1;
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = sizeof(ctrl.buf);
+	}
+
+	ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (ret > 0 && fd_out) {
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd_out, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if (ret == 0) {
+		ALOGE("CASH Server closed the connection");
+		return -EPIPE;
+	} else if (ret == -1) {
 		ALOGE("Cannot receive reply from CASH Server");
-		ret = -EINVAL;
+		return -EINVAL;
 	}
-end:
-	if (sock)
+
+	return ret;
+}
+
+static int32_t send_cashsvr_data(struct cash_params params, struct cash_response *cash_resp)
+{
+	int sock, ret, retry;
+
+	/* Checked under the lock, not to reopen a session being closed */
+	pthread_mutex_lock(&cashctl_lock);
+	if (!cashctl_session) {
+		pthread_mutex_unlock(&cashctl_lock);
+
+		sock = cashsvr_connect();
+		if (sock < 0)
+			return sock;
+
+		ret = cashsvr_xfer(sock, &params, cash_resp, NULL);
 		close(sock);
+		goto end;
+	}
+
+	for (retry = 0; retry < 2; retry++) {
+		if (cashctl_sock < 0) {
+			cashctl_sock = cashsvr_connect();
+			if (cashctl_sock < 0) {
+				ret = cashctl_sock;
+				break;
+			}
+		}
+
+		ret = cashsvr_xfer(cashctl_sock, &params, cash_resp, NULL);
+		if (ret > 0)
+			break;
+
+		/*
+		 * Whatever went wrong, this connection cannot be trusted
+		 * anymore: a late reply would be mistaken for the answer
+		 * to the next request. Drop it and, if the server went
+		 * away (i.e. it was restarted), reconnect once.
+		 */
+		close(cashctl_sock);
+		cashctl_sock = -1;
+		if (ret != -EPIPE)
+			break;
+	}
+	pthread_mutex_unlock(&cashctl_lock);
+
+end:
+	/* The server is still setting the needed sensors up */
+	if (ret > 0 && cash_resp->unready_mask)
+		return -EAGAIN;
+
+	return ret;
+}
+
+/*
+ * cash_session_open - Enables the persistent session mode: all the
+ *		       following requests will share one connection
+ *		       to the CASH Server, which gets transparently
+ *		       re-established if the server restarts.
+ *
+ * \return Returns zero or negative errno if the server cannot be
+ *	   reached yet. The session mode stays enabled anyway.
+ */
+int cash_session_open(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&cashctl_lock);
+	cashctl_session = true;
+	if (cashctl_sock < 0) {
+		cashctl_sock = cashsvr_connect();
+		if (cashctl_sock < 0)
+			ret = cashctl_sock;
+	}
+	pthread_mutex_unlock(&cashctl_lock);
+
 	return ret;
 }
 
+/*
+ * cash_session_close - Closes the persistent connection and goes back
+ *			to one connection per request.
+ */
+void cash_session_close(void)
+{
+	pthread_mutex_lock(&cashctl_lock);
+	cashctl_session = false;
+	if (cashctl_sock >= 0) {
+		close(cashctl_sock);
+		cashctl_sock = -1;
+	}
+	pthread_mutex_unlock(&cashctl_lock);
+}
+
 static int32_t cashsvr_send_set(int operation, int value, struct cash_response *cash_resp)
 {
 	struct cash_params params;
 
+	memset(&params, 0, sizeof(struct cash_params));
 	params.operation = operation;
 	params.value = (int32_t)value;
 
@@ -184,4 +349,481 @@ struct exptime_iso_tpl cash_get_exptime_iso(void)
 	return exptime_iso;
 }
 
+static void cash_response_to_snapshot(struct cash_response *cash_resp,
+				      struct cash_snapshot *snap)
+{
+	snap->focus_step = cash_resp->focus_step;
+	snap->exptime = cash_resp->exptime;
+	snap->iso = cash_resp->iso;
+	snap->tof_in_range = cash_resp->tof_in_range;
+	snap->rgbc_in_range = cash_resp->rgbc_in_range;
+}
+
+int cash_get_snapshot(struct cash_snapshot *snap)
+{
+	int rc;
+	struct cash_response cash_resp;
+
+	snap->focus_step = -1;
+	snap->exptime = -1;
+	snap->iso = -1;
+	snap->tof_in_range = 0;
+	snap->rgbc_in_range = 0;
+
+	rc = cashsvr_send_set(OP_SNAPSHOT_GET, 0, &cash_resp);
+	if (rc <= 0)
+		return rc ? rc : -EIO;
+
+	cash_response_to_snapshot(&cash_resp, snap);
+
+	return 0;
+}
+
+/*
+ * cash_wait_ready - Waits for sensors to give their first readings out
+ *		     after being started. The server keeps serving the
+ *		     other clients meanwhile.
+ *
+ * \param sensors - CASH_SUBSCRIBE_TOF and/or CASH_SUBSCRIBE_RGBC
+ * \param timeout_ms - How long to wait at most, zero to just check.
+ *		       Capped to CASH_WAIT_READY_MAX_MS.
+ *
+ * \return Returns the mask of the sensors that are ready, which are
+ *	   all of the requested ones unless it timed out, or negative
+ *	   errno.
+ */
+int cash_wait_ready(int sensors, int timeout_ms)
+{
+	int rc;
+	struct cash_params params;
+	struct cash_response cash_resp;
+
+	if (!(sensors & (CASH_SUBSCRIBE_TOF | CASH_SUBSCRIBE_RGBC)) ||
+	    timeout_ms < 0)
+		return -EINVAL;
+
+	memset(&params, 0, sizeof(struct cash_params));
+	params.operation = OP_WAIT_READY;
+	params.value = sensors;
+	params.timeout_ms = timeout_ms;
+
+	rc = send_cashsvr_data(params, &cash_resp);
+	if (rc <= 0)
+		return rc ? rc : -EIO;
+
+	return cash_resp.ready_mask;
+}
+
+/*
+ * cash_get_stats - Gets the sensors power management counters, to
+ *		    measure idle power and first sample latency.
+ *
+ * \return Returns zero or negative errno.
+ */
+int cash_get_stats(struct cash_stats *stats)
+{
+	int rc;
+	struct cash_params params;
+	struct cash_response cash_resp;
+
+	memset(&params, 0, sizeof(struct cash_params));
+	params.operation = OP_STATS;
+
+	rc = send_cashsvr_data(params, &cash_resp);
+	if (rc <= 0)
+		return rc ? rc : -EIO;
+
+	*stats = cash_resp.stats;
+	return 0;
+}
+
+/*
+ * cash_get_focus_at - Gets the focus step for the range that the
+ *		       subject is expected to be at, at a given time:
+ *		       for instance the exposure start of the next
+ *		       frame plus the lens settle time.
+ *
+ * \param timestamp_ns - Time to predict the range at
+ * \param clock_id - CASH_CLOCK_MONOTONIC or CASH_CLOCK_BOOTTIME
+ *
+ * \return Returns zero or negative errno.
+ */
+int cash_get_focus_at(int64_t timestamp_ns, int clock_id,
+		      struct cash_focus_prediction *pred)
+{
+	int rc;
+	struct cash_params params;
+	struct cash_response cash_resp;
+
+	if (timestamp_ns == 0)
+		return -EINVAL;
+
+	if (clock_id != CASH_CLOCK_MONOTONIC &&
+	    clock_id != CASH_CLOCK_BOOTTIME)
+		return -EINVAL;
+
+	memset(&params, 0, sizeof(struct cash_params));
+	params.operation = OP_FOCUS_GET;
+	params.timestamp_ns = timestamp_ns;
+	params.clock_id = clock_id;
+
+	rc = send_cashsvr_data(params, &cash_resp);
+	if (rc <= 0)
+		return rc ? rc : -EIO;
+
+	if (cash_resp.range_mm < 0)
+		return -ENODATA;
+
+	pred->focus_step = cash_resp.focus_step;
+	pred->range_mm = cash_resp.range_mm;
+	pred->speed_mm_s = cash_resp.speed_mm_s;
+	pred->timestamp_ns = cash_resp.tof_timestamp_ns;
+
+	return 0;
+}
+
+/*
+ * cash_get_focus_roi - Gets the focus step for a region of the field of
+ *			view, such as a face or a tap to focus area.
+ *
+ * \param roi - Region, as fractions of the field of view, or NULL for
+ *		all of it
+ *
+ * \return Returns zero or negative errno.
+ */
+int cash_get_focus_roi(const struct cash_roi *roi, struct cash_focus_roi *focus)
+{
+	int rc;
+	struct cash_params params;
+	struct cash_response cash_resp;
+
+	memset(&params, 0, sizeof(struct cash_params));
+	params.operation = OP_FOCUS_ROI_GET;
+	if (roi != NULL)
+		params.roi = *roi;
+
+	rc = send_cashsvr_data(params, &cash_resp);
+	if (rc <= 0)
+		return rc ? rc : -EIO;
+
+	if (cash_resp.range_mm < 0)
+		return -ENODATA;
+
+	focus->focus_step = cash_resp.focus_step;
+	focus->range_mm = cash_resp.range_mm;
+	focus->zones = cash_resp.zones;
+	focus->timestamp_ns = cash_resp.tof_timestamp_ns;
+
+	return 0;
+}
+
+/*
+ * cash_get_color - Gets lux, color temperature and white balance gains
+ *		    out of the RGBC-IR sensor.
+ *
+ * \return Returns zero, -ENODATA if there is no reading or
+ *	   negative errno.
+ */
+int cash_get_color(struct cash_color *color)
+{
+	int rc;
+	struct cash_params params;
+	struct cash_response cash_resp;
+
+	memset(&params, 0, sizeof(struct cash_params));
+	params.operation = OP_COLOR_GET;
+
+	rc = send_cashsvr_data(params, &cash_resp);
+	if (rc <= 0)
+		return rc ? rc : -EIO;
+
+	if (!cash_resp.retval)
+		return -ENODATA;
+
+	*color = cash_resp.color;
+
+	return 0;
+}
+
+/*
+ * cash_get_flicker - Gets the light flicker found by the RGBC sensor,
+ *		      for anti-banding. The flicker detection has to be
+ *		      enabled through persist.vendor.cash.rgbc.flicker_ms.
+ *
+ * \return Returns zero, -ENODATA if there is no outcome yet or
+ *	   negative errno.
+ */
+int cash_get_flicker(struct cash_flicker *flicker)
+{
+	int rc;
+	struct cash_params params;
+	struct cash_response cash_resp;
+
+	memset(&params, 0, sizeof(struct cash_params));
+	params.operation = OP_FLICKER_GET;
+
+	rc = send_cashsvr_data(params, &cash_resp);
+	if (rc <= 0)
+		return rc ? rc : -EIO;
+
+	if (!cash_resp.retval)
+		return -ENODATA;
+
+	*flicker = cash_resp.flicker;
+
+	return 0;
+}
+
+/*
+ * cash_get_sample_at - Gets the readings taken at a given time, for
+ *			instance when a camera frame got exposed, and
+ *			what they translate to.
+ *
+ * \param timestamp_ns - Time of the wanted readings
+ * \param clock_id - CASH_CLOCK_MONOTONIC or CASH_CLOCK_BOOTTIME
+ * \param mode - CASH_SAMPLE_NEAREST or CASH_SAMPLE_INTERPOLATE
+ *
+ * \return Returns zero, -ENODATA if no sensor had readings for that
+ *	   time or negative errno.
+ */
+int cash_get_sample_at(int64_t timestamp_ns, int clock_id, int mode,
+		       struct cash_sample_at *sample)
+{
+	int rc;
+	struct cash_params params;
+	struct cash_response cash_resp;
+
+	if (clock_id != CASH_CLOCK_MONOTONIC &&
+	    clock_id != CASH_CLOCK_BOOTTIME)
+		return -EINVAL;
+
+	if (mode != CASH_SAMPLE_NEAREST && mode != CASH_SAMPLE_INTERPOLATE)
+		return -EINVAL;
+
+	memset(&params, 0, sizeof(struct cash_params));
+	params.operation = OP_SAMPLE_AT;
+	params.value = mode;
+	params.timestamp_ns = timestamp_ns;
+	params.clock_id = clock_id;
+
+	rc = send_cashsvr_data(params, &cash_resp);
+	if (rc <= 0)
+		return rc ? rc : -EIO;
+
+	cash_response_to_snapshot(&cash_resp, &sample->snap);
+	sample->range_mm = cash_resp.range_mm;
+	sample->clear = cash_resp.clear;
+	sample->tof_timestamp_ns = cash_resp.tof_timestamp_ns;
+	sample->rgbc_timestamp_ns = cash_resp.rgbc_timestamp_ns;
+
+	if (sample->range_mm < 0 && sample->clear < 0)
+		return -ENODATA;
+
+	return 0;
+}
+
+/*
+ * cash_subscribe - Opens a dedicated connection on which the CASH
+ *		    Server pushes new readings as soon as they come.
+ *
+ * \param sensors - CASH_SUBSCRIBE_TOF and/or CASH_SUBSCRIBE_RGBC
+ * \param focus_delta - Minimum focus step change worth a push
+ * \param iso_delta - Minimum ISO change worth a push
+ *
+ * Zero deltas mean that every new sample gets pushed.
+ *
+ * \return Returns a non-blocking fd to poll for POLLIN and to read
+ *	   with cash_subscription_read(), or negative errno.
+ */
+int cash_subscribe(int sensors, int32_t focus_delta, int32_t iso_delta)
+{
+	int sock, ret;
+	struct cash_params params;
+	struct cash_response cash_resp;
+
+	if (!(sensors & (CASH_SUBSCRIBE_TOF | CASH_SUBSCRIBE_RGBC)))
+		return -EINVAL;
+
+	sock = cashsvr_connect();
+	if (sock < 0)
+		return sock;
+
+	memset(&params, 0, sizeof(struct cash_params));
+	params.operation = OP_SUBSCRIBE;
+	params.value = sensors;
+	params.focus_delta = focus_delta;
+	params.iso_delta = iso_delta;
 
+	ret = cashsvr_xfer(sock, &params, &cash_resp, NULL);
+	if (ret <= 0) {
+		close(sock);
+		return ret ? ret : -EIO;
+	}
+
+	return sock;
+}
+
+/*
+ * cash_subscription_read - Gets the next pushed reading.
+ *
+ * \return Returns zero, -EAGAIN if nothing was pushed yet, -EPIPE if
+ *	   the server went away or another negative errno.
+ */
+int cash_subscription_read(int fd, struct cash_snapshot *snap)
+{
+	int ret;
+	struct cash_response cash_resp;
+
+	ret = recv(fd, &cash_resp, sizeof(struct cash_response), 0);
+	if (ret == 0)
+		return -EPIPE;
+	if (ret < 0)
+		return -errno;
+	if (ret != sizeof(struct cash_response))
+		return -EINVAL;
+
+	cash_response_to_snapshot(&cash_resp, snap);
+
+	return 0;
+}
+
+void cash_unsubscribe(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+static inline int64_t cashctl_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * cashctl_shm_map - Gets the snapshot descriptor from the server and
+ *		     maps it. Must be called with cashctl_lock held.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cashctl_shm_map(void)
+{
+	int sock, fd, ret;
+	struct cash_params params;
+	struct cash_response cash_resp;
+	struct cash_shm_snapshot *shm;
+
+	sock = cashsvr_connect();
+	if (sock < 0)
+		return sock;
+
+	memset(&params, 0, sizeof(struct cash_params));
+	params.operation = OP_SHM_GET;
+
+	ret = cashsvr_xfer(sock, &params, &cash_resp, &fd);
+	close(sock);
+	if (ret <= 0)
+		return ret ? ret : -EIO;
+	if (fd < 0)
+		return -ENODEV;
+
+	shm = mmap(NULL, sizeof(struct cash_shm_snapshot), PROT_READ,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return -ENOMEM;
+
+	if (shm->version != CASH_SHM_VERSION) {
+		ALOGE("Unsupported snapshot version %u", shm->version);
+		munmap(shm, sizeof(struct cash_shm_snapshot));
+		return -EPROTO;
+	}
+
+	atomic_store(&cashctl_shm, shm);
+	return 0;
+}
+
+/*
+ * cashctl_shm_get - Gets the snapshot mapping, trying to (re)map it
+ *		     at most once per CASH_SHM_STALE_NS.
+ */
+static const struct cash_shm_snapshot *cashctl_shm_get(bool remap)
+{
+	const struct cash_shm_snapshot *shm = atomic_load(&cashctl_shm);
+	int64_t now;
+
+	if (shm != NULL && !remap)
+		return shm;
+
+	pthread_mutex_lock(&cashctl_lock);
+	now = cashctl_now_ns();
+	if (now >= cashctl_shm_retry_ns) {
+		cashctl_shm_retry_ns = now + CASH_SHM_STALE_NS;
+		if (remap)
+			atomic_store(&cashctl_shm, NULL);
+		cashctl_shm_map();
+	}
+	pthread_mutex_unlock(&cashctl_lock);
+
+	return atomic_load(&cashctl_shm);
+}
+
+static int cashctl_shm_read(const struct cash_shm_snapshot *shm,
+			    struct cash_shm_data *data)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < CASH_SHM_READ_TRIES; i++) {
+		seq = cash_seqlock_read_begin(&shm->lock);
+		memcpy(data, (const void*)&shm->data,
+		       sizeof(struct cash_shm_data));
+		if (!cash_seqlock_read_retry(&shm->lock, seq))
+			return 0;
+	}
+
+	return -EBUSY;
+}
+
+/*
+ * cash_get_snapshot_shm - Same as cash_get_snapshot(), but reads the
+ *			   shared memory snapshot published by the
+ *			   server: no syscalls are involved, unless the
+ *			   readings are unavailable or stale, in which
+ *			   case this falls back to the socket.
+ *
+ * \return Returns zero or negative errno.
+ */
+int cash_get_snapshot_shm(struct cash_snapshot *snap)
+{
+	const struct cash_shm_snapshot *shm;
+	struct cash_shm_data data;
+	bool tof_ok, rgbc_ok;
+	int64_t now;
+
+	shm = cashctl_shm_get(false);
+	if (shm == NULL || cashctl_shm_read(shm, &data) < 0)
+		return cash_get_snapshot(snap);
+
+	now = cashctl_now_ns();
+	tof_ok = data.tof_timestamp_ns &&
+		 now - data.tof_timestamp_ns < CASH_SHM_STALE_NS;
+	rgbc_ok = data.rgbc_timestamp_ns &&
+		  now - data.rgbc_timestamp_ns < CASH_SHM_STALE_NS;
+
+	if (!tof_ok && !rgbc_ok) {
+		/* Nothing fresh: if the server got restarted, remap */
+		if (kill(shm->owner_pid, 0) < 0 && errno == ESRCH)
+			cashctl_shm_get(true);
+		return cash_get_snapshot(snap);
+	}
+
+	snap->focus_step = tof_ok ? data.focus_step : -1;
+	snap->tof_in_range = tof_ok ? data.tof_in_range : 0;
+	snap->exptime = rgbc_ok ? data.exptime : -1;
+	snap->iso = rgbc_ok ? data.iso : -1;
+	snap->rgbc_in_range = rgbc_ok ? data.rgbc_in_range : 0;
+
+	return 0;
+}
@@ -19,43 +19,516 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <time.h>
 #include <log/log.h>
 
 #include "cash_input_common.h"
 
+/* New samples notification, consumed by the server event loop */
+static int cash_notify_fd = -1;
+static atomic_bool cash_notify_armed;
+static atomic_uint cash_notify_mask;
 
-/* Start/stop threads */
-int cash_input_threadman(bool start, struct thread_data *thread_data)
+/* Sensor instances: created once, never destroyed */
+static pthread_mutex_t cash_sensors_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cash_sensor *_Atomic cash_sensors[CASH_SENSOR_MAX];
+
+/* Single threaded mode: sensors are served by the server event loop */
+static cash_input_attach_t cash_reactor_attach;
+
+/* Input fds that have a device behind, as opposed to a vanished one */
+static pthread_mutex_t cash_fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool cash_fd_present[CASH_SENSOR_MAX];
+
+/* Wakeups of every event loop, sensor threads included */
+static atomic_ulong cash_wakeups;
+
+/*
+ * cash_sensor_wake_init - Adds an eventfd to the epoll set of a sensor
+ *			   thread, so that it can be told to stop right
+ *			   away instead of after its poll timeout.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_sensor_wake_init(struct cash_sensor *sns)
+{
+	struct epoll_event evt;
+	int fd;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		ALOGE("Cannot create the wake eventfd");
+		return -errno;
+	}
+
+	evt.events = EPOLLIN;
+	evt.data.fd = fd;
+	if (epoll_ctl(sns->epfd, EPOLL_CTL_ADD, fd, &evt) < 0) {
+		ALOGE("Cannot add the wake eventfd");
+		close(fd);
+		return -errno;
+	}
+
+	sns->wake_fd = fd;
+
+	return 0;
+}
+
+/*
+ * cash_sensor_create - Creates an instance of a sensor backend, with
+ *			the state of its type layer and its own one.
+ *
+ * \return Returns the instance, or NULL if there's no room left.
+ */
+struct cash_sensor *cash_sensor_create(const struct cash_sensor_class *cls,
+				       const struct cash_sensor_ops *ops)
+{
+	struct cash_sensor *sns = NULL;
+	int id;
+
+	pthread_mutex_lock(&cash_sensors_lock);
+	for (id = 0; id < CASH_SENSOR_MAX; id++)
+		if (atomic_load(&cash_sensors[id]) == NULL)
+			break;
+	if (id == CASH_SENSOR_MAX) {
+		ALOGE("Too many sensors: cannot add a %s", ops->name);
+		goto end;
+	}
+
+	sns = calloc(1, sizeof(*sns));
+	if (sns == NULL)
+		goto err_mem;
+
+	sns->id = id;
+	sns->cls = cls;
+	sns->ops = ops;
+	sns->fd = -1;
+	sns->evtno = -1;
+	sns->epfd = -1;
+	sns->wake_fd = -1;
+	sns->poll_ms = 1000;
+
+	sns->ctx = calloc(1, cls->ctx_size);
+	sns->priv = ops->priv_size ? calloc(1, ops->priv_size) : NULL;
+	if (sns->ctx == NULL || (ops->priv_size && sns->priv == NULL))
+		goto err_mem;
+
+	sns->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sns->epfd < 0) {
+		ALOGE("Error: Cannot create epoll descriptor");
+		goto err;
+	}
+
+	if (cash_sensor_wake_init(sns) < 0)
+		ALOGW("%s thread will stop after its poll timeout only",
+			ops->name);
+
+	if (cls->init != NULL && cls->init(sns) < 0)
+		goto err;
+
+	/* Fully set up: anyone can look it up from now on */
+	atomic_store(&cash_sensors[id], sns);
+	goto end;
+
+err_mem:
+	ALOGE("Memory exhausted. Cannot allocate.");
+err:
+	if (sns != NULL) {
+		if (sns->wake_fd >= 0)
+			close(sns->wake_fd);
+		if (sns->epfd >= 0)
+			close(sns->epfd);
+		free(sns->ctx);
+		free(sns->priv);
+		free(sns);
+		sns = NULL;
+	}
+end:
+	pthread_mutex_unlock(&cash_sensors_lock);
+	return sns;
+}
+
+struct cash_sensor *cash_sensor_at(int id)
+{
+	if (id < 0 || id >= CASH_SENSOR_MAX)
+		return NULL;
+
+	return atomic_load(&cash_sensors[id]);
+}
+
+/*
+ * cash_sensor_get - Gets the sensor the server uses for a type: the
+ *		     first one found. Devices coming back get their old
+ *		     instance back, so that it doesn't change.
+ *
+ * \return Returns the instance, or NULL if none was ever found.
+ */
+struct cash_sensor *cash_sensor_get(enum cash_sensor_type type)
+{
+	struct cash_sensor *sns;
+	int id;
+
+	for (id = 0; id < CASH_SENSOR_MAX; id++) {
+		sns = atomic_load(&cash_sensors[id]);
+		if (sns != NULL && sns->cls->type == type)
+			return sns;
+	}
+
+	return NULL;
+}
+
+static bool cash_sensor_is_wake(struct cash_sensor *sns, int fd)
+{
+	eventfd_t cnt;
+
+	if (fd < 0 || fd != sns->wake_fd)
+		return false;
+
+	eventfd_read(fd, &cnt);
+
+	return true;
+}
+
+static void *cash_sensor_thread(void *arg)
+{
+	struct cash_sensor *sns = arg;
+	struct epoll_event pevt[10];
+	int ret, i;
+
+	sns->cls->power(sns, true);
+
+	ALOGD("%s thread started", sns->ops->name);
+
+	while (sns->run) {
+		ret = epoll_wait(sns->epfd, pevt, 10, sns->poll_ms);
+		cash_input_count_wakeup();
+		for (i = 0; i < ret; i++) {
+			if (pevt[i].events & EPOLLERR ||
+			    pevt[i].events & EPOLLHUP ||
+			    !(pevt[i].events & EPOLLIN))
+				continue;
+
+			if (cash_sensor_is_wake(sns, pevt[i].data.fd))
+				continue;
+
+			sns->cls->process(sns);
+		}
+	}
+
+	sns->cls->power(sns, false);
+
+	return NULL;
+}
+
+/*
+ * cash_input_reactor_man - Starts or stops a sensor in the single
+ *			    threaded mode: it gets powered and its input
+ *			    fd gets handed over to the server event loop.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_input_reactor_man(struct cash_sensor *sns, bool start)
 {
-	int ret = -1;
-	int thread_no = thread_data->thread_no;
+	int rc = 0;
 
 	if (start == false) {
-		static void *join_retval;  // Unused
+		if (!sns->run)
+			return 0;
+
+		pthread_mutex_lock(&cash_fd_lock);
+		sns->run = false;
+		if (cash_fd_present[sns->id])
+			cash_reactor_attach(sns->id, sns->fd, false);
+		pthread_mutex_unlock(&cash_fd_lock);
+		sns->cls->power(sns, false);
+		return 0;
+	}
+
+	if (sns->run)
+		return 0;
+
+	sns->run = true;
+	sns->cls->power(sns, true);
+
+	/* A vanished device gets added when it comes back */
+	pthread_mutex_lock(&cash_fd_lock);
+	if (cash_fd_present[sns->id])
+		rc = cash_reactor_attach(sns->id, sns->fd, true);
+	pthread_mutex_unlock(&cash_fd_lock);
+	if (rc < 0) {
+		ALOGE("Cannot add sensor %d to the event loop", sns->id);
+		sns->run = false;
+		sns->cls->power(sns, false);
+		return rc;
+	}
+
+	return 0;
+}
+
+/*
+ * cash_sensor_start - Starts or stops a sensor: its thread powers it up
+ *		       and serves it until stopped, or the server event
+ *		       loop does in the single threaded mode.
+ *
+ * \return Returns zero or negative errno.
+ */
+int cash_sensor_start(struct cash_sensor *sns, bool start)
+{
+	int ret;
+
+	if (cash_reactor_attach != NULL)
+		return cash_input_reactor_man(sns, start);
+
+	if (start == false) {
+		/* Nothing to stop, and it cannot be joined twice */
+		if (!sns->run)
+			return 0;
+
 		/* Instruct thread to stop: */
-		cash_thread_run[thread_no] = false;
+		sns->run = false;
+		if (sns->wake_fd >= 0)
+			eventfd_write(sns->wake_fd, 1);
 		/* Wait until thread really exits: */
-		pthread_join(cash_pthreads[thread_no], join_retval);
+		pthread_join(sns->thread, NULL);
 		return 0;
 	};
 
-	cash_thread_run[thread_no] = true;
+	/* Already running: one thread per sensor is plenty */
+	if (sns->run)
+		return 0;
 
-	if (thread_no < THREAD_MAX) {
-		ret = pthread_create(&cash_pthreads[thread_no], NULL,
-				thread_data->thread_func, NULL);
-		if (ret != 0) {
-			ALOGE("Cannot create thread with number %d", thread_no);
-			return -ENXIO;
-		}
+	sns->run = true;
+
+	ret = pthread_create(&sns->thread, NULL, cash_sensor_thread, sns);
+	if (ret != 0) {
+		ALOGE("Cannot create the thread of sensor %d", sns->id);
+		sns->run = false;
+		return -ENXIO;
+	}
+
+	return 0;
+}
+
+/*
+ * cash_sensor_start_type - Starts or stops all the sensors of a type.
+ *
+ * \return Returns zero, -ENODEV if none was ever found, or the first
+ *	   negative errno.
+ */
+int cash_sensor_start_type(enum cash_sensor_type type, bool start)
+{
+	struct cash_sensor *sns;
+	int id, rc, ret = -ENODEV;
+
+	for (id = 0; id < CASH_SENSOR_MAX; id++) {
+		sns = cash_sensor_at(id);
+		if (sns == NULL || sns->cls->type != type)
+			continue;
+
+		rc = cash_sensor_start(sns, start);
+		if (ret == -ENODEV || (ret == 0 && rc < 0))
+			ret = rc;
 	}
 
 	return ret;
 }
 
+/*
+ * cash_input_reactor_init - Switches to the single threaded mode: no
+ *			     sensor threads get started anymore, their
+ *			     input fds are served by the server event
+ *			     loop instead, through attach.
+ */
+void cash_input_reactor_init(cash_input_attach_t attach)
+{
+	cash_reactor_attach = attach;
+}
+
+/*
+ * cash_input_reactor_process - Single threaded mode: handles the input
+ *				events of a sensor, like its thread would.
+ */
+void cash_input_reactor_process(int id)
+{
+	struct cash_sensor *sns = cash_sensor_at(id);
+
+	if (sns != NULL && sns->run)
+		sns->cls->process(sns);
+}
+
+/*
+ * cash_input_count_wakeup - Accounts for an event loop wakeup.
+ */
+void cash_input_count_wakeup(void)
+{
+	atomic_fetch_add_explicit(&cash_wakeups, 1, memory_order_relaxed);
+}
+
+unsigned long cash_input_wakeups(void)
+{
+	return atomic_load_explicit(&cash_wakeups, memory_order_relaxed);
+}
+
+/*
+ * cash_input_notify_init - Creates the eventfd used to signal that
+ *			    new sensor samples are available.
+ *
+ * \return Returns the eventfd to poll on or negative errno.
+ */
+int cash_input_notify_init(void)
+{
+	if (cash_notify_fd >= 0)
+		return cash_notify_fd;
+
+	cash_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cash_notify_fd < 0) {
+		ALOGE("Cannot create the notification eventfd");
+		return -errno;
+	}
+
+	return cash_notify_fd;
+}
+
+/*
+ * cash_input_notify_arm - Enables or disables the notifications.
+ *			   Nobody gets woken up when nobody listens.
+ */
+void cash_input_notify_arm(bool arm)
+{
+	atomic_store(&cash_notify_armed, arm);
+}
+
+/*
+ * cash_input_notify - Signals that a sensor of the given type produced
+ *		       a new sample.
+ */
+void cash_input_notify(enum cash_sensor_type type)
+{
+	if (!atomic_load(&cash_notify_armed) || cash_notify_fd < 0)
+		return;
+
+	atomic_fetch_or(&cash_notify_mask, 1 << type);
+	eventfd_write(cash_notify_fd, 1);
+}
+
+/*
+ * cash_input_notify_ready - Signals the first sample after a power up.
+ *			     This one is never filtered out by the arm
+ *			     state: the server times the power up on it.
+ */
+void cash_input_notify_ready(enum cash_sensor_type type)
+{
+	if (cash_notify_fd < 0)
+		return;
+
+	atomic_fetch_or(&cash_notify_mask, 1 << type);
+	eventfd_write(cash_notify_fd, 1);
+}
+
+/*
+ * cash_input_notify_consume - Acknowledges the notification.
+ *
+ * \return Returns the mask (1 << cash_sensor_type) of the sensors that
+ *	   produced new samples since the last call.
+ */
+unsigned int cash_input_notify_consume(void)
+{
+	eventfd_t cnt;
+
+	eventfd_read(cash_notify_fd, &cnt);
+
+	return atomic_exchange(&cash_notify_mask, 0);
+}
+
+/*
+ * cash_input_fd_attach - Makes the input fd of a sensor refer to a newly
+ *			  opened device, then polls it in the sensor
+ *			  thread or, if started in the single threaded
+ *			  mode, in the server event loop.
+ *			  The fd number is kept across devices, so that
+ *			  whoever reads it never gets a stale one.
+ *
+ * \param fd - Device just opened, consumed in any case
+ *
+ * \return Returns zero or negative errno.
+ */
+int cash_input_fd_attach(struct cash_sensor *sns, int fd)
+{
+	struct epoll_event evt;
+	int rc = 0;
+
+	pthread_mutex_lock(&cash_fd_lock);
+
+	/* The old device leaves every epoll set along with its file */
+	if (sns->fd >= 0) {
+		if (dup2(fd, sns->fd) < 0)
+			rc = -errno;
+		close(fd);
+		if (rc < 0)
+			goto end;
+	} else {
+		sns->fd = fd;
+	}
+
+	evt.events = EPOLLIN;
+	evt.data.fd = sns->fd;
+	if (epoll_ctl(sns->epfd, EPOLL_CTL_ADD, sns->fd, &evt) < 0) {
+		ALOGE("Cannot add epoll control");
+		rc = -errno;
+		goto end;
+	}
+	cash_fd_present[sns->id] = true;
+
+	if (cash_reactor_attach != NULL && sns->run)
+		rc = cash_reactor_attach(sns->id, sns->fd, true);
+end:
+	pthread_mutex_unlock(&cash_fd_lock);
+	return rc;
+}
+
+/*
+ * cash_input_fd_detach - Stops polling the input fd of a sensor whose
+ *			  device went away, as it would hang up forever.
+ *			  The fd is kept open, for its number not to be
+ *			  reused under the feet of its readers.
+ */
+void cash_input_fd_detach(struct cash_sensor *sns)
+{
+	pthread_mutex_lock(&cash_fd_lock);
+	if (cash_fd_present[sns->id]) {
+		epoll_ctl(sns->epfd, EPOLL_CTL_DEL, sns->fd, NULL);
+		if (cash_reactor_attach != NULL && sns->run)
+			cash_reactor_attach(sns->id, sns->fd, false);
+		cash_fd_present[sns->id] = false;
+	}
+	pthread_mutex_unlock(&cash_fd_lock);
+}
+
+/*
+ * cash_input_set_clock - Makes the input device timestamp its events
+ *			  with CLOCK_MONOTONIC instead of the default
+ *			  CLOCK_REALTIME, which may jump.
+ */
+int cash_input_set_clock(int fd)
+{
+	int clk = CLOCK_MONOTONIC;
+
+	if (ioctl(fd, EVIOCSCLOCKID, &clk) < 0) {
+		ALOGW("Cannot set the input clock: timestamps may jump");
+		return -errno;
+	}
+
+	return 0;
+}
+
 int cash_set_parameter(char* path, char* value, int value_len) {
 	int fd, rc;
 
@@ -19,39 +19,154 @@
  * limitations under the License.
  */
 
+#ifndef CASH_INPUT_COMMON_H
+#define CASH_INPUT_COMMON_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/poll.h>
 #include <sys/epoll.h>
+#include <linux/input.h>
+
+#define CASH_INPUT_NAME_MAX	80
+
+/* Sensor instances, all types together */
+#define CASH_SENSOR_MAX		8
+
+/* What the server uses a sensor for */
+enum cash_sensor_type {
+	CASH_SENSOR_TOF,
+	CASH_SENSOR_RGBC,
+	CASH_SENSOR_TYPE_MAX
+};
 
-#define ITERATE_MAX_DEVS	9
+/* Input device, as found in /dev/input */
+struct cash_input_dev {
+	int evtno;
+	char name[CASH_INPUT_NAME_MAX];
+	struct input_id id;
+	/* sysfs directory of the input device, holding its attributes */
+	char sysfs[PATH_MAX];
+};
 
-enum thread_number {
-	THREAD_TOF,
-	THREAD_RGBC,
-	THREAD_MAX
+/* Input device a sensor backend can drive */
+struct cash_input_id {
+	const char *name;
+	/* Zero matches any */
+	uint16_t vendor;
+	uint16_t product;
 };
 
+struct cash_sensor;
+struct cash_tamisc_calib_params;
+
+/*
+ * Sensor backend: drives one family of sensors, turning the events of
+ * their input devices into the samples of their type.
+ */
+struct cash_sensor_ops {
+	const char *name;
+	enum cash_sensor_type type;
+	/* Terminated by an entry without name */
+	const struct cash_input_id *ids;
+	/* Size of the per instance state, found at priv */
+	size_t priv_size;
+	/* Sets a device up, when found and whenever it comes back */
+	int (*probe)(struct cash_sensor *sns, const struct cash_input_dev *dev);
+	/* Applies the factory calibration, if any: optional */
+	int (*calibrate)(struct cash_sensor *sns,
+			 const struct cash_tamisc_calib_params *calib);
+	int (*enable)(struct cash_sensor *sns, bool enable);
+	/*
+	 * Sets the analog gain and integration time of the next samples,
+	 * rounded down to what the sensor has: optional.
+	 */
+	int (*set_integration)(struct cash_sensor *sns, int again,
+			       int itime_us);
+	/*
+	 * Reads the pending input events into the sample being put
+	 * together, of the type of the sensor.
+	 * Returns 1 once it's complete, zero if not yet, or negative errno.
+	 */
+	int (*decode)(struct cash_sensor *sns, void *sample);
+};
 
-enum fd_number {
-	FD_TOF,
-	FD_RGBC,
-	FD_MAX
+/*
+ * Sensor type layer: whatever all the sensors of a type have in common
+ * on top of their backends, such as the ranging filters.
+ */
+struct cash_sensor_class {
+	enum cash_sensor_type type;
+	/* NULL terminated */
+	const struct cash_sensor_ops *const *backends;
+	/* Size of the per instance state, found at ctx */
+	size_t ctx_size;
+	int (*init)(struct cash_sensor *sns);
+	/* Powers the sensor up or down through its backend */
+	int (*power)(struct cash_sensor *sns, bool enable);
+	/* Handles the pending input events */
+	void (*process)(struct cash_sensor *sns);
 };
 
-struct thread_data {
-	enum thread_number thread_no;
-	void *thread_func;
+/*
+ * Sensor instance: one per device, kept while the device comes and
+ * goes, for it to find its state back.
+ */
+struct cash_sensor {
+	int id;
+	const struct cash_sensor_class *cls;
+	const struct cash_sensor_ops *ops;
+	/* Same fd number whatever device is behind, -1 for none yet */
+	int fd;
+	/* Attached device, -1 for none: protected by the discovery */
+	int evtno;
+	/* Powered up, as far as the type layer is concerned */
+	bool enabled;
+	/* Own thread, unless served by the server event loop */
+	bool run;
+	pthread_t thread;
+	int epfd;
+	int wake_fd;
+	int poll_ms;
+	void *ctx;
+	void *priv;
 };
 
-bool cash_thread_run[THREAD_MAX];
-pthread_t cash_pthreads[THREAD_MAX];
-struct pollfd cash_pfds[FD_MAX];
-struct epoll_event cash_pollevt[FD_MAX];
-int cash_pollfd[FD_MAX];
-int cash_pfdelay_ms[FD_MAX];
+/* Adds (or removes) a sensor input fd to the server event loop */
+typedef int (*cash_input_attach_t)(int id, int fd, bool attach);
 
-static const char sysfs_input_str[] = "/sys/class/input/input";
+static const char sysfs_input_str[] = "/sys/class/input/event";
 static const char devfs_input_str[] = "/dev/input/event";
 
-int cash_input_threadman(bool start, struct thread_data *thread_data);
+/* Sample timestamps are CLOCK_MONOTONIC nanoseconds */
+#define CASH_EVT_TIME_NS(evt)	((int64_t)(evt).input_event_sec * 1000000000LL + \
+				 (int64_t)(evt).input_event_usec * 1000LL)
+
+struct cash_sensor *cash_sensor_create(const struct cash_sensor_class *cls,
+				       const struct cash_sensor_ops *ops);
+struct cash_sensor *cash_sensor_get(enum cash_sensor_type type);
+struct cash_sensor *cash_sensor_at(int id);
+int cash_sensor_start(struct cash_sensor *sns, bool start);
+int cash_sensor_start_type(enum cash_sensor_type type, bool start);
+void cash_input_reactor_init(cash_input_attach_t attach);
+void cash_input_reactor_process(int id);
+void cash_input_count_wakeup(void);
+unsigned long cash_input_wakeups(void);
+int cash_input_set_clock(int fd);
+int cash_input_fd_attach(struct cash_sensor *sns, int fd);
+void cash_input_fd_detach(struct cash_sensor *sns);
+int cash_input_discovery_init(void);
+int cash_input_discover(const struct cash_sensor_class *cls,
+			const struct cash_tamisc_calib_params *calib);
+int cash_input_notify_init(void);
+void cash_input_notify_arm(bool arm);
+void cash_input_notify(enum cash_sensor_type type);
+void cash_input_notify_ready(enum cash_sensor_type type);
+unsigned int cash_input_notify_consume(void);
 int cash_set_parameter(char* path, char* value, int value_len);
 int cash_set_permissions(char* fpath, char* str_uid, char* str_gid);
+
+#endif
@@ -0,0 +1,529 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * Input devices discovery and hotplug
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG			"CASH_INPUT"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <cutils/uevent.h>
+#include <log/log.h>
+
+#include "cash_private.h"
+#include "cash_input_common.h"
+
+#define CASH_INPUT_DEVFS_DIR		"/dev/input"
+#define CASH_INPUT_UEVENT_BUFSZ		(256 * 1024)
+#define CASH_INPUT_UEVENT_MSGSZ		2048
+
+/*
+ * The kernel announces a device before ueventd creates its node:
+ * give ueventd some time, polling for the node to show up.
+ */
+#define CASH_INPUT_NODE_WAIT_MS		1000
+#define CASH_INPUT_NODE_POLL_MS		20
+
+/* Input devices found so far, matched or not, by event number */
+static pthread_mutex_t cash_disc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cash_input_dev *cash_disc_devs;
+static int cash_disc_ndevs, cash_disc_alloc;
+
+/* Registered sensor types, with their factory calibration */
+static const struct cash_sensor_class *cash_disc_cls[CASH_SENSOR_TYPE_MAX];
+static struct cash_tamisc_calib_params cash_disc_calib[CASH_SENSOR_TYPE_MAX];
+static bool cash_disc_calib_valid[CASH_SENSOR_TYPE_MAX];
+
+static int cash_uevent_fd = -1;
+
+/*
+ * cash_input_probe - Identifies /dev/input/eventN by name and id, and
+ *		      finds the sysfs directory of its input device.
+ *
+ * \return Returns zero or negative errno, -ENOENT if there's no node.
+ */
+static int cash_input_probe(int evtno, struct cash_input_dev *dev)
+{
+	char path[PATH_MAX];
+	int fd, rc = 0;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->evtno = evtno;
+
+	snprintf(path, sizeof(path), "%s%d", devfs_input_str, evtno);
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (ioctl(fd, EVIOCGNAME(sizeof(dev->name) - 1), dev->name) < 0 ||
+	    ioctl(fd, EVIOCGID, &dev->id) < 0) {
+		rc = -errno;
+		goto end;
+	}
+
+	/* eventN/device links to the inputN holding the attributes */
+	snprintf(path, sizeof(path), "%s%d/device", sysfs_input_str, evtno);
+	if (realpath(path, dev->sysfs) == NULL) {
+		ALOGW("Cannot resolve %s", path);
+		rc = -errno;
+	}
+end:
+	close(fd);
+	return rc;
+}
+
+static bool cash_input_match(const struct cash_input_id *ids,
+			     const struct cash_input_dev *dev)
+{
+	for (; ids->name != NULL; ids++) {
+		if (strcmp(ids->name, dev->name))
+			continue;
+		if (ids->vendor && ids->vendor != dev->id.vendor)
+			continue;
+		if (ids->product && ids->product != dev->id.product)
+			continue;
+		return true;
+	}
+
+	return false;
+}
+
+static int cash_input_dev_find(int evtno)
+{
+	int i;
+
+	for (i = 0; i < cash_disc_ndevs; i++)
+		if (cash_disc_devs[i].evtno == evtno)
+			return i;
+
+	return -1;
+}
+
+/*
+ * cash_input_sensor_attach - Opens a device for a sensor instance and
+ *			      has its backend set it up. A sensor in use
+ *			      gets powered up again. Called with the lock.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_input_sensor_attach(struct cash_sensor *sns,
+				    const struct cash_input_dev *dev)
+{
+	enum cash_sensor_type type = sns->cls->type;
+	char path[PATH_MAX];
+	int fd, rc;
+
+	rc = sns->ops->probe(sns, dev);
+	if (rc < 0)
+		return rc;
+
+	if (sns->ops->calibrate != NULL)
+		sns->ops->calibrate(sns, cash_disc_calib_valid[type] ?
+					 &cash_disc_calib[type] : NULL);
+
+	snprintf(path, sizeof(path), "%s%d", devfs_input_str, dev->evtno);
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		ALOGE("Error: cannot open the %s input device at %s.",
+			dev->name, path);
+		return -errno;
+	}
+	cash_input_set_clock(fd);
+
+	rc = cash_input_fd_attach(sns, fd);
+	if (rc < 0)
+		return rc;
+
+	sns->evtno = dev->evtno;
+
+	if (sns->enabled)
+		sns->ops->enable(sns, true);
+
+	return 0;
+}
+
+/*
+ * cash_input_bind_dev - Attaches a device to the instance of a backend
+ *			 that can drive it, the one that lost its device
+ *			 if any, a new one otherwise. Called with the lock.
+ */
+static void cash_input_bind_dev(const struct cash_input_dev *dev)
+{
+	const struct cash_sensor_class *cls;
+	const struct cash_sensor_ops *ops;
+	struct cash_sensor *sns, *idle, *primary;
+	int t, b, id;
+
+	for (id = 0; id < CASH_SENSOR_MAX; id++) {
+		sns = cash_sensor_at(id);
+		if (sns != NULL && sns->evtno == dev->evtno)
+			return;
+	}
+
+	for (t = 0; t < CASH_SENSOR_TYPE_MAX; t++) {
+		cls = cash_disc_cls[t];
+		if (cls == NULL)
+			continue;
+
+		for (b = 0; cls->backends[b] != NULL; b++) {
+			ops = cls->backends[b];
+			if (!cash_input_match(ops->ids, dev))
+				continue;
+
+			idle = NULL;
+			for (id = 0; id < CASH_SENSOR_MAX && idle == NULL;
+			     id++) {
+				sns = cash_sensor_at(id);
+				if (sns != NULL && sns->ops == ops &&
+				    sns->evtno < 0)
+					idle = sns;
+			}
+			if (idle == NULL)
+				idle = cash_sensor_create(cls, ops);
+			if (idle == NULL)
+				return;
+
+			if (cash_input_sensor_attach(idle, dev) < 0) {
+				ALOGW("Cannot attach %s at event%d",
+					dev->name, dev->evtno);
+				continue;
+			}
+
+			ALOGI("Attached %s at event%d as sensor %d",
+				dev->name, dev->evtno, idle->id);
+
+			/* A new one joins the others of its type, if running */
+			primary = cash_sensor_get(cls->type);
+			if (primary != idle && primary->run && !idle->run)
+				cash_sensor_start(idle, true);
+			return;
+		}
+	}
+}
+
+/*
+ * cash_input_bind - Attaches every known device that a registered
+ *		     backend can drive. Called with the lock.
+ */
+static void cash_input_bind(void)
+{
+	int i;
+
+	for (i = 0; i < cash_disc_ndevs; i++)
+		cash_input_bind_dev(&cash_disc_devs[i]);
+}
+
+/*
+ * cash_input_unbind - Detaches the sensor instance of the device at
+ *		       event number evtno, if any. Called with the lock.
+ */
+static void cash_input_unbind(int evtno)
+{
+	struct cash_sensor *sns;
+	int id;
+
+	for (id = 0; id < CASH_SENSOR_MAX; id++) {
+		sns = cash_sensor_at(id);
+		if (sns == NULL || sns->evtno != evtno)
+			continue;
+
+		ALOGI("Detached sensor %d from event%d", id, evtno);
+		cash_input_fd_detach(sns);
+		sns->evtno = -1;
+	}
+}
+
+/* Called with the lock */
+static void cash_input_dev_remove(int evtno)
+{
+	int i = cash_input_dev_find(evtno);
+
+	if (i < 0)
+		return;
+
+	cash_input_unbind(evtno);
+	cash_disc_devs[i] = cash_disc_devs[--cash_disc_ndevs];
+}
+
+/*
+ * cash_input_dev_add - Adds a device, or replaces the one that was at
+ *			its event number. Called with the lock.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_input_dev_add(const struct cash_input_dev *dev)
+{
+	struct cash_input_dev *devs;
+	int alloc_len;
+
+	cash_input_dev_remove(dev->evtno);
+
+	if (cash_disc_ndevs == cash_disc_alloc) {
+		alloc_len = cash_disc_alloc ? cash_disc_alloc * 2 : 16;
+		devs = realloc(cash_disc_devs, alloc_len * sizeof(*devs));
+		if (devs == NULL) {
+			ALOGE("Memory exhausted. Cannot allocate.");
+			return -ENOMEM;
+		}
+
+		cash_disc_devs = devs;
+		cash_disc_alloc = alloc_len;
+	}
+
+	cash_disc_devs[cash_disc_ndevs++] = *dev;
+
+	return 0;
+}
+
+/*
+ * cash_input_scan - Identifies everything in /dev/input, dropping the
+ *		     devices that are gone meanwhile, then attaches the
+ *		     sensor backends to what they can drive.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_input_scan(void)
+{
+	struct cash_input_dev *found = NULL, *tmp;
+	int nfound = 0, alloc_len = 0, evtno, i, j, rc = 0;
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(CASH_INPUT_DEVFS_DIR);
+	if (dir == NULL) {
+		ALOGE("Cannot open %s", CASH_INPUT_DEVFS_DIR);
+		return -errno;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (sscanf(de->d_name, "event%d", &evtno) != 1)
+			continue;
+
+		if (nfound == alloc_len) {
+			alloc_len = alloc_len ? alloc_len * 2 : 16;
+			tmp = realloc(found, alloc_len * sizeof(*found));
+			if (tmp == NULL) {
+				ALOGE("Memory exhausted. Cannot allocate.");
+				rc = -ENOMEM;
+				break;
+			}
+			found = tmp;
+		}
+
+		if (cash_input_probe(evtno, &found[nfound]) == 0)
+			nfound++;
+	}
+	closedir(dir);
+
+	pthread_mutex_lock(&cash_disc_lock);
+	if (rc == 0) {
+		for (i = cash_disc_ndevs - 1; i >= 0; i--) {
+			for (j = 0; j < nfound; j++)
+				if (found[j].evtno == cash_disc_devs[i].evtno)
+					break;
+			if (j == nfound)
+				cash_input_dev_remove(cash_disc_devs[i].evtno);
+		}
+	}
+	for (i = 0; i < nfound; i++) {
+		/* Still there, as it was: leave its sensor alone */
+		j = cash_input_dev_find(found[i].evtno);
+		if (j >= 0 &&
+		    !memcmp(&cash_disc_devs[j], &found[i], sizeof(*found)))
+			continue;
+
+		if (cash_input_dev_add(&found[i]) < 0)
+			break;
+	}
+	cash_input_bind();
+	pthread_mutex_unlock(&cash_disc_lock);
+
+	free(found);
+
+	return rc;
+}
+
+/*
+ * cash_input_uevent - Handles a kernel uevent: input event devices
+ *		       that come get identified and attached, the ones
+ *		       that go get detached.
+ */
+static void cash_input_uevent(char *msg, size_t len)
+{
+	const char *action = NULL, *subsys = NULL, *devname = NULL;
+	struct cash_input_dev dev;
+	char *p, *end = msg + len;
+	int evtno, i, rc;
+
+	for (p = msg; p < end; p += strlen(p) + 1) {
+		if (!strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			subsys = p + 10;
+		else if (!strncmp(p, "DEVNAME=", 8))
+			devname = p + 8;
+	}
+
+	if (action == NULL || subsys == NULL || devname == NULL ||
+	    strcmp(subsys, "input") ||
+	    sscanf(devname, "input/event%d", &evtno) != 1)
+		return;
+
+	if (!strcmp(action, "remove")) {
+		pthread_mutex_lock(&cash_disc_lock);
+		cash_input_dev_remove(evtno);
+		pthread_mutex_unlock(&cash_disc_lock);
+		return;
+	}
+
+	if (strcmp(action, "add"))
+		return;
+
+	for (i = 0; i < CASH_INPUT_NODE_WAIT_MS / CASH_INPUT_NODE_POLL_MS;
+	     i++) {
+		rc = cash_input_probe(evtno, &dev);
+		if (rc != -ENOENT)
+			break;
+		usleep(CASH_INPUT_NODE_POLL_MS * 1000);
+	}
+	if (rc < 0) {
+		ALOGW("Cannot identify the new input device event%d", evtno);
+		return;
+	}
+
+	pthread_mutex_lock(&cash_disc_lock);
+	if (cash_input_dev_add(&dev) == 0)
+		cash_input_bind();
+	pthread_mutex_unlock(&cash_disc_lock);
+}
+
+static void *cash_input_hotplug_thread(void *unusedvar __attribute__((unused)))
+{
+	char msg[CASH_INPUT_UEVENT_MSGSZ + 1];
+	ssize_t len;
+
+	for (;;) {
+		len = uevent_kernel_multicast_recv(cash_uevent_fd, msg,
+						   CASH_INPUT_UEVENT_MSGSZ);
+		if (len > 0) {
+			msg[len] = '\0';
+			cash_input_uevent(msg, len);
+			continue;
+		}
+
+		/* Some uevents got dropped: find out what changed */
+		if (len < 0 && errno == ENOBUFS) {
+			ALOGW("Input uevents overrun: rescanning");
+			cash_input_scan();
+			continue;
+		}
+
+		/* Userspace senders get filtered out, anything else is bad */
+		if (len < 0 && (errno == EIO || errno == EINTR))
+			continue;
+
+		break;
+	}
+
+	ALOGE("Cannot follow input devices hotplug anymore");
+
+	return NULL;
+}
+
+/*
+ * cash_input_discovery_init - Identifies the input devices once, then
+ *			       follows them coming and going, so that
+ *			       sensors probing late, or coming back,
+ *			       get attached anyway.
+ *			       The thread following them keeps the
+ *			       credentials of the caller, which needs to
+ *			       be able to set sensors up.
+ *
+ * \return Returns zero or negative errno.
+ */
+int cash_input_discovery_init(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int rc;
+
+	/* Listen before scanning, not to miss anything in between */
+	cash_uevent_fd = uevent_open_socket(CASH_INPUT_UEVENT_BUFSZ, true);
+	if (cash_uevent_fd < 0)
+		ALOGW("Cannot listen to uevents: no input devices hotplug");
+
+	rc = cash_input_scan();
+
+	if (cash_uevent_fd < 0)
+		return rc;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, cash_input_hotplug_thread,
+			   NULL) != 0) {
+		ALOGW("Cannot create the input devices hotplug thread");
+		close(cash_uevent_fd);
+		cash_uevent_fd = -1;
+		rc = -ENXIO;
+	}
+	pthread_attr_destroy(&attr);
+
+	return rc;
+}
+
+/*
+ * cash_input_discover - Registers a sensor type, attaching its backends
+ *			 to the matching devices found already. Devices
+ *			 showing up later, or coming back, get attached
+ *			 as soon as they do.
+ *
+ * \param calib - Factory calibration of the sensors, NULL for none
+ *
+ * \return Returns zero, or -ENODEV if no sensor got attached yet.
+ */
+int cash_input_discover(const struct cash_sensor_class *cls,
+			const struct cash_tamisc_calib_params *calib)
+{
+	struct cash_sensor *sns;
+	int id, rc = -ENODEV;
+
+	pthread_mutex_lock(&cash_disc_lock);
+	if (calib != NULL) {
+		cash_disc_calib[cls->type] = *calib;
+		cash_disc_calib_valid[cls->type] = true;
+	}
+	cash_disc_cls[cls->type] = cls;
+	cash_input_bind();
+
+	for (id = 0; id < CASH_SENSOR_MAX; id++) {
+		sns = cash_sensor_at(id);
+		if (sns != NULL && sns->cls == cls && sns->evtno >= 0)
+			rc = 0;
+	}
+	pthread_mutex_unlock(&cash_disc_lock);
+
+	return rc;
+}
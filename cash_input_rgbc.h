@@ -26,10 +26,62 @@ struct cash_tcs3490 {
 	int blue;
 	int clear;
 	int ir;
+	/* Analog gain and integration time the counts were taken with */
+	int again;
+	int itime_us;
+	int64_t timestamp_ns;
 };
 
+extern const struct cash_sensor_ops cash_tcs3490_ops;
+
 int cash_rgbc_read_inst(struct cash_tcs3490 *tcsvl_final);
+int cash_rgbc_sample_at(int64_t timestamp_ns, bool interpolate,
+			struct cash_tcs3490 *tcsvl_final);
 int cash_input_rgbc_start(bool start);
 bool cash_input_is_rgbc_alive(void);
+bool cash_input_is_rgbc_ready(void);
 int cash_input_rgbc_init(struct cash_tamisc_calib_params *calib_params);
 
+/* Color calibration of the module, out of MiscTA */
+struct cash_color_calib {
+	bool valid;
+	/* Scales R, G and B so that daylight reads neutral */
+	double chan_gain[3];
+	/* ln(B/R) of the scaled channels under the two references */
+	double log_br_a;
+	double log_br_d65;
+};
+
+void cash_color_calib_init(const struct cash_tamisc_calib_params *calib,
+			   struct cash_color_calib *cc);
+int cash_color_process(const struct cash_color_calib *cc,
+		       const struct cash_tcs3490 *tcsvl,
+		       struct cash_color *color);
+
+/* Samples of a flicker burst, and bins of their DFT */
+#define FLICKER_DFT_LEN		128
+#define FLICKER_DFT_BINS	(FLICKER_DFT_LEN / 2)
+
+/* DFT of a flicker burst, run as a Goertzel filter per bin */
+struct cash_flicker_dft {
+	float s1[FLICKER_DFT_BINS] __attribute__((aligned(16)));
+	float s2[FLICKER_DFT_BINS] __attribute__((aligned(16)));
+	float coef[FLICKER_DFT_BINS] __attribute__((aligned(16)));
+	/* First count, taken out of all to keep the filters small */
+	float offset;
+	double sum;
+	int n;
+	int64_t first_ns;
+	int64_t last_ns;
+};
+
+void cash_flicker_start(struct cash_flicker_dft *dft);
+bool cash_flicker_push(struct cash_flicker_dft *dft, int32_t clear,
+		       int64_t timestamp_ns);
+void cash_flicker_analyze(const struct cash_flicker_dft *dft,
+			  struct cash_flicker *flicker);
+
+void cash_rgbc_set_flicker(int interval_ms);
+void cash_rgbc_set_autorange(bool on);
+unsigned int cash_rgbc_range_switches(void);
+int cash_rgbc_read_flicker(struct cash_flicker *flicker);
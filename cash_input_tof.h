@@ -25,24 +25,66 @@
 #define TOF_STABILIZATION_WAIT_MS		10
 #define TOF_STABILIZATION_HYST_MM		7
 #define TOF_STABILIZATION_MATCH_NO		3
+#define TOF_STABILIZATION_MAX_RUNS		32
+#define TOF_FILTER_DEF_EMA_ALPHA		0.5
+#define TOF_FILTER_DEF_MEDIAN_LEN		5
+#define TOF_FILTER_DEF_KALMAN_Q			100000.0
+#define TOF_FILTER_DEF_KALMAN_R			25.0
+#define TOF_FILTER_MAX_GAP_NS			500000000LL
+#define TOF_PREDICT_MAX_SAMPLES			16
+#define TOF_PREDICT_WINDOW_NS			300000000LL
+#define TOF_PREDICT_MAX_AHEAD_NS		250000000LL
+#define TOF_FILTER_KALMAN_SPEED_VAR		1000000.0
+#define TOF_ZONES_SIDE_MAX			8
+#define TOF_ZONES_MAX				(TOF_ZONES_SIDE_MAX * TOF_ZONES_SIDE_MAX)
+#define TOF_ZONES_RANGE_MAX_MM			8000
+#define TOF_ZONES_CLUSTER_MM			80
+#define TOF_ZONES_CLUSTER_MIN_PCT		15
+#define TOF_ZONES_CLUSTER_PASSES		4
 
 struct cash_vl53l0 {
 	int range_mm;
 	int distance;
 	int range_status;
 	int measure_mode;
+	int64_t timestamp_ns;
 };
 
-int cash_input_tof_read(struct cash_vl53l0 *stmvl_cur,
-	uint16_t want_code);
-int cash_tof_read_stabilized(
-	struct cash_vl53l0 *stmvl_final,
-	int runs, int nmatch, int sleep_ms, int hyst);
+/*
+ * Multi-zone frame: one array per field, so that going through the
+ * zones vectorizes. Zones are in row major order, starting from the
+ * top left one as seen by the camera; a status of zero means valid.
+ */
+struct cash_tof_zones {
+	int32_t range_mm[TOF_ZONES_MAX] __attribute__((aligned(16)));
+	int32_t status[TOF_ZONES_MAX] __attribute__((aligned(16)));
+	int rows;
+	int cols;
+	int64_t timestamp_ns;
+};
+
+struct cash_sensor;
+
+extern const struct cash_sensor_ops cash_vl53l0_ops;
+extern const struct cash_sensor_ops cash_vl53l5_ops;
+
+void cash_tof_zones_publish(struct cash_sensor *sns,
+			    const struct cash_tof_zones *zones);
+int cash_tof_zones_reduce(const struct cash_tof_zones *zones,
+			  const struct cash_roi *roi, int *zones_used);
+int cash_tof_read_zones(struct cash_tof_zones *zones);
+
 int cash_tof_read_inst(struct cash_vl53l0 *stmvl_final);
-int cash_tof_thr_read_stabilized(
-	struct cash_vl53l0 *stmvl_final,
-	int runs, int nmatch, int sleep_ms, int hyst);
+int cash_tof_thr_read_stabilized(struct cash_vl53l0 *stmvl_final);
+int cash_tof_sample_at(int64_t timestamp_ns, bool interpolate,
+		       struct cash_vl53l0 *stmvl_final);
+int cash_tof_predict(int64_t timestamp_ns, struct cash_vl53l0 *stmvl_final,
+		     int32_t *speed_mm_s);
+void cash_tof_set_stabilization(int runs, int nmatch, int hyst);
+int cash_tof_read_filtered(struct cash_vl53l0 *stmvl_final);
+void cash_tof_set_filter(struct cash_tof_filter_params *params);
 int cash_input_tof_start(bool start);
 bool cash_input_is_tof_alive(void);
+bool cash_input_is_tof_ready(void);
 int cash_input_tof_init(struct cash_tamisc_calib_params *calib_params);
 
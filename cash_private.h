@@ -18,17 +18,33 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
+
+#include "cash_ext.h"
+#include "cash_seqlock.h"
 
 /* CASH Server definitions */
 #define CASHSERVER_DIR			"/dev/socket/cashsvr/"
 #define CASHSERVER_SOCKET		CASHSERVER_DIR "cashsvr"
 #define CASHSERVER_MAXCONN		10
 
+/* Sensors power management defaults, in milliseconds */
+#define CASHSERVER_POWER_IDLE_MS	10000
+#define CASHSERVER_POWER_WARM_MS	3000
+
 #define CASHSERVER_TOF_CONF_FILE	"/vendor/etc/tof_focus_calibration.xml"
 #define CASHSERVER_RGBC_CONF_FILE	"/vendor/etc/cash_expcol_calibration.xml"
 
 #define CASHSERVER_DATASTORE_DIR	"/data/vendor/cashsvr/"
 #define CASHSERVER_CALDATA_FILE		CASHSERVER_DATASTORE_DIR "miscta_caldata.bin"
+#define CASHSERVER_TOF_CALCACHE_FILE	CASHSERVER_DATASTORE_DIR "tof_calcache.bin"
+#define CASHSERVER_RGBC_CALCACHE_FILE	CASHSERVER_DATASTORE_DIR "rgbc_calcache.bin"
+
+/*
+ * Calibration cache layout version: bump it whenever the cached
+ * structures or the code deriving them (fitting, LUTs) change.
+ */
+#define CASH_CALCACHE_VERSION		2
 
 #define CASHSERVER_LIB_TA		"libta.so"
 #define TA_UNIT_RGBCIR_CAPS1		4880
@@ -45,6 +61,15 @@ typedef enum {
 	OP_RGBC_START,
 	OP_CHECK_RGBC_RANGE,
 	OP_EXPTIME_ISO_GET,
+	OP_SNAPSHOT_GET,
+	OP_SUBSCRIBE,
+	OP_SHM_GET,
+	OP_SAMPLE_AT,
+	OP_WAIT_READY,
+	OP_STATS,
+	OP_FOCUS_ROI_GET,
+	OP_COLOR_GET,
+	OP_FLICKER_GET,
 	OP_MAX,
 } cash_svr_ops_t;
 
@@ -59,6 +84,26 @@ struct cash_polyreg_params {
 	double *terms;
 };
 
+enum cash_tof_filter_type {
+	TOF_FILTER_NONE = 0,
+	TOF_FILTER_EMA,
+	TOF_FILTER_MEDIAN,
+	TOF_FILTER_KALMAN,
+};
+
+#define TOF_FILTER_MEDIAN_MAX_LEN	15
+
+struct cash_tof_filter_params {
+	int32_t type;
+	/* EMA: weight of the newest sample, 0 < alpha <= 1 */
+	double ema_alpha;
+	/* Median: number of samples, odd */
+	int32_t median_len;
+	/* Kalman: acceleration noise (mm^2/s^3) and range noise (mm^2) */
+	double kalman_q;
+	double kalman_r;
+};
+
 struct cash_configuration {
 	int32_t tof_min;
 	int32_t tof_max;
@@ -68,6 +113,8 @@ struct cash_configuration {
 	int32_t tof_polyreg_extra;
 	int8_t  use_tof_stabilized;
 	int8_t  disable_tof;
+	int8_t  use_focus_lut;
+	struct cash_tof_filter_params tof_filter;
 	int32_t rgbc_clear_min;
 	int32_t rgbc_clear_max;
 	int32_t rgbc_polyreg_degree;
@@ -75,6 +122,15 @@ struct cash_configuration {
 	int8_t  disable_rgbc;
 	int64_t *exposure_times;
 	int32_t nexposure_times;
+	/* Zero idle timeout: sensors stay up until explicitly stopped */
+	int32_t power_idle_ms;
+	int32_t power_warm_ms;
+	/* Serve sensors in the event loop instead of a thread each */
+	int8_t  single_thread;
+	/* Time between flicker bursts, zero for no flicker detection */
+	int32_t rgbc_flicker_ms;
+	/* Adapt the RGBC gain and integration time to the light */
+	int8_t  rgbc_autorange;
 };
 
 struct cash_focus_state {
@@ -86,8 +142,24 @@ struct cash_focus_state {
 struct cash_params {
 	int32_t operation;
 	int32_t value;
+	/* OP_SUBSCRIBE: minimum change worth a push, zero for any */
+	int32_t focus_delta;
+	int32_t iso_delta;
+	/*
+	 * OP_SAMPLE_AT: wanted time, on the CASH_CLOCK_* given by clock_id.
+	 * OP_FOCUS_GET: time to predict the focus at, zero for now.
+	 */
+	int64_t timestamp_ns;
+	int32_t clock_id;
+	/* OP_WAIT_READY: how long to wait for the sensors in value */
+	int32_t timeout_ms;
+	/* OP_FOCUS_ROI_GET: region to focus on */
+	struct cash_roi roi;
 };
 
+/* Longest OP_WAIT_READY, well within the client reply timeout */
+#define CASH_WAIT_READY_MAX_MS		5000
+
 struct cash_tamisc_calib_params {
 	uint16_t rgbcir_caps1[5];
 	uint16_t rgbcir_caps2[5];
@@ -101,6 +173,57 @@ struct cash_response {
 	int32_t focus_step;
 	int64_t exptime;
 	int32_t iso;
+	bool tof_in_range;
+	bool rgbc_in_range;
+	/* OP_SAMPLE_AT: readings used, timestamps on the requested clock */
+	int32_t range_mm;
+	int32_t clear;
+	int64_t tof_timestamp_ns;
+	int64_t rgbc_timestamp_ns;
+	/* OP_FOCUS_GET with a target time: radial speed in mm/s */
+	int32_t speed_mm_s;
+	/* OP_WAIT_READY: CASH_SUBSCRIBE_* mask of the ready sensors */
+	int32_t ready_mask;
+	/* OP_STATS */
+	struct cash_stats stats;
+	/*
+	 * CASH_SUBSCRIBE_* mask of the sensors that are still being
+	 * initialized: if not zero, the request was not served.
+	 */
+	int32_t unready_mask;
+	/* OP_FOCUS_ROI_GET: ToF zones the range came out of */
+	int32_t zones;
+	/* OP_COLOR_GET */
+	struct cash_color color;
+	/* OP_FLICKER_GET */
+	struct cash_flicker flicker;
+};
+
+/*
+ * Latest readings, published in shared memory for syscall-free reads.
+ * Timestamps are CLOCK_MONOTONIC nanoseconds, zero if never updated.
+ */
+#define CASH_SHM_VERSION		1
+#define CASH_SHM_STALE_NS		1000000000LL
+
+struct cash_shm_data {
+	int64_t tof_timestamp_ns;
+	int32_t range_mm;
+	int32_t distance;
+	int32_t focus_step;
+	int64_t rgbc_timestamp_ns;
+	int32_t clear;
+	int32_t iso;
+	int64_t exptime;
+	bool tof_in_range;
+	bool rgbc_in_range;
+};
+
+struct cash_shm_snapshot {
+	uint32_t version;
+	int32_t owner_pid;
+	struct cash_seqlock lock;
+	struct cash_shm_data data;
 };
 
 int parse_cash_tof_xml_data(char* filepath, char* node, 
@@ -113,6 +236,33 @@ int parse_cash_rgbc_xml_data(char* filepath, char* node,
 
 int cash_miscta_init_params(struct cash_tamisc_calib_params *conf);
 
+int cash_shm_get_fd(void);
+void cash_shm_publish(struct cash_shm_data *data);
+
+enum cash_calcache_blob {
+	CALCACHE_BLOB_CONF,
+	CALCACHE_BLOB_TABLE,
+	CALCACHE_BLOB_TERMS,
+	CALCACHE_BLOB_LUT,
+	CALCACHE_BLOB_EXPTIMES,
+	CALCACHE_BLOB_MAX
+};
+
+struct cash_calcache {
+	void *map;
+	size_t map_len;
+	const void *blob[CALCACHE_BLOB_MAX];
+	size_t blob_len[CALCACHE_BLOB_MAX];
+};
+
+int cash_calcache_load(const char *path, const char *src_path,
+		       struct cash_calcache *cache);
+int cash_calcache_store(const char *path, const char *src_path,
+			const void *blob[CALCACHE_BLOB_MAX],
+			const size_t blob_len[CALCACHE_BLOB_MAX]);
+bool cash_calcache_owns(struct cash_calcache *cache, const void *ptr);
+void cash_calcache_release(struct cash_calcache *cache);
+
 #define REPLY_FOCUS_CUSTOM_LEN		7
 #define REPLY_SHORT_FOCUS_LEN		2
 #define FOCUS_PROCESSING_MAX_PASS	6
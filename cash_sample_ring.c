@@ -0,0 +1,201 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * Timestamped sample ring
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "cash_sample_ring.h"
+
+#define CASH_RING_MASK		(CASH_RING_SLOTS - 1)
+#define CASH_RING_READ_TRIES	8
+
+/*
+ * cash_ring_push - Appends a sample, overwriting the oldest one.
+ *		    Must only be called by the thread owning the ring.
+ */
+void cash_ring_push(struct cash_sample_ring *ring, int64_t timestamp_ns,
+		    const int32_t *val, int nval)
+{
+	uint64_t head = atomic_load_explicit(&ring->head,
+					     memory_order_relaxed);
+	struct cash_ring_slot *slot = &ring->slot[head & CASH_RING_MASK];
+
+	if (nval > CASH_RING_VALS)
+		nval = CASH_RING_VALS;
+
+	cash_seqlock_write_begin(&slot->lock);
+	slot->sample.idx = head;
+	slot->sample.timestamp_ns = timestamp_ns;
+	memset(slot->sample.val, 0, sizeof(slot->sample.val));
+	memcpy(slot->sample.val, val, nval * sizeof(int32_t));
+	cash_seqlock_write_end(&slot->lock);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * cash_ring_get - Copies out the sample number idx
+ *
+ * \return Returns zero or -EAGAIN if the sample was overwritten.
+ */
+int cash_ring_get(struct cash_sample_ring *ring, uint64_t idx,
+		  struct cash_sample *sample)
+{
+	struct cash_ring_slot *slot = &ring->slot[idx & CASH_RING_MASK];
+	uint32_t seq;
+
+	do {
+		seq = cash_seqlock_read_begin(&slot->lock);
+		*sample = slot->sample;
+	} while (cash_seqlock_read_retry(&slot->lock, seq));
+
+	if (sample->idx != idx)
+		return -EAGAIN;
+
+	return 0;
+}
+
+static void cash_ring_interpolate(struct cash_sample *a,
+				  struct cash_sample *b,
+				  int64_t timestamp_ns,
+				  struct cash_sample *sample)
+{
+	int64_t span = b->timestamp_ns - a->timestamp_ns;
+	int64_t off = timestamp_ns - a->timestamp_ns;
+	int i;
+
+	*sample = *a;
+	sample->timestamp_ns = timestamp_ns;
+
+	if (span <= 0)
+		return;
+
+	for (i = 0; i < CASH_RING_VALS; i++)
+		sample->val[i] = a->val[i] +
+			(int32_t)(((int64_t)(b->val[i] - a->val[i]) * off) /
+				  span);
+}
+
+/*
+ * cash_ring_get_recent - Copies out up to max of the newest samples,
+ *			  oldest first.
+ *
+ * \return Returns the number of samples or -EAGAIN if the writer kept
+ *	   overwriting them.
+ */
+int cash_ring_get_recent(struct cash_sample_ring *ring,
+			 struct cash_sample *samples, int max)
+{
+	uint64_t head;
+	int n, i, tries;
+
+	if (max > CASH_RING_SLOTS - 1)
+		max = CASH_RING_SLOTS - 1;
+
+	for (tries = 0; tries < CASH_RING_READ_TRIES; tries++) {
+		head = atomic_load_explicit(&ring->head,
+					    memory_order_acquire);
+		n = head < (uint64_t)max ? (int)head : max;
+
+		for (i = 0; i < n; i++)
+			if (cash_ring_get(ring, head - n + i, &samples[i]) < 0)
+				break;
+		if (i == n)
+			return n;
+	}
+
+	return -EAGAIN;
+}
+
+/*
+ * cash_ring_get_at - Looks up the sample taken at a given time.
+ *
+ * Requests out of the time span of the ring give back the oldest or
+ * the newest sample, as they are: nothing is ever extrapolated.
+ *
+ * \param timestamp_ns - Time of the wanted sample, same clock as the ring
+ * \param interpolate - Interpolate the two samples around timestamp_ns
+ *			linearly, instead of taking the nearest one.
+ *			The sample index is the one of the older sample.
+ *
+ * \return Returns zero, -ENODATA if the ring is empty or -EAGAIN if
+ *	   the writer kept overwriting the samples being looked at.
+ */
+int cash_ring_get_at(struct cash_sample_ring *ring, int64_t timestamp_ns,
+		     bool interpolate, struct cash_sample *sample)
+{
+	struct cash_sample lo_s, hi_s, mid_s;
+	uint64_t head, lo, hi, mid;
+	int tries;
+
+	for (tries = 0; tries < CASH_RING_READ_TRIES; tries++) {
+		head = atomic_load_explicit(&ring->head,
+					    memory_order_acquire);
+		if (head == 0)
+			return -ENODATA;
+
+		/* The oldest slot may be getting overwritten right now */
+		hi = head - 1;
+		lo = head > CASH_RING_SLOTS ? head - CASH_RING_SLOTS + 1 : 0;
+
+		if (cash_ring_get(ring, hi, &hi_s) < 0)
+			continue;
+		if (timestamp_ns >= hi_s.timestamp_ns) {
+			*sample = hi_s;
+			return 0;
+		}
+
+		if (cash_ring_get(ring, lo, &lo_s) < 0)
+			continue;
+		if (timestamp_ns <= lo_s.timestamp_ns) {
+			*sample = lo_s;
+			return 0;
+		}
+
+		/* Timestamps only go up: find the two around the wanted one */
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo) / 2;
+			if (cash_ring_get(ring, mid, &mid_s) < 0)
+				break;
+
+			if (mid_s.timestamp_ns <= timestamp_ns) {
+				lo = mid;
+				lo_s = mid_s;
+			} else {
+				hi = mid;
+				hi_s = mid_s;
+			}
+		}
+		if (hi - lo > 1)
+			continue;
+
+		if (interpolate)
+			cash_ring_interpolate(&lo_s, &hi_s,
+					      timestamp_ns, sample);
+		else if (timestamp_ns - lo_s.timestamp_ns <=
+			 hi_s.timestamp_ns - timestamp_ns)
+			*sample = lo_s;
+		else
+			*sample = hi_s;
+
+		return 0;
+	}
+
+	return -EAGAIN;
+}
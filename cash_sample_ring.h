@@ -0,0 +1,64 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * Timestamped sample ring
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CASH_SAMPLE_RING_H
+#define CASH_SAMPLE_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cash_seqlock.h"
+
+/* Must be a power of two */
+#define CASH_RING_SLOTS		64
+#define CASH_RING_VALS		5
+
+struct cash_sample {
+	uint64_t idx;
+	int64_t timestamp_ns;
+	int32_t val[CASH_RING_VALS];
+};
+
+struct cash_ring_slot {
+	struct cash_seqlock lock;
+	struct cash_sample sample;
+};
+
+/*
+ * Last CASH_RING_SLOTS samples of one sensor, oldest first.
+ * Written by the sensor thread only, read by anyone without locking:
+ * every slot has its own seqlock and remembers which sample it holds,
+ * so that readers can tell when the writer lapped them.
+ */
+struct cash_sample_ring {
+	atomic_uint_least64_t head;
+	struct cash_ring_slot slot[CASH_RING_SLOTS];
+};
+
+void cash_ring_push(struct cash_sample_ring *ring, int64_t timestamp_ns,
+		    const int32_t *val, int nval);
+int cash_ring_get(struct cash_sample_ring *ring, uint64_t idx,
+		  struct cash_sample *sample);
+int cash_ring_get_at(struct cash_sample_ring *ring, int64_t timestamp_ns,
+		     bool interpolate, struct cash_sample *sample);
+int cash_ring_get_recent(struct cash_sample_ring *ring,
+			 struct cash_sample *samples, int max);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * Sequence lock helpers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CASH_SEQLOCK_H
+#define CASH_SEQLOCK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Single writer, many lock-free readers. The sequence is odd while an
+ * update is in progress: readers copy the data out and retry if the
+ * sequence moved meanwhile.
+ * Readers never wait on the writer, so they can also live in another
+ * process, mapping the same memory read-only.
+ */
+struct cash_seqlock {
+	atomic_uint_least32_t seq;
+};
+
+static inline void cash_seqlock_write_begin(struct cash_seqlock *sl)
+{
+	uint32_t seq = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&sl->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void cash_seqlock_write_end(struct cash_seqlock *sl)
+{
+	uint32_t seq = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&sl->seq, seq + 1, memory_order_release);
+}
+
+static inline uint32_t cash_seqlock_read_begin(const struct cash_seqlock *sl)
+{
+	return atomic_load_explicit((atomic_uint_least32_t*)&sl->seq,
+				    memory_order_acquire);
+}
+
+/*
+ * cash_seqlock_read_retry - Tells whether the data copied out since
+ *			     cash_seqlock_read_begin() may be torn.
+ */
+static inline bool cash_seqlock_read_retry(const struct cash_seqlock *sl,
+					   uint32_t seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+
+	return (seq & 1) ||
+	       atomic_load_explicit((atomic_uint_least32_t*)&sl->seq,
+				    memory_order_relaxed) != seq;
+}
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * Sequence lock stress test: one writer keeps publishing samples whose
+ * fields all derive from the same counter, while several readers check
+ * that whatever they copy out never mixes two publishes.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cash_seqlock.h"
+
+#define SEQLOCK_TEST_READERS	6
+#define SEQLOCK_TEST_PUBLISHES	2000000
+
+/* Shaped like the sensor samples: a few ints and a timestamp */
+struct seqlock_test_sample {
+	int range_mm;
+	int distance;
+	int range_status;
+	int clear;
+	int64_t timestamp_ns;
+};
+
+static struct seqlock_test_sample test_status;
+static struct cash_seqlock test_lock;
+static atomic_bool test_done;
+
+struct seqlock_test_reader {
+	pthread_t thread;
+	uint64_t reads;
+	uint64_t torn;
+	uint64_t backwards;
+};
+
+static void seqlock_test_fill(struct seqlock_test_sample *s, int n)
+{
+	s->range_mm = n;
+	s->distance = ~n;
+	s->range_status = n * 3;
+	s->clear = -n;
+	s->timestamp_ns = (int64_t)n * 1000;
+}
+
+static bool seqlock_test_coherent(const struct seqlock_test_sample *s)
+{
+	int n = s->range_mm;
+
+	return s->distance == ~n && s->range_status == n * 3 &&
+	       s->clear == -n && s->timestamp_ns == (int64_t)n * 1000;
+}
+
+static void *seqlock_test_write(void *arg)
+{
+	int n;
+
+	(void)arg;
+
+	for (n = 1; n <= SEQLOCK_TEST_PUBLISHES; n++) {
+		cash_seqlock_write_begin(&test_lock);
+		seqlock_test_fill(&test_status, n);
+		cash_seqlock_write_end(&test_lock);
+	}
+
+	atomic_store(&test_done, true);
+	return NULL;
+}
+
+static void *seqlock_test_read(void *arg)
+{
+	struct seqlock_test_reader *rd = arg;
+	struct seqlock_test_sample s;
+	int last = 0;
+	uint32_t seq;
+
+	while (!atomic_load(&test_done)) {
+		do {
+			seq = cash_seqlock_read_begin(&test_lock);
+			s = test_status;
+		} while (cash_seqlock_read_retry(&test_lock, seq));
+
+		rd->reads++;
+		if (!seqlock_test_coherent(&s))
+			rd->torn++;
+		/* A single writer never goes back in time */
+		if (s.range_mm < last)
+			rd->backwards++;
+		last = s.range_mm;
+	}
+
+	return NULL;
+}
+
+int main(void)
+{
+	struct seqlock_test_reader readers[SEQLOCK_TEST_READERS] = { 0 };
+	uint64_t reads = 0, torn = 0, backwards = 0;
+	pthread_t writer;
+	int i;
+
+	seqlock_test_fill(&test_status, 0);
+
+	for (i = 0; i < SEQLOCK_TEST_READERS; i++) {
+		if (pthread_create(&readers[i].thread, NULL,
+				   seqlock_test_read, &readers[i])) {
+			fprintf(stderr, "Cannot create reader %d\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (pthread_create(&writer, NULL, seqlock_test_write, NULL)) {
+		fprintf(stderr, "Cannot create the writer\n");
+		atomic_store(&test_done, true);
+		for (i = 0; i < SEQLOCK_TEST_READERS; i++)
+			pthread_join(readers[i].thread, NULL);
+		return EXIT_FAILURE;
+	}
+
+	pthread_join(writer, NULL);
+	for (i = 0; i < SEQLOCK_TEST_READERS; i++) {
+		pthread_join(readers[i].thread, NULL);
+		reads += readers[i].reads;
+		torn += readers[i].torn;
+		backwards += readers[i].backwards;
+	}
+
+	printf("%d publishes, %llu reads: %llu torn, %llu out of order\n",
+		SEQLOCK_TEST_PUBLISHES, (unsigned long long)reads,
+		(unsigned long long)torn, (unsigned long long)backwards);
+
+	if (torn || backwards || !seqlock_test_coherent(&test_status)) {
+		printf("FAIL\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("PASS\n");
+	return EXIT_SUCCESS;
+}
@@ -24,6 +24,13 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/system_properties.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -33,13 +40,19 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <math.h>
+#include <limits.h>
 #include <pwd.h>
+#include <poll.h>
+#include <libgen.h>
+#include <stdatomic.h>
 
 #include <cutils/android_filesystem_config.h>
 #include <log/log.h>
 
 #include <libpolyreg/polyreg.h>
 #include "cash_private.h"
+#include "cash_input_common.h"
 #include "cash_input_tof.h"
 #include "cash_input_rgbc.h"
 #include "cash_ext.h"
@@ -48,29 +61,582 @@
 
 /* Serial port fd */
 static int serport = -1;
-static struct cash_polyreg_params focus_conf;
-static struct cash_polyreg_params clear_iso_conf;
 static struct cash_configuration cash_conf;
 
+/* Focus step for each millimeter, from tof_min to tof_max */
+#define FOCUS_LUT_MAX_ENTRIES	16384
+
+#define EXPOSURE_LUT_MAX_ENTRIES	16384
+struct cash_exposure_entry {
+	int64_t exptime;
+	int32_t iso;
+};
+
+/*
+ * Calibration snapshot: never modified once published, so that
+ * requests can use it without locks while a new one gets built.
+ * The ToF and RGBC halves are replaced independently, so they can
+ * be shared by several snapshots: each half has a reference count
+ * of its own and is freed along with the last snapshot using it.
+ */
+#define CALIB_OWNS_TOF		(1 << 0)
+#define CALIB_OWNS_RGBC		(1 << 1)
+
+struct cashsvr_calib {
+	/* Configuration with the calibrated values applied */
+	struct cash_configuration conf;
+
+	struct cash_polyreg_params focus_conf;
+	int32_t *focus_lut;
+	int32_t focus_lut_len;
+	/* Compiled calibration, mapped read-only when up to date */
+	struct cash_calcache tof_cache;
+
+	struct cash_polyreg_params clear_iso_conf;
+	struct cash_exposure_entry *exposure_lut;
+	int32_t exposure_lut_len;
+	bool clear_iso_descending;
+	struct cash_calcache rgbc_cache;
+
+	/* Snapshots sharing each half */
+	atomic_uint *tof_refs;
+	atomic_uint *rgbc_refs;
+	/* Requests using it, plus one while it is the current one */
+	atomic_uint refs;
+};
+
+static struct cashsvr_calib *cashsvr_calib_cur;
+/* Only taken to swap the snapshot or to get a reference to it */
+static pthread_mutex_t cashsvr_calib_ref_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes publishing and reading the live properties */
+static pthread_mutex_t cashsvr_calib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define CASHSERVER_RELOAD_SETTLE_MS	200
+
+struct cashsvr_tof_calconf {
+	int32_t tof_min;
+	int32_t tof_max;
+	int32_t tof_hyst;
+	int32_t tof_max_runs;
+	int32_t tof_polyreg_degree;
+	int32_t tof_polyreg_extra;
+	struct cash_tof_filter_params tof_filter;
+	uint32_t num_steps;
+};
+
+struct cashsvr_rgbc_calconf {
+	int32_t rgbc_clear_min;
+	int32_t rgbc_clear_max;
+	int32_t rgbc_polyreg_degree;
+	int32_t rgbc_polyreg_extra;
+	int32_t nexposure_times;
+	uint32_t num_steps;
+	int8_t  clear_iso_descending;
+};
+
 /* CASH Server */
 static int sock;
-static int clientsock;
 static struct sockaddr_un server_addr;
 static pthread_t cashsvr_thread;
 static bool ucthread_run = true;
 
+/* Event loop */
+#define CASHSERVER_MAX_EVENTS	16
+#define CASHSERVER_WORKERS	2
+
+struct cashsvr_evsrc {
+	int fd;
+	/* Closed while its events were being served: skip them */
+	bool dead;
+	void (*handle)(struct cashsvr_evsrc *src, uint32_t events);
+};
+
+struct cashsvr_client {
+	struct cashsvr_evsrc src;
+	struct cash_params params;
+	struct cashsvr_client *next;
+
+	/* OP_SUBSCRIBE state, only ever touched by the event loop */
+	unsigned int sub_mask;
+	int32_t focus_delta;
+	int32_t iso_delta;
+	bool pushed;
+	struct cash_response last_push;
+	struct cashsvr_client *sub_next;
+
+	/* OP_WAIT_READY state, only ever touched by the event loop */
+	int64_t wait_deadline_ns;
+	struct cashsvr_client *wait_next;
+};
+
+static int cashsvr_epfd = -1;
+static struct cashsvr_evsrc cashsvr_listen_src;
+static struct cashsvr_evsrc cashsvr_notify_src;
+static struct cashsvr_client *cashsvr_subscribers;
+static struct cashsvr_client *cashsvr_waiters;
+
+/* Clients closed by the event loop, freed once their batch is served */
+static struct cashsvr_client *cashsvr_dead;
+static __thread bool cashsvr_is_looper;
+
+/* Single threaded mode: sensor input fds and timers are served here */
+static struct cashsvr_evsrc cashsvr_sensor_src[CASH_SENSOR_MAX];
+static bool cashsvr_sensor_attached[CASH_SENSOR_MAX];
+
+/*
+ * Attach requests coming from other threads, such as the hotplug one,
+ * applied by the event loop: it never sees a sensor change under it.
+ */
+static struct cashsvr_evsrc cashsvr_attach_src = { .fd = -1 };
+static pthread_mutex_t cashsvr_attach_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int cashsvr_attach_pending;
+static bool cashsvr_attach_want[CASH_SENSOR_MAX];
+static struct cashsvr_evsrc cashsvr_timer_src = { .fd = -1 };
+static int64_t cashsvr_timer_next;
+
+/* Shared memory snapshot, only ever touched by the event loop */
+static struct cash_shm_data cashsvr_shm_data;
+static bool cashsvr_shm_active;
+
+/* Slow operations are served by workers, off the event loop */
+static pthread_t cashsvr_workers[CASHSERVER_WORKERS];
+static pthread_mutex_t cashsvr_work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cashsvr_work_cond = PTHREAD_COND_INITIALIZER;
+static struct cashsvr_client *cashsvr_work_head;
+static struct cashsvr_client *cashsvr_work_tail;
+
+/* Serializes sensors power up/down requested by concurrent workers */
+static pthread_mutex_t cashsvr_power_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Demand-driven power management: a query powers a sensor up if it is
+ * down, and it goes back down once nobody queried it for the idle
+ * timeout. Shared memory readers don't count, but they fall back to
+ * a query as soon as the readings go stale.
+ * Protected by cashsvr_work_lock: the workers do the powering.
+ */
+struct cashsvr_power {
+	unsigned int mask;
+	int (*start)(bool start);
+	bool (*is_alive)(void);
+	bool (*is_ready)(void);
+
+	/* Explicitly started, and not stopped since */
+	bool requested;
+	/* Wanted while down: a worker has to power it up */
+	bool want_on;
+	int64_t last_query_ns;
+	/* Explicit stop still in its warm window, zero for none */
+	int64_t stop_ns;
+	int64_t on_since_ns;
+	/* Power up time, until the first sample comes in */
+	int64_t enable_ns;
+	struct cash_sensor_stats stats;
+};
+
+static struct cashsvr_power cashsvr_power[CASH_SENSOR_TYPE_MAX] = {
+	[CASH_SENSOR_TOF] = {
+		.mask = CASH_SUBSCRIBE_TOF,
+		.start = cash_input_tof_start,
+		.is_alive = cash_input_is_tof_alive,
+		.is_ready = cash_input_is_tof_ready,
+	},
+	[CASH_SENSOR_RGBC] = {
+		.mask = CASH_SUBSCRIBE_RGBC,
+		.start = cash_input_rgbc_start,
+		.is_alive = cash_input_is_rgbc_alive,
+		.is_ready = cash_input_is_rgbc_ready,
+	},
+};
+
+/*
+ * Subsystems get initialized concurrently while the server is already
+ * up: the ToF waits for the MiscTA calibration, nothing else waits.
+ */
+enum cashsvr_subsys {
+	SUBSYS_MISCTA,
+	SUBSYS_TOF,
+	SUBSYS_RGBC,
+	SUBSYS_MAX
+};
+
+static pthread_mutex_t cashsvr_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cashsvr_init_cond = PTHREAD_COND_INITIALIZER;
+static atomic_uint cashsvr_init_mask;
+static struct cash_tamisc_calib_params calib_params;
+static bool calib_params_valid;
+static struct cash_color_calib cashsvr_color_calib;
+
+static inline bool cashsvr_init_is_done(enum cashsvr_subsys subsys)
+{
+	return atomic_load(&cashsvr_init_mask) & (1 << subsys);
+}
+
 /* Debugging defines */
 // #define DEBUG_CMDS
 // #define DEBUG_FOCUS
+// #define DEBUG_FOCUS_BENCH
+
+static inline int64_t cashsvr_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void cashsvr_calib_free(struct cashsvr_calib *cal);
+
+/*
+ * cashsvr_calib_get - Gets the current calibration snapshot, which
+ *		       stays valid until cashsvr_calib_put(). Doesn't
+ *		       wait for a reload going on, only for a pointer
+ *		       swap at most.
+ */
+static struct cashsvr_calib *cashsvr_calib_get(void)
+{
+	struct cashsvr_calib *cal;
+
+	pthread_mutex_lock(&cashsvr_calib_ref_lock);
+	cal = cashsvr_calib_cur;
+	atomic_fetch_add(&cal->refs, 1);
+	pthread_mutex_unlock(&cashsvr_calib_ref_lock);
+
+	return cal;
+}
+
+/*
+ * cashsvr_calib_put - Drops a reference to a calibration snapshot.
+ *		       The last one, once the snapshot got replaced,
+ *		       frees it.
+ */
+static void cashsvr_calib_put(struct cashsvr_calib *cal)
+{
+	if (atomic_fetch_sub(&cal->refs, 1) == 1)
+		cashsvr_calib_free(cal);
+}
+
+/*
+ * cashsvr_power_disabled - Tells whether the sensors of a type
+ *			    got disabled by configuration.
+ */
+static bool cashsvr_power_disabled(enum cash_sensor_type type)
+{
+	if (type == CASH_SENSOR_TOF)
+		return cash_conf.disable_tof;
+
+	return cash_conf.disable_rgbc;
+}
+
+/*
+ * cashsvr_power_deadline - Gets when a powered sensor has to go down:
+ *			    after the idle timeout since the last query
+ *			    and, if it got stopped, not before the end of
+ *			    the warm window. Called with the work lock.
+ *
+ * \return Returns CLOCK_MONOTONIC nanoseconds, or zero for never.
+ */
+static int64_t cashsvr_power_deadline(struct cashsvr_power *pm)
+{
+	int64_t deadline = 0, warm;
+
+	if (!pm->is_alive())
+		return 0;
+
+	if (cash_conf.power_idle_ms > 0)
+		deadline = pm->last_query_ns +
+			   (int64_t)cash_conf.power_idle_ms * 1000000LL;
+
+	if (!pm->requested && pm->stop_ns) {
+		warm = pm->stop_ns +
+		       (int64_t)cash_conf.power_warm_ms * 1000000LL;
+		if (warm > deadline)
+			deadline = warm;
+	}
+
+	return deadline;
+}
+
+/*
+ * cashsvr_power_next - Gets when the workers have to manage power next.
+ *			Called with the work lock.
+ *
+ * \return Returns CLOCK_MONOTONIC nanoseconds, or zero for never.
+ */
+static int64_t cashsvr_power_next(void)
+{
+	int64_t next = 0, deadline;
+	int i;
+
+	for (i = 0; i < CASH_SENSOR_TYPE_MAX; i++) {
+		if (cashsvr_power[i].want_on)
+			return cashsvr_now_ns();
+
+		deadline = cashsvr_power_deadline(&cashsvr_power[i]);
+		if (deadline && (!next || deadline < next))
+			next = deadline;
+	}
+
+	return next;
+}
+
+/*
+ * cashsvr_power_set - Powers a sensor up or down and accounts for it.
+ *		       Called with the power lock.
+ *
+ * \param automatic - True if not explicitly requested by a client
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cashsvr_power_set(struct cashsvr_power *pm, bool on, bool automatic)
+{
+	int64_t now;
+	int rc;
+
+	rc = pm->start(on);
+	if (rc < 0)
+		return rc;
+
+	now = cashsvr_now_ns();
+
+	pthread_mutex_lock(&cashsvr_work_lock);
+	if (on) {
+		pm->stats.enables++;
+		if (automatic)
+			pm->stats.auto_enables++;
+		pm->on_since_ns = now;
+		pm->enable_ns = now;
+	} else {
+		if (automatic && !pm->stop_ns)
+			pm->stats.idle_disables++;
+		else
+			pm->stats.disables++;
+		pm->stats.on_time_ms += (now - pm->on_since_ns) / 1000000LL;
+		pm->enable_ns = 0;
+		pm->requested = false;
+		pm->stop_ns = 0;
+	}
+	pthread_mutex_unlock(&cashsvr_work_lock);
+
+	return rc;
+}
+
+/*
+ * cashsvr_power_request - Serves OP_TOF_START and OP_RGBC_START.
+ *			   A stop leaves the sensor up for the warm
+ *			   window, so that a restart right after it
+ *			   doesn't pay the power up again.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cashsvr_power_request(enum cash_sensor_type type, bool start)
+{
+	struct cashsvr_power *pm = &cashsvr_power[type];
+	bool alive, warm;
+	int rc = 0;
+
+	pthread_mutex_lock(&cashsvr_power_lock);
+	alive = pm->is_alive();
+	warm = !start && alive && cash_conf.power_warm_ms > 0;
+
+	pthread_mutex_lock(&cashsvr_work_lock);
+	if (start) {
+		if (alive)
+			pm->stats.warm_restarts++;
+		pm->requested = true;
+		pm->stop_ns = 0;
+		pm->last_query_ns = cashsvr_now_ns();
+	} else {
+		pm->requested = false;
+		if (warm)
+			pm->stop_ns = cashsvr_now_ns();
+	}
+	pm->want_on = false;
+
+	/* Deadlines moved: have a sleeping worker look at them again */
+	pthread_cond_signal(&cashsvr_work_cond);
+	pthread_mutex_unlock(&cashsvr_work_lock);
+
+	if (alive != start && !warm)
+		rc = cashsvr_power_set(pm, start, false);
+
+	pthread_mutex_unlock(&cashsvr_power_lock);
+
+	return rc;
+}
 
-static int cashsvr_tof_start(int ena)
+/*
+ * cashsvr_power_demand - Records that the sensors in mask are wanted
+ *			  and, if any of them is down, gets a worker to
+ *			  power it up. Never sleeps: the event loop
+ *			  calls this on each request.
+ *
+ * \param query - False for demand that isn't a client request, such
+ *		  as readings pushed to subscribers
+ */
+static void cashsvr_power_demand(unsigned int mask, bool query)
+{
+	struct cashsvr_power *pm;
+	int64_t now = cashsvr_now_ns();
+	bool wake = false;
+	int i;
+
+	if (!mask)
+		return;
+
+	pthread_mutex_lock(&cashsvr_work_lock);
+	for (i = 0; i < CASH_SENSOR_TYPE_MAX; i++) {
+		pm = &cashsvr_power[i];
+		if (!(mask & pm->mask) || cashsvr_power_disabled(i))
+			continue;
+
+		/* Can't power up what is still being set up */
+		if (!cashsvr_init_is_done(i == CASH_SENSOR_TOF ?
+					  SUBSYS_TOF : SUBSYS_RGBC))
+			continue;
+
+		pm->last_query_ns = now;
+		if (query)
+			pm->stats.queries++;
+
+		/* With no idle timeout, only explicit starts power up */
+		if (cash_conf.power_idle_ms > 0 && !pm->want_on &&
+		    !pm->is_alive()) {
+			pm->want_on = true;
+			wake = true;
+		}
+	}
+
+	if (wake)
+		pthread_cond_signal(&cashsvr_work_cond);
+	pthread_mutex_unlock(&cashsvr_work_lock);
+}
+
+/*
+ * cashsvr_power_manage - Powers up the sensors that were wanted while
+ *			  down, and powers down the ones that are due.
+ *			  Runs in the workers: powering down joins the
+ *			  sensor thread.
+ */
+static void cashsvr_power_manage(void)
+{
+	struct cashsvr_power *pm;
+	int64_t deadline;
+	bool on, off;
+	int i;
+
+	pthread_mutex_lock(&cashsvr_power_lock);
+	for (i = 0; i < CASH_SENSOR_TYPE_MAX; i++) {
+		pm = &cashsvr_power[i];
+
+		pthread_mutex_lock(&cashsvr_work_lock);
+		deadline = cashsvr_power_deadline(pm);
+		on = pm->want_on && !pm->is_alive();
+		off = deadline && deadline <= cashsvr_now_ns();
+		pm->want_on = false;
+		pthread_mutex_unlock(&cashsvr_work_lock);
+
+		if (on) {
+			ALOGD("Sensor %d wanted: powering up", i);
+			cashsvr_power_set(pm, true, true);
+		} else if (off) {
+			ALOGD("Sensor %d idle: powering down", i);
+			cashsvr_power_set(pm, false, true);
+		}
+	}
+	pthread_mutex_unlock(&cashsvr_power_lock);
+}
+
+/*
+ * cashsvr_power_ready - Takes the power up to first sample latency of
+ *			 the sensors in mask that just became ready.
+ */
+static void cashsvr_power_ready(unsigned int mask)
+{
+	struct cashsvr_power *pm;
+	int64_t now = cashsvr_now_ns();
+	int i;
+
+	pthread_mutex_lock(&cashsvr_work_lock);
+	for (i = 0; i < CASH_SENSOR_TYPE_MAX; i++) {
+		pm = &cashsvr_power[i];
+		if (!(mask & pm->mask) || !pm->enable_ns || !pm->is_ready())
+			continue;
+
+		pm->stats.ready_latency_us = (now - pm->enable_ns) / 1000LL;
+		pm->enable_ns = 0;
+		ALOGD("Sensor %d ready in %uus", i, pm->stats.ready_latency_us);
+	}
+	pthread_mutex_unlock(&cashsvr_work_lock);
+}
+
+/*
+ * cashsvr_get_stats - Gives back the power management counters, with
+ *		       the powered time of the sensors that are still up,
+ *		       and how often the server threads woke up.
+ *
+ * \return Returns zero.
+ */
+static int32_t cashsvr_get_stats(struct cash_response *cash_resp)
 {
-	return cash_input_tof_start(ena);
+	struct cash_sensor_stats *stats[CASH_SENSOR_TYPE_MAX] = {
+		[CASH_SENSOR_TOF] = &cash_resp->stats.tof,
+		[CASH_SENSOR_RGBC] = &cash_resp->stats.rgbc,
+	};
+	struct cashsvr_power *pm;
+	struct rusage ru;
+	int64_t now = cashsvr_now_ns();
+	int i;
+
+	pthread_mutex_lock(&cashsvr_work_lock);
+	for (i = 0; i < CASH_SENSOR_TYPE_MAX; i++) {
+		pm = &cashsvr_power[i];
+		*stats[i] = pm->stats;
+		if (pm->is_alive())
+			stats[i]->on_time_ms +=
+				(now - pm->on_since_ns) / 1000000LL;
+	}
+	pthread_mutex_unlock(&cashsvr_work_lock);
+
+	cash_resp->stats.rgbc.range_switches = cash_rgbc_range_switches();
+	cash_resp->stats.single_thread = cash_conf.single_thread;
+	cash_resp->stats.wakeups = cash_input_wakeups();
+
+	/* Summed up over all of the threads of the server */
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		cash_resp->stats.vol_ctx_switches = ru.ru_nvcsw;
+		cash_resp->stats.invol_ctx_switches = ru.ru_nivcsw;
+	}
+
+	return 0;
 }
 
-static int cashsvr_rgbc_start(int ena)
+/*
+ * cashsvr_tof_read - Gets the ToF reading as configured: filtered,
+ *		      stabilized or just the newest one.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cashsvr_tof_read(struct cashsvr_calib *cal,
+			    struct cash_vl53l0 *tof_data)
 {
-	return cash_input_rgbc_start(ena);
+	int tof_score;
+
+	if (cal->conf.tof_filter.type != TOF_FILTER_NONE) {
+		if (cash_tof_read_filtered(tof_data) < 0)
+			return -ENODATA;
+	} else if (cal->conf.use_tof_stabilized) {
+		tof_score = cash_tof_thr_read_stabilized(tof_data);
+		if (tof_score == -INT_MAX)
+			return -ENODATA;
+
+		ALOGD("Got tof score %d", tof_score);
+	} else {
+		if (cash_tof_read_inst(tof_data) < 0)
+			return -ENODATA;
+	}
+
+	return 0;
 }
 
 /*
@@ -79,9 +645,8 @@ static int cashsvr_rgbc_start(int ena)
  *
  * \return Returns 0 (FALSE) for "out of range" or "error" or 1 (TRUE)
  */
-int cashsvr_is_tof_in_range(void)
+int cashsvr_is_tof_in_range(struct cashsvr_calib *cal)
 {
-	int tof_score, rc;
 	struct cash_vl53l0 tof_data;
 
 	if (cash_conf.disable_tof)
@@ -90,22 +655,11 @@ int cashsvr_is_tof_in_range(void)
 	if (!cash_input_is_tof_alive())
 		return 0;
 
-	if (cash_conf.use_tof_stabilized) {
-		tof_score = cash_tof_thr_read_stabilized(&tof_data,
-				TOF_STABILIZATION_DEF_RUNS,
-				TOF_STABILIZATION_MATCH_NO,
-				TOF_STABILIZATION_WAIT_MS,
-				TOF_STABILIZATION_HYST_MM);
-
-		ALOGI("Got tof score %d", tof_score);
-	} else {
-		rc = cash_tof_read_inst(&tof_data);
-		if (rc < 0)
-			return 0;
-	}
+	if (cashsvr_tof_read(cal, &tof_data) < 0)
+		return 0;
 
-	if (tof_data.range_mm < cash_conf.tof_min ||
-	    tof_data.range_mm > cash_conf.tof_max)
+	if (tof_data.range_mm < cal->conf.tof_min ||
+	    tof_data.range_mm > cal->conf.tof_max)
 		return 0;
 
 	return 1;
@@ -117,7 +671,7 @@ int cashsvr_is_tof_in_range(void)
  *
  * \return Returns 0 (FALSE) for "out of range" or "error" or 1 (TRUE)
  */
-int cashsvr_is_rgbc_in_range(void)
+int cashsvr_is_rgbc_in_range(struct cashsvr_calib *cal)
 {
 	int rc;
 	struct cash_tcs3490 rgbc_data;
@@ -132,16 +686,106 @@ int cashsvr_is_rgbc_in_range(void)
 	if (rc < 0)
 		return 0;
 
-	if (rgbc_data.clear < cash_conf.rgbc_clear_min ||
-	    rgbc_data.clear > cash_conf.rgbc_clear_max)
+	if (rgbc_data.clear < cal->conf.rgbc_clear_min ||
+	    rgbc_data.clear > cal->conf.rgbc_clear_max)
 		return 0;
 
 	return 1;
 }
 
-int32_t cashsvr_get_exptime_iso(struct cash_response *cash_resp) {
+/*
+ * cashsvr_iso_to_exptime - Finds the exposure time that goes with an
+ *			    ISO, out of the steps of the calibration.
+ *
+ * \return Returns the exposure time or -1 if there is none.
+ */
+static int64_t cashsvr_iso_to_exptime(struct cashsvr_calib *cal, int32_t iso)
+{
+	struct cash_polyreg_tbl_entry *tbl = cal->clear_iso_conf.table;
+	uint32_t i, lo, hi, mid;
+
+	if (cal->conf.exposure_times == NULL ||
+	    cal->conf.nexposure_times <= 0)
+		return -1;
+
+	if (cal->clear_iso_descending) {
+		/* First step whose ISO threshold is not above iso */
+		lo = 0;
+		hi = cal->clear_iso_conf.num_steps;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (iso >= tbl[mid].output_val)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		i = lo;
+	} else {
+		for (i = 0; i < cal->clear_iso_conf.num_steps; i++) {
+			if (iso >= tbl[i].output_val)
+				break;
+		}
+	}
+
+	/* There may be less exposure times than ISO steps */
+	if (i >= (uint32_t)cal->conf.nexposure_times)
+		i = cal->conf.nexposure_times - 1;
+
+	return cal->conf.exposure_times[i];
+}
+
+static void cashsvr_clear_to_exptime_iso_polyreg(struct cashsvr_calib *cal,
+						 int clear, int64_t *exptime,
+						 int32_t *iso)
+{
+	*iso = (int32_t)polyreg_f(clear, cal->clear_iso_conf.terms,
+					cal->conf.rgbc_polyreg_degree);
+	*exptime = cashsvr_iso_to_exptime(cal, *iso);
+}
+
+/*
+ * cashsvr_clear_to_exptime_iso - Translates a clear channel reading
+ *				  to the exposure time and ISO pair.
+ */
+static void cashsvr_clear_to_exptime_iso(struct cashsvr_calib *cal,
+					 int clear, int64_t *exptime,
+					 int32_t *iso)
+{
+	uint32_t idx = (uint32_t)(clear - cal->conf.rgbc_clear_min);
+
+	if (cal->exposure_lut != NULL &&
+	    idx < (uint32_t)cal->exposure_lut_len) {
+		*iso = cal->exposure_lut[idx].iso;
+		*exptime = cal->exposure_lut[idx].exptime;
+		return;
+	}
+
+	/* Out of the calibrated range, or no LUT: do the math */
+	cashsvr_clear_to_exptime_iso_polyreg(cal, clear, exptime, iso);
+}
+
+static inline int32_t cashsvr_range_to_focus_polyreg(struct cashsvr_calib *cal,
+						     int range_mm)
+{
+	return (int32_t)polyreg_f(range_mm, cal->focus_conf.terms,
+					cal->conf.tof_polyreg_degree);
+}
+
+static inline int32_t cashsvr_range_to_focus(struct cashsvr_calib *cal,
+					     int range_mm)
+{
+	uint32_t idx = (uint32_t)(range_mm - cal->conf.tof_min);
+
+	if (cal->focus_lut != NULL && idx < (uint32_t)cal->focus_lut_len)
+		return cal->focus_lut[idx];
+
+	/* Out of the calibrated range, or no LUT: do the math */
+	return cashsvr_range_to_focus_polyreg(cal, range_mm);
+}
+
+int32_t cashsvr_get_exptime_iso(struct cashsvr_calib *cal,
+				struct cash_response *cash_resp) {
 	int rc;
-	uint32_t i;
 	struct cash_tcs3490 rgbc_data;
 	int64_t exptime = -1;
 	int32_t iso = -1;
@@ -150,15 +794,7 @@ int32_t cashsvr_get_exptime_iso(struct cash_response *cash_resp) {
 	if (rc < 0)
 		return rc;
 
-	iso = (int32_t)polyreg_f(rgbc_data.clear, clear_iso_conf.terms,
-					cash_conf.rgbc_polyreg_degree);
-	
-	for (i = 0; i < clear_iso_conf.num_steps; i++) {
-		if (iso >= clear_iso_conf.table[i].output_val) {
-			break;
-		}
-	}
-	exptime = cash_conf.exposure_times[i];
+	cashsvr_clear_to_exptime_iso(cal, rgbc_data.clear, &exptime, &iso);
 
 	ALOGD("Setting exposure time to %ld and iso to %d for %d clear value", exptime, iso, rgbc_data.clear);
 	cash_resp->exptime = exptime;
@@ -167,154 +803,1426 @@ int32_t cashsvr_get_exptime_iso(struct cash_response *cash_resp) {
 	return rc;
 }
 
-int32_t cashsvr_get_focus(struct cash_response *cash_resp) {
-	int tof_score, rc = -EINVAL;
+int32_t cashsvr_get_focus(struct cashsvr_calib *cal,
+			  struct cash_response *cash_resp) {
 	int32_t focus_step;
 	struct cash_vl53l0 tof_data;
 
-	if (cash_conf.use_tof_stabilized) {
-		tof_score = cash_tof_thr_read_stabilized(&tof_data,
-				cash_conf.tof_max_runs,
-				TOF_STABILIZATION_MATCH_NO,
-				TOF_STABILIZATION_WAIT_MS,
-				cash_conf.tof_hyst);
-	} else {
-		rc = cash_tof_read_inst(&tof_data);
-		if (rc < 0)
-			return 0;
-	}
+	if (cashsvr_tof_read(cal, &tof_data) < 0)
+		return 0;
 
-	focus_step = (int32_t)polyreg_f(tof_data.range_mm, focus_conf.terms,
-					cash_conf.tof_polyreg_degree);
+	focus_step = cashsvr_range_to_focus(cal, tof_data.range_mm);
 
 	ALOGD("Setting focus %d for %dmm", focus_step, tof_data.range_mm);
 	cash_resp->focus_step = focus_step;
 
-	return rc;
+	return 1;
 }
 
-
 /*
- * cash_dispatch - Recognizes the requested operation and calls
- *		    the appropriate functions.
+ * cashsvr_fill_response - Translates one reading per sensor to focus,
+ *			   exposure and range flags.
  *
- * \return Returns success(0) or negative errno.
+ * \param tof_rc - Negative if there is no ToF reading
+ * \param tof_data - ToF reading, range_mm is set to -1 if unavailable
+ * \param rgbc_rc - Negative if there is no RGBC reading
+ * \param rgbc_data - RGBC reading, clear is set to -1 if unavailable
+ *
+ * \return Returns zero or -ENODATA if no sensor gave a reading.
  */
-static int32_t cash_dispatch(struct cash_params *params, struct cash_response *cash_resp)
+static int32_t cashsvr_fill_response(struct cashsvr_calib *cal,
+				     struct cash_response *cash_resp,
+				     int tof_rc, struct cash_vl53l0 *tof_data,
+				     int rgbc_rc, struct cash_tcs3490 *rgbc_data)
 {
-	int32_t rc;
-	int val = params->value;
+	cash_resp->tof_in_range = false;
+	cash_resp->rgbc_in_range = false;
+
+	if (tof_rc >= 0) {
+		cash_resp->focus_step =
+			cashsvr_range_to_focus(cal, tof_data->range_mm);
+		cash_resp->tof_in_range =
+			tof_data->range_mm >= cal->conf.tof_min &&
+			tof_data->range_mm <= cal->conf.tof_max;
+	} else {
+		tof_data->range_mm = -1;
+	}
 
-	switch (params->operation) {
-	case OP_TOF_START:
-		rc = cashsvr_tof_start(val);
-		break;
-	case OP_CHECK_TOF_RANGE:
-		rc = cashsvr_is_tof_in_range();
-		break;
-	case OP_FOCUS_GET:
-		rc = cashsvr_get_focus(cash_resp);
-		break;
-	case OP_RGBC_START:
-		rc = cashsvr_rgbc_start(val);
-		break;
-	case OP_CHECK_RGBC_RANGE:
-		rc = cashsvr_is_rgbc_in_range();
-		break;
-	case OP_EXPTIME_ISO_GET:
-		rc = cashsvr_get_exptime_iso(cash_resp);
-		break;
-	default:
-		ALOGE("Invalid operation requested.");
-		rc = -2;
+	if (rgbc_rc >= 0) {
+		cashsvr_clear_to_exptime_iso(cal, rgbc_data->clear,
+				&cash_resp->exptime, &cash_resp->iso);
+		cash_resp->rgbc_in_range =
+			rgbc_data->clear >= cal->conf.rgbc_clear_min &&
+			rgbc_data->clear <= cal->conf.rgbc_clear_max;
+	} else {
+		rgbc_data->clear = -1;
 	}
 
-	cash_resp->retval = rc;
-	return rc;
+	if (tof_rc < 0 && rgbc_rc < 0)
+		return -ENODATA;
+
+	return 0;
 }
 
-static void *cashsvr_looper(void *unusedvar UNUSED)
+/*
+ * cashsvr_get_snapshot - Fills in every field of the response out of
+ *			  a single reading per sensor, so that focus,
+ *			  exposure and range flags are consistent.
+ *
+ * \param tof_data - Raw ToF reading, range_mm is -1 if unavailable
+ * \param rgbc_data - Raw RGBC reading, clear is -1 if unavailable
+ *
+ * \return Returns zero or -ENODATA if no sensor gave a reading.
+ */
+int32_t cashsvr_get_snapshot(struct cashsvr_calib *cal,
+			     struct cash_response *cash_resp,
+			     struct cash_vl53l0 *tof_data,
+			     struct cash_tcs3490 *rgbc_data)
 {
-	int ret = -EINVAL;
-	uint8_t retry;
-	socklen_t clientlen = sizeof(struct sockaddr_un);
-	struct sockaddr_un client_addr;
-	struct cash_params extparams;
-	struct cash_response cash_resp = { 0, -1, -1, -1 };
+	int tof_rc = -1, rgbc_rc = -1;
 
-reloop:
-	ALOGI("CASH Server is waiting for connection...");
-	if (clientsock)
-		close(clientsock);
-	retry = 0;
-	while (((clientsock = accept(sock, (struct sockaddr*)&client_addr,
-		&clientlen)) > 0) && (ucthread_run == true))
-	{
-		ret = recv(clientsock, &extparams,
-			sizeof(struct cash_params), 0);
-		if (!ret) {
-			ALOGE("Cannot receive data from client");
-			goto reloop;
-		}
+	tof_data->range_mm = -1;
+	tof_data->distance = -1;
+	rgbc_data->clear = -1;
 
-		if (ret != sizeof(struct cash_params)) {
-			ALOGE("Received data size mismatch!!");
-			goto reloop;
-		} else ret = 0;
+	if (!cash_conf.disable_tof && cash_input_is_tof_alive())
+		tof_rc = cashsvr_tof_read(cal, tof_data);
 
-		ret = cash_dispatch(&extparams, &cash_resp);
-		if (ret < 0) {
-			ALOGE("Cannot dispatch. Error %d", ret);
-			goto reloop;
-		}
+	if (!cash_conf.disable_rgbc && cash_input_is_rgbc_alive())
+		rgbc_rc = cash_rgbc_read_inst(rgbc_data);
 
-retry_send:
-		retry++;
-		ret = send(clientsock, &cash_resp,
-			sizeof(cash_resp), 0);
-		if (ret == -1) {
-			if (retry < 50)
-				goto retry_send;
-			ALOGE("ERROR: Cannot send reply!!!");
-			goto reloop;
-		} else retry = 0;
+	return cashsvr_fill_response(cal, cash_resp, tof_rc, tof_data,
+				     rgbc_rc, rgbc_data);
+}
 
-		if (clientsock)
-			close(clientsock);
-	}
+/*
+ * cashsvr_clock_offset - Gets how far a CASH_CLOCK_* clock is ahead of
+ *			  CLOCK_MONOTONIC, which samples are taken on.
+ *
+ * \return Returns zero or -EINVAL for unknown clocks.
+ */
+static int cashsvr_clock_offset(int32_t clock_id, int64_t *clock_off)
+{
+	struct timespec mono, boot;
 
-	ALOGI("Camera Augmented Sensing Helper Server terminated.");
-	pthread_exit((void*)((int)0));
+	switch (clock_id) {
+	case CASH_CLOCK_MONOTONIC:
+		*clock_off = 0;
+		return 0;
+	case CASH_CLOCK_BOOTTIME:
+		/* CLOCK_MONOTONIC stops in suspend, CLOCK_BOOTTIME doesn't */
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		clock_gettime(CLOCK_BOOTTIME, &boot);
+		*clock_off = (boot.tv_sec - mono.tv_sec) * 1000000000LL +
+			     (boot.tv_nsec - mono.tv_nsec);
+		return 0;
+	default:
+		return -EINVAL;
+	}
 }
 
-static int manage_cashsvr(bool start)
+/*
+ * cashsvr_get_focus_at - Gives back the focus step for the range
+ *			  predicted at the requested time, and the
+ *			  radial speed it was predicted with.
+ *
+ * \param params - Target time and its clock
+ *
+ * \return Returns 1 or 0 (FALSE) for error.
+ */
+int32_t cashsvr_get_focus_at(struct cashsvr_calib *cal,
+			     struct cash_params *params,
+			     struct cash_response *cash_resp)
 {
-	int ret;
-	struct stat st = {0};
+	struct cash_vl53l0 tof_data;
+	int64_t clock_off;
+	int32_t speed_mm_s;
 
-	if (start == false) {
-		ucthread_run = false;
-		if (clientsock) {
-			shutdown(clientsock, SHUT_RDWR);
-			close(clientsock);
-		}
-		if (sock) {
-			shutdown(sock, SHUT_RDWR);
-			close(sock);
-		}
+	cash_resp->range_mm = -1;
 
+	if (cash_conf.disable_tof)
 		return 0;
-	}
+
+	if (cashsvr_clock_offset(params->clock_id, &clock_off) < 0)
+		return 0;
+
+	if (cash_tof_predict(params->timestamp_ns - clock_off,
+			     &tof_data, &speed_mm_s) < 0)
+		return 0;
+
+	cash_resp->focus_step = cashsvr_range_to_focus(cal, tof_data.range_mm);
+	cash_resp->range_mm = tof_data.range_mm;
+	cash_resp->speed_mm_s = speed_mm_s;
+	cash_resp->tof_timestamp_ns = tof_data.timestamp_ns + clock_off;
+
+	ALOGD("Setting focus %d for %dmm predicted at %dmm/s",
+		cash_resp->focus_step, tof_data.range_mm, speed_mm_s);
+
+	return 1;
+}
+
+/*
+ * cashsvr_get_focus_roi - Gives back the focus step for the range over
+ *			   a region of the field of view. ToFs with one
+ *			   zone only cover the center: their range is
+ *			   used whatever the region is.
+ *
+ * \param params - Region, normalized to the field of view
+ *
+ * \return Returns 1 or 0 (FALSE) for error.
+ */
+int32_t cashsvr_get_focus_roi(struct cashsvr_calib *cal,
+			      struct cash_params *params,
+			      struct cash_response *cash_resp)
+{
+	struct cash_tof_zones zones;
+	struct cash_vl53l0 tof_data;
+	int range_mm, used = 1;
+
+	cash_resp->range_mm = -1;
+
+	if (cash_conf.disable_tof)
+		return 0;
+
+	if (cash_tof_read_zones(&zones) == 0) {
+		range_mm = cash_tof_zones_reduce(&zones, &params->roi, &used);
+		if (range_mm < 0)
+			return 0;
+
+		tof_data.timestamp_ns = zones.timestamp_ns;
+	} else {
+		if (cashsvr_tof_read(cal, &tof_data) < 0)
+			return 0;
+
+		range_mm = tof_data.range_mm;
+	}
+
+	cash_resp->focus_step = cashsvr_range_to_focus(cal, range_mm);
+	cash_resp->range_mm = range_mm;
+	cash_resp->zones = used;
+	cash_resp->tof_timestamp_ns = tof_data.timestamp_ns;
+
+	ALOGD("Setting focus %d for %dmm over %d zones",
+		cash_resp->focus_step, range_mm, used);
+
+	return 1;
+}
+
+/*
+ * cashsvr_get_color - Gives back lux, color temperature and white
+ *		       balance gains out of the last RGBC-IR reading.
+ *
+ * \return Returns 1 or 0 (FALSE) for error.
+ */
+int32_t cashsvr_get_color(struct cash_response *cash_resp)
+{
+	struct cash_tcs3490 rgbc_data;
+
+	if (cash_conf.disable_rgbc)
+		return 0;
+
+	if (cash_rgbc_read_inst(&rgbc_data) < 0)
+		return 0;
+
+	if (cash_color_process(&cashsvr_color_calib, &rgbc_data,
+			       &cash_resp->color) < 0)
+		return 0;
+
+	ALOGD("Color: %d lux, %dK, gains R %.3f B %.3f",
+		cash_resp->color.lux, cash_resp->color.cct,
+		cash_resp->color.awb_gain_r, cash_resp->color.awb_gain_b);
+
+	return 1;
+}
+
+/*
+ * cashsvr_get_flicker - Gives back the light flicker found by the last
+ *			 RGBC burst.
+ *
+ * \return Returns 1 or 0 (FALSE) for error.
+ */
+int32_t cashsvr_get_flicker(struct cash_response *cash_resp)
+{
+	if (cash_conf.disable_rgbc)
+		return 0;
+
+	if (cash_rgbc_read_flicker(&cash_resp->flicker) < 0)
+		return 0;
+
+	ALOGD("Flicker: %dHz, confidence %.2f",
+		cash_resp->flicker.freq_hz, cash_resp->flicker.confidence);
+
+	return 1;
+}
+
+/*
+ * cashsvr_get_sample_at - Fills in the response out of the readings
+ *			   taken at the requested time.
+ *
+ * \param params - Time, clock and CASH_SAMPLE_* mode of the request
+ *
+ * \return Returns zero or negative errno.
+ */
+int32_t cashsvr_get_sample_at(struct cashsvr_calib *cal,
+			      struct cash_params *params,
+			      struct cash_response *cash_resp)
+{
+	struct cash_vl53l0 tof_data;
+	struct cash_tcs3490 rgbc_data;
+	int64_t clock_off, timestamp_ns;
+	bool interpolate = params->value == CASH_SAMPLE_INTERPOLATE;
+	int tof_rc = -1, rgbc_rc = -1, rc;
+
+	cash_resp->range_mm = -1;
+	cash_resp->clear = -1;
+
+	rc = cashsvr_clock_offset(params->clock_id, &clock_off);
+	if (rc < 0)
+		return rc;
+	timestamp_ns = params->timestamp_ns - clock_off;
+
+	if (!cash_conf.disable_tof)
+		tof_rc = cash_tof_sample_at(timestamp_ns, interpolate,
+					    &tof_data);
+
+	if (!cash_conf.disable_rgbc)
+		rgbc_rc = cash_rgbc_sample_at(timestamp_ns, interpolate,
+					      &rgbc_data);
+
+	rc = cashsvr_fill_response(cal, cash_resp, tof_rc, &tof_data,
+				   rgbc_rc, &rgbc_data);
+
+	cash_resp->range_mm = tof_data.range_mm;
+	cash_resp->clear = rgbc_data.clear;
+	cash_resp->tof_timestamp_ns = tof_rc < 0 ? 0 :
+				      tof_data.timestamp_ns + clock_off;
+	cash_resp->rgbc_timestamp_ns = rgbc_rc < 0 ? 0 :
+				       rgbc_data.timestamp_ns + clock_off;
+
+	return rc;
+}
+
+static void cashsvr_notify_arm_update(void)
+{
+	cash_input_notify_arm(cashsvr_subscribers != NULL ||
+			      cashsvr_waiters != NULL ||
+			      cashsvr_shm_active);
+}
+
+static unsigned int cashsvr_ready_mask(void)
+{
+	unsigned int mask = 0;
+
+	if (!cash_conf.disable_tof && cash_input_is_tof_ready())
+		mask |= CASH_SUBSCRIBE_TOF;
+	if (!cash_conf.disable_rgbc && cash_input_is_rgbc_ready())
+		mask |= CASH_SUBSCRIBE_RGBC;
+
+	return mask;
+}
+
+/*
+ * cashsvr_get_ready - Tells which sensors gave their first readings
+ *		       out since they were started.
+ *
+ * \return Returns 1 (TRUE) if all of the requested ones did.
+ */
+static int32_t cashsvr_get_ready(struct cash_params *params,
+				 struct cash_response *cash_resp)
+{
+	unsigned int want = params->value &
+			    (CASH_SUBSCRIBE_TOF | CASH_SUBSCRIBE_RGBC);
+
+	cash_resp->ready_mask = cashsvr_ready_mask();
+
+	return (cash_resp->ready_mask & want) == want;
+}
+
+/*
+ * cashsvr_shm_update - Publishes the readings of the sensors in mask
+ *			to the shared memory snapshot.
+ */
+static void cashsvr_shm_update(unsigned int mask,
+			       struct cash_response *cash_resp,
+			       struct cash_vl53l0 *tof_data,
+			       struct cash_tcs3490 *rgbc_data)
+{
+	struct cash_shm_data *data = &cashsvr_shm_data;
+	int64_t now = cashsvr_now_ns();
+
+	if (!cashsvr_shm_active)
+		return;
+
+	if ((mask & CASH_SUBSCRIBE_TOF) && tof_data->range_mm >= 0) {
+		data->tof_timestamp_ns = tof_data->timestamp_ns ?: now;
+		data->range_mm = tof_data->range_mm;
+		data->distance = tof_data->distance;
+		data->focus_step = cash_resp->focus_step;
+		data->tof_in_range = cash_resp->tof_in_range;
+	}
+
+	if ((mask & CASH_SUBSCRIBE_RGBC) && rgbc_data->clear >= 0) {
+		data->rgbc_timestamp_ns = rgbc_data->timestamp_ns ?: now;
+		data->clear = rgbc_data->clear;
+		data->iso = cash_resp->iso;
+		data->exptime = cash_resp->exptime;
+		data->rgbc_in_range = cash_resp->rgbc_in_range;
+	}
+
+	cash_shm_publish(data);
+}
+
+/*
+ * cashsvr_shm_start - Makes sure that the shared snapshot exists and
+ *		       gets refreshed on every new sample.
+ *		       The descriptor is attached to the reply later.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int32_t cashsvr_shm_start(struct cashsvr_calib *cal,
+				 struct cash_response *cash_resp)
+{
+	struct cash_vl53l0 tof_data;
+	struct cash_tcs3490 rgbc_data;
+	int fd;
+
+	fd = cash_shm_get_fd();
+	if (fd < 0)
+		return fd;
+
+	if (cashsvr_shm_active)
+		return 0;
+
+	cashsvr_shm_active = true;
+	cashsvr_notify_arm_update();
+
+	/* Don't let the first reader find it empty */
+	if (cashsvr_get_snapshot(cal, cash_resp, &tof_data, &rgbc_data) == 0)
+		cashsvr_shm_update(CASH_SUBSCRIBE_TOF | CASH_SUBSCRIBE_RGBC,
+				   cash_resp, &tof_data, &rgbc_data);
+
+	return 0;
+}
+
+/*
+ * cash_dispatch - Recognizes the requested operation and calls
+ *		    the appropriate functions.
+ *
+ * \return Returns success(0) or negative errno.
+ */
+static int32_t cash_dispatch(struct cash_params *params, struct cash_response *cash_resp)
+{
+	struct cash_vl53l0 tof_data;
+	struct cash_tcs3490 rgbc_data;
+	struct cashsvr_calib *cal;
+	int32_t rc;
+	int val = params->value;
+
+	/* One calibration for the whole request, even across a reload */
+	cal = cashsvr_calib_get();
+
+	switch (params->operation) {
+	case OP_TOF_START:
+		rc = cashsvr_power_request(CASH_SENSOR_TOF, val);
+		break;
+	case OP_CHECK_TOF_RANGE:
+		rc = cashsvr_is_tof_in_range(cal);
+		break;
+	case OP_FOCUS_GET:
+		if (params->timestamp_ns)
+			rc = cashsvr_get_focus_at(cal, params, cash_resp);
+		else
+			rc = cashsvr_get_focus(cal, cash_resp);
+		break;
+	case OP_RGBC_START:
+		rc = cashsvr_power_request(CASH_SENSOR_RGBC, val);
+		break;
+	case OP_CHECK_RGBC_RANGE:
+		rc = cashsvr_is_rgbc_in_range(cal);
+		break;
+	case OP_EXPTIME_ISO_GET:
+		rc = cashsvr_get_exptime_iso(cal, cash_resp);
+		break;
+	case OP_SNAPSHOT_GET:
+		rc = cashsvr_get_snapshot(cal, cash_resp, &tof_data,
+					  &rgbc_data);
+		break;
+	case OP_SHM_GET:
+		rc = cashsvr_shm_start(cal, cash_resp);
+		break;
+	case OP_SAMPLE_AT:
+		rc = cashsvr_get_sample_at(cal, params, cash_resp);
+		break;
+	case OP_WAIT_READY:
+		/* Waiting is done by the event loop */
+		rc = cashsvr_get_ready(params, cash_resp);
+		break;
+	case OP_SUBSCRIBE:
+		/* Bookkeeping is done by the event loop */
+		rc = 0;
+		break;
+	case OP_STATS:
+		rc = cashsvr_get_stats(cash_resp);
+		break;
+	case OP_FOCUS_ROI_GET:
+		rc = cashsvr_get_focus_roi(cal, params, cash_resp);
+		break;
+	case OP_COLOR_GET:
+		rc = cashsvr_get_color(cash_resp);
+		break;
+	case OP_FLICKER_GET:
+		rc = cashsvr_get_flicker(cash_resp);
+		break;
+	default:
+		ALOGE("Invalid operation requested.");
+		rc = -2;
+	}
+
+	cashsvr_calib_put(cal);
+
+	cash_resp->retval = rc;
+	return rc;
+}
+
+/*
+ * cashsvr_op_is_slow - Tells whether an operation may sleep for long
+ *			and must therefore be kept out of the event loop
+ *
+ * \return Returns true if the operation has to be run by a worker.
+ */
+static bool cashsvr_op_is_slow(struct cash_params *params)
+{
+	switch (params->operation) {
+	case OP_TOF_START:
+	case OP_RGBC_START:
+		/* Stopping joins the sensor thread: may take a while */
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * cashsvr_op_sensors - Tells which sensors an operation reads from.
+ *
+ * \return Returns a CASH_SUBSCRIBE_* mask.
+ */
+static unsigned int cashsvr_op_sensors(struct cash_params *params)
+{
+	switch (params->operation) {
+	case OP_CHECK_TOF_RANGE:
+	case OP_FOCUS_GET:
+	case OP_FOCUS_ROI_GET:
+		return CASH_SUBSCRIBE_TOF;
+	case OP_CHECK_RGBC_RANGE:
+	case OP_EXPTIME_ISO_GET:
+	case OP_COLOR_GET:
+	case OP_FLICKER_GET:
+		return CASH_SUBSCRIBE_RGBC;
+	case OP_SNAPSHOT_GET:
+	case OP_SHM_GET:
+	case OP_SAMPLE_AT:
+		return CASH_SUBSCRIBE_TOF | CASH_SUBSCRIBE_RGBC;
+	case OP_SUBSCRIBE:
+	case OP_WAIT_READY:
+		return params->value &
+		       (CASH_SUBSCRIBE_TOF | CASH_SUBSCRIBE_RGBC);
+	default:
+		/* Explicit starts and stops are accounted on their own */
+		return 0;
+	}
+}
+
+/*
+ * cashsvr_op_unready - Tells whether an operation has to wait for the
+ *			sensors it needs to be initialized.
+ *
+ * Partial answers are fine: a snapshot is served as soon as one of
+ * the two sensors can be read.
+ *
+ * \return Returns the CASH_SUBSCRIBE_* mask of the sensors that are
+ *	   not initialized yet, or zero if the operation can be served.
+ */
+static unsigned int cashsvr_op_unready(struct cash_params *params)
+{
+	unsigned int want, unready = 0;
+
+	switch (params->operation) {
+	case OP_TOF_START:
+		want = CASH_SUBSCRIBE_TOF;
+		break;
+	case OP_RGBC_START:
+		want = CASH_SUBSCRIBE_RGBC;
+		break;
+	case OP_SUBSCRIBE:
+	case OP_SHM_GET:
+	case OP_WAIT_READY:
+		/* These get their readings as the sensors come up */
+		return 0;
+	default:
+		want = cashsvr_op_sensors(params);
+	}
+
+	if ((want & CASH_SUBSCRIBE_TOF) && !cashsvr_init_is_done(SUBSYS_TOF))
+		unready |= CASH_SUBSCRIBE_TOF;
+	if ((want & CASH_SUBSCRIBE_RGBC) && !cashsvr_init_is_done(SUBSYS_RGBC))
+		unready |= CASH_SUBSCRIBE_RGBC;
+
+	return unready == want ? unready : 0;
+}
+
+static void cashsvr_client_unsubscribe(struct cashsvr_client *cli)
+{
+	struct cashsvr_client **pcli;
+
+	if (!cli->sub_mask)
+		return;
+
+	for (pcli = &cashsvr_subscribers; *pcli; pcli = &(*pcli)->sub_next) {
+		if (*pcli == cli) {
+			*pcli = cli->sub_next;
+			break;
+		}
+	}
+	cli->sub_mask = 0;
+
+	cashsvr_notify_arm_update();
+}
+
+/*
+ * cashsvr_client_subscribe - Registers the client for pushes about
+ *			      the sensors in params.value, or removes
+ *			      the subscription if that is zero.
+ */
+static void cashsvr_client_subscribe(struct cashsvr_client *cli)
+{
+	unsigned int mask = cli->params.value &
+			    (CASH_SUBSCRIBE_TOF | CASH_SUBSCRIBE_RGBC);
+
+	if (!mask) {
+		cashsvr_client_unsubscribe(cli);
+		return;
+	}
+
+	if (!cli->sub_mask) {
+		cli->sub_next = cashsvr_subscribers;
+		cashsvr_subscribers = cli;
+	}
+
+	cli->sub_mask = mask;
+	cli->focus_delta = abs(cli->params.focus_delta);
+	cli->iso_delta = abs(cli->params.iso_delta);
+	cli->pushed = false;
+
+	cashsvr_notify_arm_update();
+}
+
+/*
+ * cashsvr_client_close - Ends a client session. The batch of events
+ *			  being served by the event loop may still hold
+ *			  some of the client, when it's the one closing
+ *			  it: the client gets freed after the batch then.
+ */
+static void cashsvr_client_close(struct cashsvr_client *cli)
+{
+	cashsvr_client_unsubscribe(cli);
+	epoll_ctl(cashsvr_epfd, EPOLL_CTL_DEL, cli->src.fd, NULL);
+	close(cli->src.fd);
+
+	if (cashsvr_is_looper) {
+		cli->src.dead = true;
+		cli->next = cashsvr_dead;
+		cashsvr_dead = cli;
+		return;
+	}
+
+	free(cli);
+}
+
+static void cashsvr_client_reap(void)
+{
+	struct cashsvr_client *cli;
+
+	while (cashsvr_dead) {
+		cli = cashsvr_dead;
+		cashsvr_dead = cli->next;
+		free(cli);
+	}
+}
+
+/*
+ * cashsvr_client_arm - (Re)arms a client socket in the event loop.
+ *
+ * Client sockets are registered as one-shot: once an event fires,
+ * nobody else touches the client until this gets called again, so
+ * a client being served by a worker is never read concurrently.
+ */
+static int cashsvr_client_arm(struct cashsvr_client *cli, int op)
+{
+	struct epoll_event evt;
+
+	evt.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	evt.data.ptr = &cli->src;
+
+	return epoll_ctl(cashsvr_epfd, op, cli->src.fd, &evt);
+}
+
+/*
+ * cashsvr_send_reply - Sends a reply, passing the fd descriptor
+ *			along with it if that is not negative.
+ */
+static int cashsvr_send_reply(int csock, struct cash_response *cash_resp,
+			      int fd)
+{
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctrl;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = cash_resp;
+	iov.iov_len = sizeof(struct cash_response);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fd >= 0) {
+		memset(&ctrl, 0, sizeof(ctrl));
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = sizeof(ctrl.buf);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	return sendmsg(csock, &msg, MSG_NOSIGNAL);
+}
+
+/*
+ * cashsvr_client_reply - Sends the reply to the pending client request
+ *			  and gives the client back to the event loop.
+ */
+static void cashsvr_client_reply(struct cashsvr_client *cli,
+				 struct cash_response *cash_resp, int fd)
+{
+	int ret;
+	uint8_t retry = 0;
+
+	do {
+		retry++;
+		ret = cashsvr_send_reply(cli->src.fd, cash_resp, fd);
+	} while (ret == -1 && errno == EAGAIN && retry < 50);
+
+	if (ret == -1) {
+		if (errno != EPIPE)
+			ALOGE("ERROR: Cannot send reply!!!");
+		cashsvr_client_close(cli);
+		return;
+	}
+
+	if (cashsvr_client_arm(cli, EPOLL_CTL_MOD) < 0)
+		cashsvr_client_close(cli);
+}
+
+/*
+ * cashsvr_client_process - Dispatches the pending client request,
+ *			    sends the reply and gives the client back
+ *			    to the event loop.
+ */
+static void cashsvr_client_process(struct cashsvr_client *cli)
+{
+	int ret, fd = -1;
+	struct cash_response cash_resp = {
+		.focus_step = -1,
+		.exptime = -1,
+		.iso = -1,
+		.range_mm = -1,
+		.clear = -1,
+	};
+
+	ret = cash_dispatch(&cli->params, &cash_resp);
+	if (ret < 0)
+		ALOGE("Cannot dispatch. Error %d", ret);
+	else if (cli->params.operation == OP_SHM_GET)
+		fd = cash_shm_get_fd();
+
+	/*
+	 * Always reply, even on dispatch failure, so that a
+	 * persistent client doesn't wait for the timeout.
+	 */
+	cashsvr_client_reply(cli, &cash_resp, fd);
+}
+
+/*
+ * cashsvr_client_wait - Defers the reply to OP_WAIT_READY until the
+ *			 sensors are ready or the timeout expires.
+ *
+ * The client socket stays disarmed meanwhile, just like when a
+ * worker serves it: nothing else can be asked on that connection.
+ */
+static void cashsvr_client_wait(struct cashsvr_client *cli)
+{
+	int32_t timeout_ms = cli->params.timeout_ms;
+
+	if (timeout_ms > CASH_WAIT_READY_MAX_MS)
+		timeout_ms = CASH_WAIT_READY_MAX_MS;
+
+	cli->wait_deadline_ns = cashsvr_now_ns() +
+				(int64_t)timeout_ms * 1000000LL;
+	cli->wait_next = cashsvr_waiters;
+	cashsvr_waiters = cli;
+
+	/* New samples may mean ready sensors: get woken up for them */
+	cashsvr_notify_arm_update();
+}
+
+/*
+ * cashsvr_waiters_check - Replies to the OP_WAIT_READY requests that
+ *			   are satisfied or timed out.
+ */
+static void cashsvr_waiters_check(void)
+{
+	struct cashsvr_client **pcli, *cli;
+	unsigned int mask = cashsvr_ready_mask();
+	unsigned int want;
+	int64_t now = cashsvr_now_ns();
+
+	pcli = &cashsvr_waiters;
+	while ((cli = *pcli) != NULL) {
+		want = cli->params.value &
+		       (CASH_SUBSCRIBE_TOF | CASH_SUBSCRIBE_RGBC);
+
+		if ((mask & want) != want && now < cli->wait_deadline_ns) {
+			pcli = &cli->wait_next;
+			continue;
+		}
+
+		*pcli = cli->wait_next;
+		cashsvr_client_process(cli);
+	}
+
+	cashsvr_notify_arm_update();
+}
+
+/*
+ * cashsvr_waiters_deadline - Gets when the first OP_WAIT_READY request
+ *			      times out.
+ *
+ * \return Returns CLOCK_MONOTONIC nanoseconds, or zero for none.
+ */
+static int64_t cashsvr_waiters_deadline(void)
+{
+	struct cashsvr_client *cli;
+	int64_t first = INT64_MAX;
+
+	if (cashsvr_waiters == NULL)
+		return 0;
+
+	for (cli = cashsvr_waiters; cli; cli = cli->wait_next)
+		if (cli->wait_deadline_ns < first)
+			first = cli->wait_deadline_ns;
+
+	return first;
+}
+
+/*
+ * cashsvr_waiters_timeout - Gets how long the event loop may sleep
+ *			     before a OP_WAIT_READY request times out.
+ *
+ * \return Returns milliseconds, or -1 for no pending requests.
+ */
+static int cashsvr_waiters_timeout(void)
+{
+	int64_t first, left;
+
+	first = cashsvr_waiters_deadline();
+	if (first == 0)
+		return -1;
+
+	left = first - cashsvr_now_ns();
+	if (left <= 0)
+		return 0;
+
+	/* Round up, or we'd spin for the last fraction of millisecond */
+	return (int)((left + 999999) / 1000000);
+}
+
+static void *cashsvr_worker(void *unusedvar UNUSED)
+{
+	struct cashsvr_client *cli;
+	struct timespec ts;
+	int64_t next;
+
+	pthread_mutex_lock(&cashsvr_work_lock);
+	while (ucthread_run == true) {
+		cli = cashsvr_work_head;
+		if (cli == NULL) {
+			/* No requests: sleep until power is due, if ever */
+			next = cashsvr_power_next();
+			if (next == 0) {
+				pthread_cond_wait(&cashsvr_work_cond,
+						  &cashsvr_work_lock);
+				cash_input_count_wakeup();
+				continue;
+			}
+
+			if (next > cashsvr_now_ns()) {
+				ts.tv_sec = next / 1000000000LL;
+				ts.tv_nsec = next % 1000000000LL;
+				pthread_cond_timedwait(&cashsvr_work_cond,
+						       &cashsvr_work_lock, &ts);
+				cash_input_count_wakeup();
+				continue;
+			}
+
+			pthread_mutex_unlock(&cashsvr_work_lock);
+			cashsvr_power_manage();
+			pthread_mutex_lock(&cashsvr_work_lock);
+			continue;
+		}
+
+		cashsvr_work_head = cli->next;
+		if (cashsvr_work_head == NULL)
+			cashsvr_work_tail = NULL;
+		pthread_mutex_unlock(&cashsvr_work_lock);
+
+		cashsvr_client_process(cli);
+
+		pthread_mutex_lock(&cashsvr_work_lock);
+	}
+	pthread_mutex_unlock(&cashsvr_work_lock);
+
+	return NULL;
+}
+
+static void cashsvr_work_queue(struct cashsvr_client *cli)
+{
+	cli->next = NULL;
+
+	pthread_mutex_lock(&cashsvr_work_lock);
+	if (cashsvr_work_tail)
+		cashsvr_work_tail->next = cli;
+	else
+		cashsvr_work_head = cli;
+	cashsvr_work_tail = cli;
+	pthread_cond_signal(&cashsvr_work_cond);
+	pthread_mutex_unlock(&cashsvr_work_lock);
+}
+
+static void cashsvr_client_handler(struct cashsvr_evsrc *src, uint32_t events)
+{
+	struct cashsvr_client *cli = (struct cashsvr_client*)src;
+	struct cash_response cash_resp;
+	unsigned int unready;
+	int ret;
+
+	if (!(events & EPOLLIN)) {
+		/* Hangup or error without pending requests */
+		cashsvr_client_close(cli);
+		return;
+	}
+
+	ret = recv(src->fd, &cli->params, sizeof(struct cash_params), 0);
+	if (ret == 0) {
+		/* Client closed the session */
+		cashsvr_client_close(cli);
+		return;
+	}
+
+	if (ret < 0) {
+		if (errno == EAGAIN && cashsvr_client_arm(cli,
+						EPOLL_CTL_MOD) == 0)
+			return;
+		ALOGE("Cannot receive data from client");
+		cashsvr_client_close(cli);
+		return;
+	}
+
+	if (ret != sizeof(struct cash_params)) {
+		ALOGE("Received data size mismatch!!");
+		cashsvr_client_close(cli);
+		return;
+	}
+
+	cashsvr_power_demand(cashsvr_op_sensors(&cli->params), true);
+
+	/*
+	 * A subscribed connection carries pushes: replies to any other
+	 * request would be indistinguishable from them.
+	 */
+	if (cli->params.operation == OP_SUBSCRIBE) {
+		cashsvr_client_subscribe(cli);
+	} else if (cli->sub_mask) {
+		ALOGE("Unexpected request on a subscribed connection");
+		cashsvr_client_close(cli);
+		return;
+	}
+
+	/* Still booting: don't make the client wait for it */
+	unready = cashsvr_op_unready(&cli->params);
+	if (unready) {
+		memset(&cash_resp, 0, sizeof(cash_resp));
+		cash_resp.focus_step = -1;
+		cash_resp.exptime = -1;
+		cash_resp.iso = -1;
+		cash_resp.unready_mask = unready;
+		cashsvr_client_reply(cli, &cash_resp, -1);
+		return;
+	}
+
+	if (cli->params.operation == OP_WAIT_READY &&
+	    cli->params.timeout_ms > 0 &&
+	    !cashsvr_get_ready(&cli->params, &cash_resp)) {
+		cashsvr_client_wait(cli);
+		return;
+	}
+
+	/* With no workers around, everything is served right here */
+	if (!cash_conf.single_thread && cashsvr_op_is_slow(&cli->params))
+		cashsvr_work_queue(cli);
+	else
+		cashsvr_client_process(cli);
+}
+
+/*
+ * cashsvr_push_wanted - Decides whether a subscriber has to be told
+ *			 about the new readings.
+ *
+ * A zero delta means that every new sample gets pushed.
+ */
+static bool cashsvr_push_wanted(struct cashsvr_client *cli,
+				unsigned int mask,
+				struct cash_response *resp)
+{
+	struct cash_response *last = &cli->last_push;
+
+	if (!(cli->sub_mask & mask))
+		return false;
+
+	if (!cli->pushed)
+		return true;
+
+	if ((mask & CASH_SUBSCRIBE_TOF) &&
+	    (last->tof_in_range != resp->tof_in_range ||
+	     cli->focus_delta == 0 ||
+	     abs(last->focus_step - resp->focus_step) > cli->focus_delta))
+		return true;
+
+	if ((mask & CASH_SUBSCRIBE_RGBC) &&
+	    (last->rgbc_in_range != resp->rgbc_in_range ||
+	     cli->iso_delta == 0 ||
+	     abs(last->iso - resp->iso) > cli->iso_delta))
+		return true;
+
+	return false;
+}
+
+static void cashsvr_notify_handler(struct cashsvr_evsrc *src UNUSED,
+				   uint32_t events UNUSED)
+{
+	struct cashsvr_client *cli, *next;
+	struct cash_response cash_resp = {
+		.retval = 1,
+		.focus_step = -1,
+		.exptime = -1,
+		.iso = -1,
+		.range_mm = -1,
+		.clear = -1,
+	};
+	struct cash_vl53l0 tof_data;
+	struct cash_tcs3490 rgbc_data;
+	struct cashsvr_calib *cal;
+	unsigned int evts, mask = 0, sub_mask = 0;
+	int ret;
+
+	evts = cash_input_notify_consume();
+	if (evts & (1 << CASH_SENSOR_TOF))
+		mask |= CASH_SUBSCRIBE_TOF;
+	if (evts & (1 << CASH_SENSOR_RGBC))
+		mask |= CASH_SUBSCRIBE_RGBC;
+
+	if (!mask)
+		return;
+
+	cashsvr_power_ready(mask);
+
+	/* Subscribers keep wanting the sensors they subscribed to */
+	for (cli = cashsvr_subscribers; cli; cli = cli->sub_next)
+		sub_mask |= cli->sub_mask;
+	cashsvr_power_demand(mask & sub_mask, false);
+
+	/* Never sleep in here: the event loop must keep going */
+	cal = cashsvr_calib_get();
+	ret = cashsvr_get_snapshot(cal, &cash_resp, &tof_data, &rgbc_data);
+	cashsvr_calib_put(cal);
+	if (ret < 0)
+		return;
+
+	cashsvr_shm_update(mask, &cash_resp, &tof_data, &rgbc_data);
+
+	for (cli = cashsvr_subscribers; cli; cli = next) {
+		next = cli->sub_next;
+
+		if (!cashsvr_push_wanted(cli, mask, &cash_resp))
+			continue;
+
+		ret = send(cli->src.fd, &cash_resp, sizeof(cash_resp),
+			   MSG_NOSIGNAL);
+		if (ret == -1) {
+			/* Lagging subscriber: it'll get the next one */
+			if (errno == EAGAIN)
+				continue;
+			cashsvr_client_close(cli);
+			continue;
+		}
+
+		cli->last_push = cash_resp;
+		cli->pushed = true;
+	}
+}
+
+static void cashsvr_sensor_handler(struct cashsvr_evsrc *src, uint32_t events)
+{
+	int id = src - cashsvr_sensor_src;
+
+	/* Stopped meanwhile, in this very batch */
+	if (!cashsvr_sensor_attached[id])
+		return;
+
+	if (events & (EPOLLERR | EPOLLHUP) || !(events & EPOLLIN))
+		return;
+
+	cash_input_reactor_process(id);
+}
+
+/*
+ * cashsvr_sensor_apply - Adds the input fd of a sensor to the event
+ *			  loop, or removes it. Runs in the event loop.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cashsvr_sensor_apply(int id, bool attach)
+{
+	struct cashsvr_evsrc *src = &cashsvr_sensor_src[id];
+	struct epoll_event evt;
+
+	/*
+	 * A device that came back has the same fd number, but it left
+	 * the epoll set along with the old file: always start over.
+	 */
+	epoll_ctl(cashsvr_epfd, EPOLL_CTL_DEL, src->fd, NULL);
+	cashsvr_sensor_attached[id] = false;
+	if (!attach)
+		return 0;
+
+	evt.events = EPOLLIN;
+	evt.data.ptr = src;
+	if (epoll_ctl(cashsvr_epfd, EPOLL_CTL_ADD, src->fd, &evt) < 0)
+		return -errno;
+
+	cashsvr_sensor_attached[id] = true;
+
+	return 0;
+}
+
+static void cashsvr_attach_handler(struct cashsvr_evsrc *src,
+				   uint32_t events UNUSED)
+{
+	unsigned int pending;
+	bool want[CASH_SENSOR_MAX];
+	eventfd_t cnt;
+	int id;
+
+	eventfd_read(src->fd, &cnt);
+
+	pthread_mutex_lock(&cashsvr_attach_lock);
+	pending = cashsvr_attach_pending;
+	cashsvr_attach_pending = 0;
+	memcpy(want, cashsvr_attach_want, sizeof(want));
+	pthread_mutex_unlock(&cashsvr_attach_lock);
+
+	for (id = 0; id < CASH_SENSOR_MAX; id++) {
+		if (!(pending & (1 << id)))
+			continue;
+
+		if (cashsvr_sensor_apply(id, want[id]) < 0)
+			ALOGE("Cannot add sensor %d to the event loop", id);
+	}
+}
+
+/*
+ * cashsvr_sensor_attach - Single threaded mode: adds the input fd of
+ *			   a started sensor to the event loop, or
+ *			   removes the one of a stopped sensor.
+ *			   Other threads get it done by the event loop.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cashsvr_sensor_attach(int id, int fd, bool attach)
+{
+	cashsvr_sensor_src[id].fd = fd;
+
+	/* Whatever got asked before is superseded by this */
+	pthread_mutex_lock(&cashsvr_attach_lock);
+	cashsvr_attach_want[id] = attach;
+	if (cashsvr_is_looper)
+		cashsvr_attach_pending &= ~(1 << id);
+	else
+		cashsvr_attach_pending |= 1 << id;
+	pthread_mutex_unlock(&cashsvr_attach_lock);
+
+	if (cashsvr_is_looper)
+		return cashsvr_sensor_apply(id, attach);
+
+	if (eventfd_write(cashsvr_attach_src.fd, 1) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void cashsvr_timer_handler(struct cashsvr_evsrc *src,
+				  uint32_t events UNUSED)
+{
+	uint64_t expirations;
+
+	/* Expired: whatever is due gets handled after the events */
+	read(src->fd, &expirations, sizeof(expirations));
+	cashsvr_timer_next = 0;
+}
+
+/*
+ * cashsvr_timer_arm - Single threaded mode: takes care of the power
+ *		       management that is due, then arms the timer for
+ *		       the next one or for the first OP_WAIT_READY
+ *		       timeout, whichever comes first.
+ *		       Nothing is armed if nothing is pending, so that
+ *		       an idle server never wakes up.
+ */
+static void cashsvr_timer_arm(void)
+{
+	struct itimerspec its;
+	int64_t next, wait_next;
+
+	pthread_mutex_lock(&cashsvr_work_lock);
+	next = cashsvr_power_next();
+	pthread_mutex_unlock(&cashsvr_work_lock);
+
+	if (next && next <= cashsvr_now_ns()) {
+		cashsvr_power_manage();
+
+		pthread_mutex_lock(&cashsvr_work_lock);
+		next = cashsvr_power_next();
+		pthread_mutex_unlock(&cashsvr_work_lock);
+	}
+
+	wait_next = cashsvr_waiters_deadline();
+	if (wait_next && (!next || wait_next < next))
+		next = wait_next;
+
+	if (next == cashsvr_timer_next)
+		return;
+
+	/* A zero it_value disarms the timer */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000000LL;
+	its.it_value.tv_nsec = next % 1000000000LL;
+
+	if (timerfd_settime(cashsvr_timer_src.fd, TFD_TIMER_ABSTIME,
+			    &its, NULL) < 0) {
+		ALOGE("Cannot arm the event loop timer");
+		return;
+	}
+
+	cashsvr_timer_next = next;
+}
+
+static void cashsvr_accept_handler(struct cashsvr_evsrc *src,
+				   uint32_t events UNUSED)
+{
+	struct cashsvr_client *cli;
+	int csock;
+
+	while ((csock = accept4(src->fd, NULL, NULL,
+				SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		cli = calloc(1, sizeof(struct cashsvr_client));
+		if (cli == NULL) {
+			ALOGE("Memory exhausted. Dropping client.");
+			close(csock);
+			continue;
+		}
+
+		cli->src.fd = csock;
+		cli->src.handle = cashsvr_client_handler;
+
+		if (cashsvr_client_arm(cli, EPOLL_CTL_ADD) < 0) {
+			ALOGE("Cannot add client to the event loop");
+			close(csock);
+			free(cli);
+		}
+	}
+}
+
+static void *cashsvr_looper(void *unusedvar UNUSED)
+{
+	struct epoll_event pevt[CASHSERVER_MAX_EVENTS];
+	struct cashsvr_evsrc *src;
+	int ret, i;
+
+	cashsvr_is_looper = true;
+
+	ALOGI("CASH Server is waiting for connection...");
+	while (ucthread_run == true) {
+		/* In the single threaded mode, timeouts come from the timer */
+		ret = epoll_wait(cashsvr_epfd, pevt, CASHSERVER_MAX_EVENTS,
+				 cash_conf.single_thread ?
+				 -1 : cashsvr_waiters_timeout());
+		cash_input_count_wakeup();
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("Event loop failure: %d", errno);
+			break;
+		}
+
+		for (i = 0; i < ret; i++) {
+			src = (struct cashsvr_evsrc*)pevt[i].data.ptr;
+			if (!src->dead)
+				src->handle(src, pevt[i].events);
+		}
+
+		if (cashsvr_waiters)
+			cashsvr_waiters_check();
+
+		if (cash_conf.single_thread)
+			cashsvr_timer_arm();
+
+		cashsvr_client_reap();
+	}
+
+	ALOGI("Camera Augmented Sensing Helper Server terminated.");
+	pthread_exit((void*)((int)0));
+}
+
+/*
+ * cashsvr_reactor_init - Sets the single threaded mode up: the event
+ *			  loop gets the timer, and the input fds of the
+ *			  sensors as soon as they are started.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cashsvr_reactor_init(void)
+{
+	struct epoll_event evt;
+	int i;
+
+	if (cashsvr_timer_src.fd < 0) {
+		cashsvr_timer_src.fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+		if (cashsvr_timer_src.fd < 0) {
+			ALOGE("Cannot create the event loop timer");
+			return -errno;
+		}
+		cashsvr_timer_src.handle = cashsvr_timer_handler;
+	}
+
+	evt.events = EPOLLIN;
+	evt.data.ptr = &cashsvr_timer_src;
+	if (epoll_ctl(cashsvr_epfd, EPOLL_CTL_ADD,
+		      cashsvr_timer_src.fd, &evt) < 0) {
+		ALOGE("Cannot add the timer to the event loop");
+		return -EPROTO;
+	}
+	cashsvr_timer_next = -1;
+
+	if (cashsvr_attach_src.fd < 0) {
+		cashsvr_attach_src.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (cashsvr_attach_src.fd < 0) {
+			ALOGE("Cannot create the sensors attach event");
+			return -errno;
+		}
+		cashsvr_attach_src.handle = cashsvr_attach_handler;
+	}
+
+	evt.events = EPOLLIN;
+	evt.data.ptr = &cashsvr_attach_src;
+	if (epoll_ctl(cashsvr_epfd, EPOLL_CTL_ADD,
+		      cashsvr_attach_src.fd, &evt) < 0) {
+		ALOGE("Cannot add the sensors attach event to the event loop");
+		return -EPROTO;
+	}
+
+	for (i = 0; i < CASH_SENSOR_MAX; i++)
+		cashsvr_sensor_src[i].handle = cashsvr_sensor_handler;
+
+	/* We may get restarted: sensors that are up move to the new loop */
+	for (i = 0; i < CASH_SENSOR_MAX; i++) {
+		if (!cashsvr_sensor_attached[i])
+			continue;
+
+		evt.events = EPOLLIN;
+		evt.data.ptr = &cashsvr_sensor_src[i];
+		if (epoll_ctl(cashsvr_epfd, EPOLL_CTL_ADD,
+			      cashsvr_sensor_src[i].fd, &evt) < 0)
+			ALOGE("Cannot move sensor %d to the event loop", i);
+	}
+
+	cash_input_reactor_init(cashsvr_sensor_attach);
+
+	return 0;
+}
+
+static int manage_cashsvr(bool start)
+{
+	int i, ret;
+	struct stat st = {0};
+	struct epoll_event evt;
+	pthread_condattr_t cond_attr;
+	static bool workers_up = false;
+
+	if (start == false) {
+		ucthread_run = false;
+		if (sock) {
+			shutdown(sock, SHUT_RDWR);
+			close(sock);
+		}
+
+		/* Wake up the workers and wait for them to go away */
+		pthread_mutex_lock(&cashsvr_work_lock);
+		pthread_cond_broadcast(&cashsvr_work_cond);
+		pthread_mutex_unlock(&cashsvr_work_lock);
+		for (i = 0; workers_up && i < CASHSERVER_WORKERS; i++)
+			pthread_join(cashsvr_workers[i], NULL);
+		workers_up = false;
+
+		return 0;
+	}
 
 	ucthread_run = true;
 
+	/* We may get restarted after an event loop failure */
+	if (cashsvr_epfd >= 0)
+		close(cashsvr_epfd);
+	if (sock > 0)
+		close(sock);
+
+	cashsvr_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (cashsvr_epfd < 0) {
+		ALOGE("Cannot create epoll descriptor");
+		return -EPROTO;
+	}
+
 	/* Create folder, if doesn't exist */
 	if (stat(CASHSERVER_DIR, &st) == -1) {
 		mkdir(CASHSERVER_DIR, 0773);
 	}
 
 	/* Get socket in the UNIX domain */
-	sock = socket(PF_UNIX, SOCK_SEQPACKET, 0);
+	sock = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (sock < 0) {
 		ALOGE("Could not create the socket");
 		return -EPROTO;
@@ -347,169 +2255,924 @@ static int manage_cashsvr(bool start)
 		return ret;
 	}
 
-	ret = pthread_create(&cashsvr_thread, NULL, cashsvr_looper, NULL);
-	if (ret != 0) {
-		ALOGE("Cannot create CASH thread");
-		return -ENXIO;
+	cashsvr_listen_src.fd = sock;
+	cashsvr_listen_src.handle = cashsvr_accept_handler;
+
+	evt.events = EPOLLIN;
+	evt.data.ptr = &cashsvr_listen_src;
+	ret = epoll_ctl(cashsvr_epfd, EPOLL_CTL_ADD, sock, &evt);
+	if (ret != 0) {
+		ALOGE("Cannot add socket to the event loop");
+		return -EPROTO;
+	}
+
+	/* New samples notifications, for OP_SUBSCRIBE */
+	cashsvr_notify_src.fd = cash_input_notify_init();
+	cashsvr_notify_src.handle = cashsvr_notify_handler;
+	if (cashsvr_notify_src.fd >= 0) {
+		evt.events = EPOLLIN;
+		evt.data.ptr = &cashsvr_notify_src;
+		ret = epoll_ctl(cashsvr_epfd, EPOLL_CTL_ADD,
+				cashsvr_notify_src.fd, &evt);
+		if (ret != 0)
+			ALOGW("Cannot add notifications to the event loop");
+	}
+
+	/* Workers sleep until the next power down: don't let clock jumps in */
+	if (!workers_up && !cash_conf.single_thread) {
+		pthread_condattr_init(&cond_attr);
+		pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&cashsvr_work_cond, &cond_attr);
+		pthread_condattr_destroy(&cond_attr);
+	}
+
+	if (cash_conf.single_thread) {
+		ret = cashsvr_reactor_init();
+		if (ret < 0)
+			return ret;
+	}
+
+	for (i = 0; !workers_up && !cash_conf.single_thread &&
+		    i < CASHSERVER_WORKERS; i++) {
+		ret = pthread_create(&cashsvr_workers[i], NULL,
+				     cashsvr_worker, NULL);
+		if (ret != 0) {
+			ALOGE("Cannot create CASH worker thread");
+			return -ENXIO;
+		}
+	}
+	workers_up = !cash_conf.single_thread;
+
+	ret = pthread_create(&cashsvr_thread, NULL, cashsvr_looper, NULL);
+	if (ret != 0) {
+		ALOGE("Cannot create CASH thread");
+		return -ENXIO;
+	}
+
+	return 0;
+}
+
+/*
+ * cash_autofocus_get_coeff - Prepares the focus algorithm in advance
+ *			       by getting the polynomial regression's
+ *			       correlation coefficient for the provided
+ *			       input-focus table.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_autofocus_get_coeff(struct cashsvr_calib *cal)
+{
+	uint32_t i;
+	struct pair_data *pairs;
+	double coeff;
+	int rs = 3 * FOCTBL_POLYREG_DEGREE;
+
+	if (cal->focus_conf.table == NULL)
+		return -3;
+
+	pairs = (struct pair_data*)calloc(cal->focus_conf.num_steps+1,
+				 sizeof(struct pair_data));
+	if (pairs == NULL) {
+		ALOGE("Memory exhausted. Cannot write focus table");
+		return -4;
+	}
+
+	for (i = 0; i <= cal->focus_conf.num_steps; i++) {
+		pairs[i].x = cal->focus_conf.table[i].input_val;
+		pairs[i].y = cal->focus_conf.table[i].output_val;
+		ALOGD("Table x:%.2f  y:%.2f",
+			pairs[i].x, pairs[i].y);
+	}
+
+	ALOGE("Got %d pairs", cal->focus_conf.num_steps);
+
+	cal->focus_conf.terms = (double*)calloc(rs, sizeof(double));
+
+	compute_coefficients(pairs, cal->focus_conf.num_steps,
+				cal->conf.tof_polyreg_degree, cal->focus_conf.terms);
+	if (cal->focus_conf.terms == NULL) {
+		ALOGE("FATAL: Cannot compute coefficients.");
+		free(pairs);
+		return -5;
+	}
+
+	for (i = 0; i < cal->focus_conf.num_steps && i < (uint32_t)rs; i++)
+		ALOGE("Term%d: %.10f",i, cal->focus_conf.terms[i]);
+
+	coeff = corr_coeff(pairs, cal->focus_conf.num_steps, cal->focus_conf.terms);
+	free(pairs);
+	if (coeff > 1.0f)
+		ALOGW("WARNING! The correlation coefficient is >1!!");
+	else if (coeff == 0.0f)
+		ALOGW("WARNING! The correlation coefficient is ZERO!!");
+
+	ALOGD("Correlation coefficient: %.10f", coeff);
+
+	ALOGI("Auto-Focus Polynomial Regression coordinates loaded.");
+
+	return 0;
+}
+
+/*
+ * cash_clear_iso_get_coeff - Prepares the iso algorithm in advance
+ *			       by getting the polynomial regression's
+ *			       correlation coefficient for the provided
+ *			       clear-iso table.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_clear_iso_get_coeff(struct cashsvr_calib *cal)
+{
+	uint32_t i;
+	struct pair_data *pairs;
+	double coeff;
+	int rs = 3 * FOCTBL_POLYREG_DEGREE;
+
+	if (cal->clear_iso_conf.table == NULL)
+		return -3;
+
+	pairs = (struct pair_data*)calloc(cal->clear_iso_conf.num_steps+1,
+				 sizeof(struct pair_data));
+	if (pairs == NULL) {
+		ALOGE("Memory exhausted. Cannot write clear-iso table");
+		return -4;
+	}
+
+	for (i = 0; i <= cal->clear_iso_conf.num_steps; i++) {
+		pairs[i].x = cal->clear_iso_conf.table[i].input_val;
+		pairs[i].y = cal->clear_iso_conf.table[i].output_val;
+		ALOGD("Table x:%.2f  y:%.2f",
+			pairs[i].x, pairs[i].y);
+	}
+
+	ALOGE("Got %d pairs", cal->clear_iso_conf.num_steps);
+
+	cal->clear_iso_conf.terms = (double*)calloc(rs, sizeof(double));
+
+	compute_coefficients(pairs, cal->clear_iso_conf.num_steps,
+				cal->conf.rgbc_polyreg_degree, cal->clear_iso_conf.terms);
+	if (cal->clear_iso_conf.terms == NULL) {
+		ALOGE("FATAL: Cannot compute coefficients.");
+		free(pairs);
+		return -5;
+	}
+
+	for (i = 0; i < cal->clear_iso_conf.num_steps && i < (uint32_t)rs; i++)
+		ALOGE("Term%d: %.10f",i, cal->clear_iso_conf.terms[i]);
+
+	coeff = corr_coeff(pairs, cal->clear_iso_conf.num_steps, cal->clear_iso_conf.terms);
+	free(pairs);
+	if (coeff > 1.0f)
+		ALOGW("WARNING! The correlation coefficient is >1!!");
+	else if (coeff == 0.0f)
+		ALOGW("WARNING! The correlation coefficient is ZERO!!");
+
+	ALOGD("Correlation coefficient: %.10f", coeff);
+
+	ALOGI("Clear-ISO Polynomial Regression coordinates loaded.");
+
+	return 0;
+}
+
+#ifdef DEBUG_FOCUS_BENCH
+/*
+ * cash_focus_lut_bench - Compares the time needed to get a focus step
+ *			  out of polyreg_f and out of the lookup table.
+ */
+static void cash_focus_lut_bench(struct cashsvr_calib *cal)
+{
+	struct timespec t0, t1, t2;
+	volatile int32_t sink;
+	int i, range, runs = 100;
+	int64_t poly_ns, lut_ns, nevals;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < runs; i++)
+		for (range = cal->conf.tof_min; range <= cal->conf.tof_max; range++)
+			sink = cashsvr_range_to_focus_polyreg(cal, range);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < runs; i++)
+		for (range = cal->conf.tof_min; range <= cal->conf.tof_max; range++)
+			sink = cashsvr_range_to_focus(cal, range);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	(void)sink;
+
+	nevals = (int64_t)runs * cal->focus_lut_len;
+	poly_ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+		  (t1.tv_nsec - t0.tv_nsec);
+	lut_ns = (t2.tv_sec - t1.tv_sec) * 1000000000LL +
+		 (t2.tv_nsec - t1.tv_nsec);
+
+	ALOGI("Focus benchmark: polyreg %.2fns, LUT %.2fns per evaluation",
+		(double)poly_ns / nevals, (double)lut_ns / nevals);
+}
+#endif
+
+/*
+ * cash_focus_lut_build - Evaluates the focus polynomial for every
+ *			  millimeter of the allowed ToF range, so that
+ *			  getting a focus step costs one array load.
+ *
+ * With one entry per millimeter, each one filled with the very same
+ * conversion the fallback does, the table is exact by construction:
+ * only a polynomial that diverges somewhere gets it discarded.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_focus_lut_build(struct cashsvr_calib *cal)
+{
+	int32_t *lut, len, i;
+	double val;
+
+	if (!cash_calcache_owns(&cal->tof_cache, cal->focus_lut))
+		free(cal->focus_lut);
+	cal->focus_lut = NULL;
+	cal->focus_lut_len = 0;
+
+	if (cal->focus_conf.terms == NULL)
+		return -EINVAL;
+
+	len = cal->conf.tof_max - cal->conf.tof_min + 1;
+	if (len <= 0 || len > FOCUS_LUT_MAX_ENTRIES) {
+		ALOGW("ToF range too big for the focus LUT: %d", len);
+		return -E2BIG;
+	}
+
+	lut = calloc(len, sizeof(int32_t));
+	if (lut == NULL) {
+		ALOGE("Memory exhausted. Cannot allocate focus LUT.");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < len; i++) {
+		val = polyreg_f(cal->conf.tof_min + i, cal->focus_conf.terms,
+				cal->conf.tof_polyreg_degree);
+		if (!isfinite(val) || val > INT32_MAX || val < INT32_MIN) {
+			ALOGW("Focus polynomial diverges at %dmm: no LUT",
+				cal->conf.tof_min + i);
+			free(lut);
+			return -ERANGE;
+		}
+		lut[i] = (int32_t)val;
+	}
+
+	cal->focus_lut = lut;
+	cal->focus_lut_len = len;
+
+	ALOGI("Focus LUT ready: %d entries for %d-%dmm", len,
+		cal->conf.tof_min, cal->conf.tof_max);
+
+#ifdef DEBUG_FOCUS_BENCH
+	cash_focus_lut_bench(cal);
+#endif
+	return 0;
+}
+
+/*
+ * cash_exposure_lut_build - Compiles the clear to ISO polynomial and
+ *			     the exposure times table into one entry per
+ *			     clear value of the allowed RGBC range.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_exposure_lut_build(struct cashsvr_calib *cal)
+{
+	struct cash_exposure_entry *lut;
+	int32_t len, i;
+	uint32_t step;
+	double val;
+
+	if (!cash_calcache_owns(&cal->rgbc_cache, cal->exposure_lut))
+		free(cal->exposure_lut);
+	cal->exposure_lut = NULL;
+	cal->exposure_lut_len = 0;
+
+	if (cal->clear_iso_conf.terms == NULL || cal->clear_iso_conf.table == NULL)
+		return -EINVAL;
+
+	/* Binary search needs the ISO thresholds to never go up */
+	cal->clear_iso_descending = true;
+	for (step = 1; step < cal->clear_iso_conf.num_steps; step++) {
+		if (cal->clear_iso_conf.table[step].output_val >
+		    cal->clear_iso_conf.table[step - 1].output_val) {
+			ALOGW("Clear-ISO table is not descending: "
+			      "using linear search");
+			cal->clear_iso_descending = false;
+			break;
+		}
+	}
+
+	if (cal->conf.nexposure_times < (int32_t)cal->clear_iso_conf.num_steps + 1)
+		ALOGW("Only %d exposure times for %u ISO steps",
+			cal->conf.nexposure_times, cal->clear_iso_conf.num_steps);
+
+	len = cal->conf.rgbc_clear_max - cal->conf.rgbc_clear_min + 1;
+	if (len <= 0 || len > EXPOSURE_LUT_MAX_ENTRIES) {
+		ALOGW("Clear range too big for the exposure LUT: %d", len);
+		return -E2BIG;
+	}
+
+	lut = calloc(len, sizeof(*lut));
+	if (lut == NULL) {
+		ALOGE("Memory exhausted. Cannot allocate exposure LUT.");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < len; i++) {
+		val = polyreg_f(cal->conf.rgbc_clear_min + i,
+				cal->clear_iso_conf.terms,
+				cal->conf.rgbc_polyreg_degree);
+		if (!isfinite(val) || val > INT32_MAX || val < INT32_MIN) {
+			ALOGW("Clear-ISO polynomial diverges at %d: no LUT",
+				cal->conf.rgbc_clear_min + i);
+			free(lut);
+			return -ERANGE;
+		}
+		cashsvr_clear_to_exptime_iso_polyreg(cal,
+				cal->conf.rgbc_clear_min + i,
+				&lut[i].exptime, &lut[i].iso);
+	}
+
+	cal->exposure_lut = lut;
+	cal->exposure_lut_len = len;
+
+	ALOGI("Exposure LUT ready: %d entries for clear %d-%d", len,
+		cal->conf.rgbc_clear_min, cal->conf.rgbc_clear_max);
+	return 0;
+}
+
+/*
+ * cashsvr_tof_calcache_load - Takes the ToF configuration, fitted
+ *			       terms and focus LUT straight out of the
+ *			       calibration cache, skipping XML parsing
+ *			       and fitting altogether.
+ *
+ * \return Returns zero or negative errno, if the cache cannot be used.
+ */
+static int cashsvr_tof_calcache_load(struct cashsvr_calib *cal)
+{
+	struct cash_calcache *cache = &cal->tof_cache;
+	const struct cashsvr_tof_calconf *conf;
+	size_t lut_len;
+	int rc;
+
+	rc = cash_calcache_load(CASHSERVER_TOF_CALCACHE_FILE,
+				CASHSERVER_TOF_CONF_FILE, cache);
+	if (rc < 0)
+		return rc;
+
+	conf = cache->blob[CALCACHE_BLOB_CONF];
+	if (conf == NULL ||
+	    cache->blob_len[CALCACHE_BLOB_CONF] != sizeof(*conf) ||
+	    cache->blob_len[CALCACHE_BLOB_TABLE] !=
+		(conf->num_steps + 1) * sizeof(struct cash_polyreg_tbl_entry) ||
+	    cache->blob_len[CALCACHE_BLOB_TERMS] !=
+		3 * FOCTBL_POLYREG_DEGREE * sizeof(double))
+		goto stale;
+
+	lut_len = (size_t)(conf->tof_max - conf->tof_min + 1);
+	if (cache->blob[CALCACHE_BLOB_LUT] != NULL &&
+	    cache->blob_len[CALCACHE_BLOB_LUT] != lut_len * sizeof(int32_t))
+		goto stale;
+
+	cal->conf.tof_min = conf->tof_min;
+	cal->conf.tof_max = conf->tof_max;
+	cal->conf.tof_hyst = conf->tof_hyst;
+	cal->conf.tof_max_runs = conf->tof_max_runs;
+	cal->conf.tof_polyreg_degree = conf->tof_polyreg_degree;
+	cal->conf.tof_polyreg_extra = conf->tof_polyreg_extra;
+	cal->conf.tof_filter = conf->tof_filter;
+
+	cal->focus_conf.num_steps = conf->num_steps;
+	cal->focus_conf.table = (struct cash_polyreg_tbl_entry *)
+				cache->blob[CALCACHE_BLOB_TABLE];
+	cal->focus_conf.terms = (double *)cache->blob[CALCACHE_BLOB_TERMS];
+
+	if (cal->conf.use_focus_lut && !cal->conf.disable_tof &&
+	    cache->blob[CALCACHE_BLOB_LUT] != NULL) {
+		cal->focus_lut = (int32_t *)cache->blob[CALCACHE_BLOB_LUT];
+		cal->focus_lut_len = lut_len;
+	}
+
+	ALOGI("ToF calibration loaded from cache");
+	return 0;
+stale:
+	ALOGW("ToF calibration cache does not fit: rebuilding");
+	cash_calcache_release(cache);
+	return -ESTALE;
+}
+
+static void cashsvr_tof_calcache_store(struct cashsvr_calib *cal)
+{
+	struct cashsvr_tof_calconf conf;
+	const void *blob[CALCACHE_BLOB_MAX] = { NULL };
+	size_t blob_len[CALCACHE_BLOB_MAX] = { 0 };
+
+	if (cal->focus_conf.table == NULL || cal->focus_conf.terms == NULL)
+		return;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.tof_min = cal->conf.tof_min;
+	conf.tof_max = cal->conf.tof_max;
+	conf.tof_hyst = cal->conf.tof_hyst;
+	conf.tof_max_runs = cal->conf.tof_max_runs;
+	conf.tof_polyreg_degree = cal->conf.tof_polyreg_degree;
+	conf.tof_polyreg_extra = cal->conf.tof_polyreg_extra;
+	conf.tof_filter = cal->conf.tof_filter;
+	conf.num_steps = cal->focus_conf.num_steps;
+
+	blob[CALCACHE_BLOB_CONF] = &conf;
+	blob_len[CALCACHE_BLOB_CONF] = sizeof(conf);
+	blob[CALCACHE_BLOB_TABLE] = cal->focus_conf.table;
+	blob_len[CALCACHE_BLOB_TABLE] = (cal->focus_conf.num_steps + 1) *
+					sizeof(struct cash_polyreg_tbl_entry);
+	blob[CALCACHE_BLOB_TERMS] = cal->focus_conf.terms;
+	blob_len[CALCACHE_BLOB_TERMS] = 3 * FOCTBL_POLYREG_DEGREE *
+					sizeof(double);
+	blob[CALCACHE_BLOB_LUT] = cal->focus_lut;
+	blob_len[CALCACHE_BLOB_LUT] = cal->focus_lut_len * sizeof(int32_t);
+
+	if (cash_calcache_store(CASHSERVER_TOF_CALCACHE_FILE,
+				CASHSERVER_TOF_CONF_FILE, blob, blob_len) == 0)
+		ALOGI("ToF calibration cache updated");
+}
+
+/*
+ * cashsvr_rgbc_calcache_load - Takes the RGBC configuration, exposure
+ *				times, fitted terms and exposure LUT
+ *				straight out of the calibration cache.
+ *
+ * \return Returns zero or negative errno, if the cache cannot be used.
+ */
+static int cashsvr_rgbc_calcache_load(struct cashsvr_calib *cal)
+{
+	struct cash_calcache *cache = &cal->rgbc_cache;
+	const struct cashsvr_rgbc_calconf *conf;
+	size_t lut_len;
+	int rc;
+
+	rc = cash_calcache_load(CASHSERVER_RGBC_CALCACHE_FILE,
+				CASHSERVER_RGBC_CONF_FILE, cache);
+	if (rc < 0)
+		return rc;
+
+	conf = cache->blob[CALCACHE_BLOB_CONF];
+	if (conf == NULL ||
+	    cache->blob_len[CALCACHE_BLOB_CONF] != sizeof(*conf) ||
+	    cache->blob_len[CALCACHE_BLOB_TABLE] !=
+		(conf->num_steps + 1) * sizeof(struct cash_polyreg_tbl_entry) ||
+	    cache->blob_len[CALCACHE_BLOB_TERMS] !=
+		3 * FOCTBL_POLYREG_DEGREE * sizeof(double) ||
+	    cache->blob_len[CALCACHE_BLOB_EXPTIMES] !=
+		conf->nexposure_times * sizeof(int64_t))
+		goto stale;
+
+	lut_len = (size_t)(conf->rgbc_clear_max - conf->rgbc_clear_min + 1);
+	if (cache->blob[CALCACHE_BLOB_LUT] != NULL &&
+	    cache->blob_len[CALCACHE_BLOB_LUT] !=
+		lut_len * sizeof(struct cash_exposure_entry))
+		goto stale;
+
+	cal->conf.rgbc_clear_min = conf->rgbc_clear_min;
+	cal->conf.rgbc_clear_max = conf->rgbc_clear_max;
+	cal->conf.rgbc_polyreg_degree = conf->rgbc_polyreg_degree;
+	cal->conf.rgbc_polyreg_extra = conf->rgbc_polyreg_extra;
+	cal->conf.exposure_times = (int64_t *)cache->blob[CALCACHE_BLOB_EXPTIMES];
+	cal->conf.nexposure_times = conf->nexposure_times;
+	cal->clear_iso_descending = conf->clear_iso_descending;
+
+	cal->clear_iso_conf.num_steps = conf->num_steps;
+	cal->clear_iso_conf.table = (struct cash_polyreg_tbl_entry *)
+				cache->blob[CALCACHE_BLOB_TABLE];
+	cal->clear_iso_conf.terms = (double *)cache->blob[CALCACHE_BLOB_TERMS];
+
+	if (cache->blob[CALCACHE_BLOB_LUT] != NULL) {
+		cal->exposure_lut = (struct cash_exposure_entry *)
+				cache->blob[CALCACHE_BLOB_LUT];
+		cal->exposure_lut_len = lut_len;
+	}
+
+	ALOGI("RGBC calibration loaded from cache");
+	return 0;
+stale:
+	ALOGW("RGBC calibration cache does not fit: rebuilding");
+	cash_calcache_release(cache);
+	return -ESTALE;
+}
+
+static void cashsvr_rgbc_calcache_store(struct cashsvr_calib *cal)
+{
+	struct cashsvr_rgbc_calconf conf;
+	const void *blob[CALCACHE_BLOB_MAX] = { NULL };
+	size_t blob_len[CALCACHE_BLOB_MAX] = { 0 };
+
+	if (cal->clear_iso_conf.table == NULL || cal->clear_iso_conf.terms == NULL)
+		return;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.rgbc_clear_min = cal->conf.rgbc_clear_min;
+	conf.rgbc_clear_max = cal->conf.rgbc_clear_max;
+	conf.rgbc_polyreg_degree = cal->conf.rgbc_polyreg_degree;
+	conf.rgbc_polyreg_extra = cal->conf.rgbc_polyreg_extra;
+	conf.nexposure_times = cal->conf.nexposure_times;
+	conf.num_steps = cal->clear_iso_conf.num_steps;
+	conf.clear_iso_descending = cal->clear_iso_descending;
+
+	blob[CALCACHE_BLOB_CONF] = &conf;
+	blob_len[CALCACHE_BLOB_CONF] = sizeof(conf);
+	blob[CALCACHE_BLOB_TABLE] = cal->clear_iso_conf.table;
+	blob_len[CALCACHE_BLOB_TABLE] = (cal->clear_iso_conf.num_steps + 1) *
+					sizeof(struct cash_polyreg_tbl_entry);
+	blob[CALCACHE_BLOB_TERMS] = cal->clear_iso_conf.terms;
+	blob_len[CALCACHE_BLOB_TERMS] = 3 * FOCTBL_POLYREG_DEGREE *
+					sizeof(double);
+	blob[CALCACHE_BLOB_LUT] = cal->exposure_lut;
+	blob_len[CALCACHE_BLOB_LUT] = cal->exposure_lut_len *
+				      sizeof(struct cash_exposure_entry);
+	blob[CALCACHE_BLOB_EXPTIMES] = cal->conf.exposure_times;
+	blob_len[CALCACHE_BLOB_EXPTIMES] = cal->conf.nexposure_times *
+					   sizeof(int64_t);
+
+	if (cash_calcache_store(CASHSERVER_RGBC_CALCACHE_FILE,
+				CASHSERVER_RGBC_CONF_FILE, blob, blob_len) == 0)
+		ALOGI("RGBC calibration cache updated");
+}
+
+/*
+ * cashsvr_tof_calib_build - Fills in the ToF half of a calibration out
+ *			     of the cache or, if that is stale, out of
+ *			     the XML file, refreshing the cache then.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cashsvr_tof_calib_build(struct cashsvr_calib *cal)
+{
+	bool want_lut = cal->conf.use_focus_lut && !cal->conf.disable_tof;
+	int rc;
+
+	if (cashsvr_tof_calcache_load(cal) == 0) {
+		if (want_lut && cal->focus_lut == NULL)
+			cash_focus_lut_build(cal);
+		return 0;
+	}
+
+	rc = parse_cash_tof_xml_data(CASHSERVER_TOF_CONF_FILE, "tof_focus",
+				&cal->focus_conf, &cal->conf);
+	if (rc < 0) {
+		ALOGE("Cannot parse configuration for ToF assisted AF");
+		return rc;
+	}
+
+	rc = cash_autofocus_get_coeff(cal);
+	if (rc < 0)
+		return rc;
+
+	if (want_lut)
+		cash_focus_lut_build(cal);
+	cashsvr_tof_calcache_store(cal);
+
+	return 0;
+}
+
+static int cashsvr_rgbc_calib_build(struct cashsvr_calib *cal)
+{
+	int rc;
+
+	if (cashsvr_rgbc_calcache_load(cal) == 0) {
+		if (cal->exposure_lut == NULL)
+			cash_exposure_lut_build(cal);
+		return 0;
+	}
+
+	rc = parse_cash_rgbc_xml_data(CASHSERVER_RGBC_CONF_FILE, "clear_iso",
+				&cal->clear_iso_conf, &cal->conf);
+	if (rc < 0) {
+		ALOGE("Cannot parse configuration for RGBC assisted AE");
+		return rc;
 	}
 
+	rc = cash_clear_iso_get_coeff(cal);
+	if (rc < 0)
+		return rc;
+
+	cash_exposure_lut_build(cal);
+	cashsvr_rgbc_calcache_store(cal);
+
 	return 0;
 }
 
-/*
- * cash_autofocus_get_coeff - Prepares the focus algorithm in advance
- *			       by getting the polynomial regression's
- *			       correlation coefficient for the provided
- *			       input-focus table.
- *
- * \return Returns zero or negative errno.
- */
-static int cash_autofocus_get_coeff(void)
+static struct cashsvr_calib *cashsvr_calib_alloc(struct cash_configuration *base)
 {
-	uint32_t i;
-	struct pair_data *pairs;
-	double coeff;
-	int rs = 3 * FOCTBL_POLYREG_DEGREE;
+	struct cashsvr_calib *cal;
 
-	if (focus_conf.table == NULL)
-		return -3;
-
-	pairs = (struct pair_data*)calloc(focus_conf.num_steps+1,
-				 sizeof(struct pair_data));
-	if (pairs == NULL) {
-		ALOGE("Memory exhausted. Cannot write focus table");
-		return -4;
+	cal = calloc(1, sizeof(*cal));
+	if (cal == NULL) {
+		ALOGE("Memory exhausted. Cannot allocate calibration.");
+		return NULL;
 	}
 
-	for (i = 0; i <= focus_conf.num_steps; i++) {
-		pairs[i].x = focus_conf.table[i].input_val;
-		pairs[i].y = focus_conf.table[i].output_val;
-		ALOGD("Table x:%.2f  y:%.2f",
-			pairs[i].x, pairs[i].y);
+	cal->tof_refs = malloc(sizeof(*cal->tof_refs));
+	cal->rgbc_refs = malloc(sizeof(*cal->rgbc_refs));
+	if (cal->tof_refs == NULL || cal->rgbc_refs == NULL) {
+		ALOGE("Memory exhausted. Cannot allocate calibration.");
+		free(cal->tof_refs);
+		free(cal->rgbc_refs);
+		free(cal);
+		return NULL;
 	}
 
-	ALOGE("Got %d pairs", focus_conf.num_steps);
+	cal->conf = *base;
+	atomic_init(cal->tof_refs, 1);
+	atomic_init(cal->rgbc_refs, 1);
+	atomic_init(&cal->refs, 1);
 
-	focus_conf.terms = (double*)calloc(rs, sizeof(double));
+	return cal;
+}
 
-	compute_coefficients(pairs, focus_conf.num_steps,
-				cash_conf.tof_polyreg_degree, focus_conf.terms);
-	if (focus_conf.terms == NULL) {
-		ALOGE("FATAL: Cannot compute coefficients.");
-		return -5;
+/*
+ * cashsvr_calib_tof_release - Drops the reference of a snapshot to its
+ *			       ToF half, freeing the half with the last.
+ */
+static void cashsvr_calib_tof_release(struct cashsvr_calib *cal)
+{
+	struct cash_calcache *cache;
+
+	if (atomic_fetch_sub(cal->tof_refs, 1) == 1) {
+		cache = &cal->tof_cache;
+		if (!cash_calcache_owns(cache, cal->focus_conf.table))
+			free(cal->focus_conf.table);
+		if (!cash_calcache_owns(cache, cal->focus_conf.terms))
+			free(cal->focus_conf.terms);
+		if (!cash_calcache_owns(cache, cal->focus_lut))
+			free(cal->focus_lut);
+		cash_calcache_release(cache);
+		free(cal->tof_refs);
 	}
+}
 
-	for (i = 0; i < focus_conf.num_steps; i++)
-		ALOGE("Term%d: %.10f",i, focus_conf.terms[i]);
+/*
+ * cashsvr_calib_rgbc_release - Drops the reference of a snapshot to its
+ *				RGBC half, freeing the half with the last.
+ */
+static void cashsvr_calib_rgbc_release(struct cashsvr_calib *cal)
+{
+	struct cash_calcache *cache;
+
+	if (atomic_fetch_sub(cal->rgbc_refs, 1) == 1) {
+		cache = &cal->rgbc_cache;
+		if (!cash_calcache_owns(cache, cal->clear_iso_conf.table))
+			free(cal->clear_iso_conf.table);
+		if (!cash_calcache_owns(cache, cal->clear_iso_conf.terms))
+			free(cal->clear_iso_conf.terms);
+		if (!cash_calcache_owns(cache, cal->exposure_lut))
+			free(cal->exposure_lut);
+		if (!cash_calcache_owns(cache, cal->conf.exposure_times))
+			free(cal->conf.exposure_times);
+		cash_calcache_release(cache);
+		free(cal->rgbc_refs);
+	}
+}
 
-	coeff = corr_coeff(pairs, focus_conf.num_steps, focus_conf.terms);
-	if (coeff > 1.0f)
-		ALOGW("WARNING! The correlation coefficient is >1!!");
-	else if (coeff == 0.0f)
-		ALOGW("WARNING! The correlation coefficient is ZERO!!");
+static void cashsvr_calib_free(struct cashsvr_calib *cal)
+{
+	cashsvr_calib_tof_release(cal);
+	cashsvr_calib_rgbc_release(cal);
+	free(cal);
+}
 
-	ALOGD("Correlation coefficient: %.10f", coeff);
+/*
+ * cashsvr_calib_copy_tof - Makes a snapshot share the ToF half of
+ *			    another one, instead of its own.
+ */
 
-	ALOGI("Auto-Focus Polynomial Regression coordinates loaded.");
+static void cashsvr_calib_copy_tof(struct cashsvr_calib *dst,
+				   struct cashsvr_calib *src)
+{
+	cashsvr_calib_tof_release(dst);
+	atomic_fetch_add(src->tof_refs, 1);
+	dst->tof_refs = src->tof_refs;
+
+	dst->conf.tof_min = src->conf.tof_min;
+	dst->conf.tof_max = src->conf.tof_max;
+	dst->conf.tof_hyst = src->conf.tof_hyst;
+	dst->conf.tof_max_runs = src->conf.tof_max_runs;
+	dst->conf.tof_polyreg_degree = src->conf.tof_polyreg_degree;
+	dst->conf.tof_polyreg_extra = src->conf.tof_polyreg_extra;
+	dst->conf.use_tof_stabilized = src->conf.use_tof_stabilized;
+	dst->conf.use_focus_lut = src->conf.use_focus_lut;
+	dst->conf.tof_filter = src->conf.tof_filter;
+	dst->focus_conf = src->focus_conf;
+	dst->focus_lut = src->focus_lut;
+	dst->focus_lut_len = src->focus_lut_len;
+	dst->tof_cache = src->tof_cache;
+}
 
-	return 0;
+/*
+ * cashsvr_calib_copy_rgbc - Makes a snapshot share the RGBC half of
+ *			     another one, instead of its own.
+ */
+static void cashsvr_calib_copy_rgbc(struct cashsvr_calib *dst,
+				    struct cashsvr_calib *src)
+{
+	cashsvr_calib_rgbc_release(dst);
+	atomic_fetch_add(src->rgbc_refs, 1);
+	dst->rgbc_refs = src->rgbc_refs;
+
+	dst->conf.rgbc_clear_min = src->conf.rgbc_clear_min;
+	dst->conf.rgbc_clear_max = src->conf.rgbc_clear_max;
+	dst->conf.rgbc_polyreg_degree = src->conf.rgbc_polyreg_degree;
+	dst->conf.rgbc_polyreg_extra = src->conf.rgbc_polyreg_extra;
+	dst->conf.exposure_times = src->conf.exposure_times;
+	dst->conf.nexposure_times = src->conf.nexposure_times;
+	dst->clear_iso_conf = src->clear_iso_conf;
+	dst->exposure_lut = src->exposure_lut;
+	dst->exposure_lut_len = src->exposure_lut_len;
+	dst->clear_iso_descending = src->clear_iso_descending;
+	dst->rgbc_cache = src->rgbc_cache;
 }
 
 /*
- * cash_clear_iso_get_coeff - Prepares the iso algorithm in advance
- *			       by getting the polynomial regression's
- *			       correlation coefficient for the provided
- *			       clear-iso table.
+ * cashsvr_calib_publish - Makes the given halves of a freshly built
+ *			   calibration current, keeping the other half
+ *			   of the current one, with one pointer swap.
+ *			   What got replaced is freed by whoever drops
+ *			   the last reference to it: right away, unless
+ *			   some request is still using it. The half
+ *			   carried over lives as long as either one.
+ *
+ * \param what - CALIB_OWNS_TOF and/or CALIB_OWNS_RGBC
+ */
+static void cashsvr_calib_publish(struct cashsvr_calib *cal,
+				  unsigned int what)
+{
+	struct cashsvr_calib *old;
+
+	pthread_mutex_lock(&cashsvr_calib_lock);
+	old = cashsvr_calib_cur;
+	if (!(what & CALIB_OWNS_TOF))
+		cashsvr_calib_copy_tof(cal, old);
+	if (!(what & CALIB_OWNS_RGBC))
+		cashsvr_calib_copy_rgbc(cal, old);
+
+	pthread_mutex_lock(&cashsvr_calib_ref_lock);
+	cashsvr_calib_cur = cal;
+	pthread_mutex_unlock(&cashsvr_calib_ref_lock);
+	pthread_mutex_unlock(&cashsvr_calib_lock);
+
+	/* The reference it had as the current one */
+	cashsvr_calib_put(old);
+}
+
+/*
+ * cashsvr_calib_update - Builds the requested halves of the calibration
+ *			  again and publishes them. On failure, the
+ *			  current calibration stays in use.
+ *
+ * \param what - CALIB_OWNS_TOF and/or CALIB_OWNS_RGBC
+ * \param base - Configuration to start from, with the live properties
  *
  * \return Returns zero or negative errno.
  */
-static int cash_clear_iso_get_coeff(void)
+static int cashsvr_calib_update(unsigned int what,
+				struct cash_configuration *base)
 {
-	uint32_t i;
-	struct pair_data *pairs;
-	double coeff;
-	int rs = 3 * FOCTBL_POLYREG_DEGREE;
+	struct cashsvr_calib *cal;
+	int rc = 0;
 
-	if (clear_iso_conf.table == NULL)
-		return -3;
+	cal = cashsvr_calib_alloc(base);
+	if (cal == NULL)
+		return -ENOMEM;
 
-	pairs = (struct pair_data*)calloc(clear_iso_conf.num_steps+1,
-				 sizeof(struct pair_data));
-	if (pairs == NULL) {
-		ALOGE("Memory exhausted. Cannot write clear-iso table");
-		return -4;
+	if (what & CALIB_OWNS_TOF)
+		rc = cashsvr_tof_calib_build(cal);
+	if (rc == 0 && (what & CALIB_OWNS_RGBC))
+		rc = cashsvr_rgbc_calib_build(cal);
+
+	if (rc < 0) {
+		ALOGE("Cannot build the calibration: keeping the current one");
+		cashsvr_calib_free(cal);
+		return rc;
 	}
 
-	for (i = 0; i <= clear_iso_conf.num_steps; i++) {
-		pairs[i].x = clear_iso_conf.table[i].input_val;
-		pairs[i].y = clear_iso_conf.table[i].output_val;
-		ALOGD("Table x:%.2f  y:%.2f",
-			pairs[i].x, pairs[i].y);
+	/* Picked up by the ToF thread right before its next sample */
+	if (what & CALIB_OWNS_TOF) {
+		cash_tof_set_stabilization(cal->conf.tof_max_runs,
+					   TOF_STABILIZATION_MATCH_NO,
+					   cal->conf.tof_hyst);
+		cash_tof_set_filter(&cal->conf.tof_filter);
 	}
 
-	ALOGE("Got %d pairs", clear_iso_conf.num_steps);
+	cashsvr_calib_publish(cal, what);
 
-	clear_iso_conf.terms = (double*)calloc(rs, sizeof(double));
+	return 0;
+}
 
-	compute_coefficients(pairs, clear_iso_conf.num_steps,
-				cash_conf.rgbc_polyreg_degree, clear_iso_conf.terms);
-	if (clear_iso_conf.terms == NULL) {
-		ALOGE("FATAL: Cannot compute coefficients.");
-		return -5;
-	}
+/*
+ * cashsvr_init_done - Marks a subsystem as initialized, successfully
+ *		       or not: requests for it get served from now on.
+ */
+static void cashsvr_init_done(enum cashsvr_subsys subsys)
+{
+	pthread_mutex_lock(&cashsvr_init_lock);
+	atomic_fetch_or(&cashsvr_init_mask, 1 << subsys);
+	pthread_cond_broadcast(&cashsvr_init_cond);
+	pthread_mutex_unlock(&cashsvr_init_lock);
+}
 
-	for (i = 0; i < clear_iso_conf.num_steps; i++)
-		ALOGE("Term%d: %.10f",i, clear_iso_conf.terms[i]);
+static void cashsvr_init_wait(enum cashsvr_subsys subsys)
+{
+	pthread_mutex_lock(&cashsvr_init_lock);
+	while (!cashsvr_init_is_done(subsys))
+		pthread_cond_wait(&cashsvr_init_cond, &cashsvr_init_lock);
+	pthread_mutex_unlock(&cashsvr_init_lock);
+}
 
-	coeff = corr_coeff(pairs, clear_iso_conf.num_steps, clear_iso_conf.terms);
-	if (coeff > 1.0f)
-		ALOGW("WARNING! The correlation coefficient is >1!!");
-	else if (coeff == 0.0f)
-		ALOGW("WARNING! The correlation coefficient is ZERO!!");
+/*
+ * Retrieve the calibration data either from MiscTA
+ * or from CASH's calibration file. On the first boot,
+ * this can take up to a minute.
+ */
+static void *cashsvr_miscta_init_thread(void *unusedvar UNUSED)
+{
+	if (cash_miscta_init_params(&calib_params) == 0)
+		calib_params_valid = true;
+	else
+		ALOGW("No MiscTA calibration. Sensors may work suboptimally.");
 
-	ALOGD("Correlation coefficient: %.10f", coeff);
+	cashsvr_init_done(SUBSYS_MISCTA);
 
-	ALOGI("Clear-ISO Polynomial Regression coordinates loaded.");
+	return NULL;
+}
 
-	return 0;
+static void *cashsvr_tof_init_thread(void *unusedvar UNUSED)
+{
+	int rc;
+
+	rc = cashsvr_calib_update(CALIB_OWNS_TOF, &cash_conf);
+	if (rc < 0)
+		goto end;
+
+	/* The sensor gets its calibration while being set up */
+	cashsvr_init_wait(SUBSYS_MISCTA);
+
+	rc = cash_input_tof_init(calib_params_valid ? &calib_params : NULL);
+	if (rc == -ENODEV)
+		ALOGW("No ToF yet. Ranging will wait for it to show up");
+	else if (rc < 0)
+		ALOGW("Cannot open ToF. Ranging will be unavailable");
+
+end:
+	cashsvr_init_done(SUBSYS_TOF);
+
+	return NULL;
 }
 
-int cashsvr_configure(void)
+static void *cashsvr_rgbc_init_thread(void *unusedvar UNUSED)
 {
-        char propbuf[PROPERTY_VALUE_MAX];
-	struct cash_tamisc_calib_params calib_params;
-	int rc = 0;
+	int rc;
 
-	cash_conf.tof_min = 0;
-	cash_conf.tof_max = 1030;
-	cash_conf.tof_hyst = TOF_STABILIZATION_HYST_MM;
-	cash_conf.tof_max_runs = TOF_STABILIZATION_DEF_RUNS;
-	cash_conf.tof_polyreg_degree = FOCTBL_POLYREG_DEGREE;
-	cash_conf.tof_polyreg_extra = 0;
-	cash_conf.use_tof_stabilized = 0;
-	cash_conf.disable_tof = 0;
-	cash_conf.rgbc_clear_min = 0;
-	cash_conf.rgbc_clear_max = 300;
-	cash_conf.rgbc_polyreg_degree = FOCTBL_POLYREG_DEGREE;
-	cash_conf.rgbc_polyreg_extra = 0;
-	cash_conf.disable_rgbc = 0;
+	rc = cashsvr_calib_update(CALIB_OWNS_RGBC, &cash_conf);
+	if (rc < 0)
+		goto end;
 
-	/*
-	 * Retrieve the calibration data either from MiscTA
-	 * or from CASH's calibration file
-	 */
-	cash_miscta_init_params(&calib_params);
+	/* The color pipeline gets its calibration out of MiscTA */
+	cashsvr_init_wait(SUBSYS_MISCTA);
+	cash_color_calib_init(calib_params_valid ? &calib_params : NULL,
+			      &cashsvr_color_calib);
 
-	rc = parse_cash_tof_xml_data(CASHSERVER_TOF_CONF_FILE, "tof_focus",
-				&focus_conf, &cash_conf);
-	if (rc < 0) {
-		ALOGE("Cannot parse configuration for ToF assisted AF");
-	} else {
-		rc = cash_input_tof_init(&calib_params);
-		if (rc < 0)
-			ALOGW("Cannot open ToF. Ranging will be unavailable");
-		cash_autofocus_get_coeff();
-	}
+	cash_rgbc_set_flicker(cash_conf.rgbc_flicker_ms);
+	cash_rgbc_set_autorange(cash_conf.rgbc_autorange);
+
+	rc = cash_input_rgbc_init(calib_params_valid ? &calib_params : NULL);
+	if (rc == -ENODEV)
+		ALOGW("No RGBC yet. Exposure control will wait for it");
+	else if (rc < 0)
+		ALOGW("Cannot open RGBC. Exposure control will be unavailable");
+
+end:
+	cashsvr_init_done(SUBSYS_RGBC);
+
+	return NULL;
+}
+
+/*
+ * cashsvr_read_props - Reads the persist.vendor.cash.* configuration
+ *			into conf, defaults included.
+ */
+static void cashsvr_read_props(struct cash_configuration *conf)
+{
+        char propbuf[PROPERTY_VALUE_MAX];
+
+	conf->use_tof_stabilized = 0;
+	conf->disable_tof = 0;
+	conf->use_focus_lut = 1;
+	conf->disable_rgbc = 0;
+	conf->power_idle_ms = CASHSERVER_POWER_IDLE_MS;
+	conf->power_warm_ms = CASHSERVER_POWER_WARM_MS;
+	conf->single_thread = 0;
+	conf->rgbc_flicker_ms = 0;
+	conf->rgbc_autorange = 1;
 
 	/*
 	 * Use stabilized read with score system or otherwise do
@@ -518,7 +3181,7 @@ int cashsvr_configure(void)
 	 */
         property_get("persist.vendor.cash.tof.stabilized", propbuf, "0");
 	if (atoi(propbuf) > 0)
-		cash_conf.use_tof_stabilized = 1;
+		conf->use_tof_stabilized = 1;
 
 	/*
 	 * Disable ToF functionality if this configuration
@@ -526,21 +3189,16 @@ int cashsvr_configure(void)
 	 */
         property_get("persist.vendor.cash.tof.disable", propbuf, "0");
 	if (atoi(propbuf) > 0)
-		cash_conf.disable_tof = 1;
+		conf->disable_tof = 1;
 
 	/*
-	 * Initialize RGBC sensor
+	 * Evaluate the focus polynomial once per millimeter at boot and
+	 * just look the focus step up at runtime, unless this
+	 * configuration option is 0.
 	 */
-	rc = parse_cash_rgbc_xml_data(CASHSERVER_RGBC_CONF_FILE, "clear_iso",
-				&clear_iso_conf, &cash_conf);
-	if (rc < 0) {
-		ALOGE("Cannot parse configuration for RGBC assisted AE");
-	} else {
-		rc = cash_input_rgbc_init(&calib_params);
-		if (rc < 0)
-			ALOGW("Cannot open RGBC. Exposure control will be unavailable");
-		cash_clear_iso_get_coeff();
-	}
+	property_get("persist.vendor.cash.tof.focus_lut", propbuf, "1");
+	if (atoi(propbuf) <= 0)
+		conf->use_focus_lut = 0;
 
 	/*
 	 * Disable RGBC functionality if this configuration
@@ -548,11 +3206,332 @@ int cashsvr_configure(void)
 	 */
         property_get("persist.vendor.cash.rgbc.disable", propbuf, "0");
 	if (atoi(propbuf) > 0)
-		cash_conf.disable_rgbc = 1;
+		conf->disable_rgbc = 1;
+
+	/*
+	 * Power sensors down after this many milliseconds without
+	 * queries, and up again on the next one. Zero keeps them up
+	 * until explicitly stopped.
+	 */
+	property_get("persist.vendor.cash.power.idle_ms", propbuf, "");
+	if (propbuf[0] != '\0' && atoi(propbuf) >= 0)
+		conf->power_idle_ms = atoi(propbuf);
+
+	/*
+	 * Keep sensors up for this many milliseconds after they are
+	 * stopped, in case the camera gets reopened right away.
+	 */
+	property_get("persist.vendor.cash.power.warm_ms", propbuf, "");
+	if (propbuf[0] != '\0' && atoi(propbuf) >= 0)
+		conf->power_warm_ms = atoi(propbuf);
+
+	/*
+	 * Serve the sensors and all of the timers in the event loop
+	 * instead of with a thread each, if this configuration option
+	 * is 1. Nothing wakes an idle server up then.
+	 */
+	property_get("persist.vendor.cash.single_thread", propbuf, "0");
+	if (atoi(propbuf) > 0)
+		conf->single_thread = 1;
+
+	/*
+	 * Look for light flicker every this many milliseconds, taking
+	 * the RGBC away from the regular readings for a fraction of a
+	 * second each time. Zero disables the flicker detection.
+	 */
+	property_get("persist.vendor.cash.rgbc.flicker_ms", propbuf, "0");
+	if (atoi(propbuf) > 0)
+		conf->rgbc_flicker_ms = atoi(propbuf);
+
+	/*
+	 * Keep the RGBC at the gain and integration time it got enabled
+	 * with, rather than adapting them to the light, if this
+	 * configuration option is 0.
+	 */
+	property_get("persist.vendor.cash.rgbc.autorange", propbuf, "1");
+	if (atoi(propbuf) <= 0)
+		conf->rgbc_autorange = 0;
+}
+
+/* Poked by the properties watcher, polled by the files watcher */
+static int cashsvr_reload_fd = -1;
+
+/*
+ * cashsvr_props_watch_thread - Follows the properties: the ToF read
+ *				mode, focus LUT, flicker and RGBC
+ *				auto-ranging ones get applied live,
+ *				the others need a restart.
+ */
+static void *cashsvr_props_watch_thread(void *unusedvar UNUSED)
+{
+	struct cash_configuration props, warned;
+	uint32_t serial = 0;
+	bool changed;
+
+	cashsvr_init_wait(SUBSYS_TOF);
+	cashsvr_init_wait(SUBSYS_RGBC);
+
+	warned = cash_conf;
+	do {
+		cashsvr_read_props(&props);
+
+		if (props.disable_tof != warned.disable_tof ||
+		    props.disable_rgbc != warned.disable_rgbc ||
+		    props.power_idle_ms != warned.power_idle_ms ||
+		    props.power_warm_ms != warned.power_warm_ms ||
+		    props.single_thread != warned.single_thread) {
+			ALOGW("Configuration changed: restart to apply it");
+			warned = props;
+		}
+
+		pthread_mutex_lock(&cashsvr_calib_lock);
+		changed = props.use_tof_stabilized !=
+				cash_conf.use_tof_stabilized ||
+			  props.use_focus_lut != cash_conf.use_focus_lut;
+		cash_conf.use_tof_stabilized = props.use_tof_stabilized;
+		cash_conf.use_focus_lut = props.use_focus_lut;
+		cash_conf.rgbc_flicker_ms = props.rgbc_flicker_ms;
+		cash_conf.rgbc_autorange = props.rgbc_autorange;
+		pthread_mutex_unlock(&cashsvr_calib_lock);
+
+		/* Picked up by the RGBC threads with their next sample */
+		cash_rgbc_set_flicker(props.rgbc_flicker_ms);
+		cash_rgbc_set_autorange(props.rgbc_autorange);
+
+		if (changed)
+			eventfd_write(cashsvr_reload_fd, 1);
+
+		/* Any property change system-wide bumps the serial */
+	} while (__system_property_wait(NULL, serial, &serial, NULL));
+
+	ALOGE("Cannot watch properties anymore");
+
+	return NULL;
+}
+
+/*
+ * cashsvr_files_watch - Adds an inotify watch on the directory of a
+ *			 calibration file: editors and package updates
+ *			 replace files, rather than writing them.
+ *
+ * \return Returns the watch descriptor or negative errno.
+ */
+static int cashsvr_files_watch(int ifd, const char *path)
+{
+	char dir[PATH_MAX];
+	int wd;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	wd = inotify_add_watch(ifd, dirname(dir), IN_CLOSE_WRITE |
+			       IN_MOVED_TO | IN_CREATE | IN_ATTRIB);
+	if (wd < 0)
+		ALOGW("Cannot watch %s for changes", path);
+
+	return wd;
+}
+
+/*
+ * cashsvr_files_changed - Tells which calibration files the queued
+ *			   inotify events are about.
+ *
+ * \return Returns CALIB_OWNS_* flags.
+ */
+static unsigned int cashsvr_files_changed(int ifd, int tof_wd, int rgbc_wd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *tof_name = strrchr(CASHSERVER_TOF_CONF_FILE, '/') + 1;
+	const char *rgbc_name = strrchr(CASHSERVER_RGBC_CONF_FILE, '/') + 1;
+	const struct inotify_event *ev;
+	unsigned int what = 0;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(ifd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len;
+		     p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->len == 0)
+				continue;
+
+			if (ev->wd == tof_wd &&
+			    strcmp(ev->name, tof_name) == 0)
+				what |= CALIB_OWNS_TOF;
+			if (ev->wd == rgbc_wd &&
+			    strcmp(ev->name, rgbc_name) == 0)
+				what |= CALIB_OWNS_RGBC;
+		}
+	}
+
+	return what;
+}
+
+/*
+ * cashsvr_files_watch_thread - Rebuilds and publishes the calibration
+ *				when its files or the live properties
+ *				change. Changes get collected until
+ *				things settle down, so that a file being
+ *				written gets parsed once, when complete.
+ */
+static void *cashsvr_files_watch_thread(void *unusedvar UNUSED)
+{
+	struct cash_configuration base;
+	struct pollfd pfd[2];
+	unsigned int what;
+	eventfd_t val;
+	int ifd, tof_wd = -1, rgbc_wd = -1, timeout;
+
+	cashsvr_init_wait(SUBSYS_TOF);
+	cashsvr_init_wait(SUBSYS_RGBC);
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd < 0) {
+		ALOGW("Cannot watch the calibration files");
+	} else {
+		tof_wd = cashsvr_files_watch(ifd, CASHSERVER_TOF_CONF_FILE);
+		rgbc_wd = cashsvr_files_watch(ifd, CASHSERVER_RGBC_CONF_FILE);
+	}
+
+	pfd[0].fd = ifd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = cashsvr_reload_fd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		what = 0;
+		timeout = -1;
+
+		while (poll(pfd, 2, timeout) > 0) {
+			if (pfd[0].revents & POLLIN)
+				what |= cashsvr_files_changed(ifd, tof_wd,
+							      rgbc_wd);
+			/* Only the ToF has live properties */
+			if ((pfd[1].revents & POLLIN) &&
+			    eventfd_read(cashsvr_reload_fd, &val) == 0)
+				what |= CALIB_OWNS_TOF;
+
+			if (what)
+				timeout = CASHSERVER_RELOAD_SETTLE_MS;
+		}
+
+		if (!what)
+			continue;
+
+		pthread_mutex_lock(&cashsvr_calib_lock);
+		base = cash_conf;
+		pthread_mutex_unlock(&cashsvr_calib_lock);
+
+		ALOGI("Reloading the%s%s calibration",
+			what & CALIB_OWNS_TOF ? " ToF" : "",
+			what & CALIB_OWNS_RGBC ? " RGBC" : "");
+		cashsvr_calib_update(what, &base);
+	}
+
+	return NULL;
+}
+
+/*
+ * cashsvr_configure - Reads the configuration and starts initializing
+ *		       MiscTA, ToF and RGBC concurrently, without
+ *		       waiting for any of them.
+ *
+ * \return Returns zero or negative errno.
+ */
+int cashsvr_configure(void)
+{
+	void *(*init_fn[SUBSYS_MAX])(void *) = {
+		[SUBSYS_MISCTA] = cashsvr_miscta_init_thread,
+		[SUBSYS_TOF] = cashsvr_tof_init_thread,
+		[SUBSYS_RGBC] = cashsvr_rgbc_init_thread,
+	};
+	struct cashsvr_calib *cal;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i, rc = 0;
+
+	cash_conf.tof_min = 0;
+	cash_conf.tof_max = 1030;
+	cash_conf.tof_hyst = TOF_STABILIZATION_HYST_MM;
+	cash_conf.tof_max_runs = TOF_STABILIZATION_DEF_RUNS;
+	cash_conf.tof_polyreg_degree = FOCTBL_POLYREG_DEGREE;
+	cash_conf.tof_polyreg_extra = 0;
+	cash_conf.tof_filter.type = TOF_FILTER_NONE;
+	cash_conf.tof_filter.ema_alpha = TOF_FILTER_DEF_EMA_ALPHA;
+	cash_conf.tof_filter.median_len = TOF_FILTER_DEF_MEDIAN_LEN;
+	cash_conf.tof_filter.kalman_q = TOF_FILTER_DEF_KALMAN_Q;
+	cash_conf.tof_filter.kalman_r = TOF_FILTER_DEF_KALMAN_R;
+	cash_conf.rgbc_clear_min = 0;
+	cash_conf.rgbc_clear_max = 300;
+	cash_conf.rgbc_polyreg_degree = FOCTBL_POLYREG_DEGREE;
+	cash_conf.rgbc_polyreg_extra = 0;
+
+	cashsvr_read_props(&cash_conf);
+
+	/* Uncalibrated until the init threads publish their halves */
+	cal = cashsvr_calib_alloc(&cash_conf);
+	if (cal == NULL)
+		return -ENOMEM;
+	cashsvr_calib_cur = cal;
+
+	/*
+	 * Find the sensors once for all, then follow them coming and
+	 * going: as root, like the init threads, to set them up.
+	 */
+	if (cash_input_discovery_init() < 0)
+		ALOGW("Input devices discovery went wrong");
+
+	/*
+	 * Serve clients right away: requests for the subsystems that are
+	 * still being initialized get a "not ready" reply meanwhile.
+	 * Credentials are per thread: these keep running as root until
+	 * done, even after the main thread drops to system.
+	 */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < SUBSYS_MAX; i++) {
+		if (pthread_create(&thread, &attr, init_fn[i], NULL) == 0)
+			continue;
+
+		/* Better late than never */
+		ALOGW("Cannot create init thread %d: running it inline", i);
+		init_fn[i](NULL);
+		rc = -ENXIO;
+	}
+	pthread_attr_destroy(&attr);
 
 	return rc;
 }
 
+/*
+ * cashsvr_watch_start - Follows the calibration files and the
+ *			 properties, so that tuning doesn't need a
+ *			 restart. Credentials are per thread: this has
+ *			 to be called once in system context, for the
+ *			 watchers not to parse and write files as root.
+ */
+static void cashsvr_watch_start(void)
+{
+	void *(*watch_fn[])(void *) = {
+		cashsvr_files_watch_thread,
+		cashsvr_props_watch_thread,
+	};
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
+
+	cashsvr_reload_fd = eventfd(0, EFD_CLOEXEC);
+	if (cashsvr_reload_fd < 0) {
+		ALOGW("Cannot watch the calibration for changes");
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < 2; i++)
+		if (pthread_create(&thread, &attr, watch_fn[i], NULL) != 0)
+			ALOGW("Cannot watch the calibration for changes");
+	pthread_attr_destroy(&attr);
+}
+
 int main(void)
 {
 	int rc;
@@ -564,15 +3543,21 @@ int main(void)
 	if (rc != 0)
 		ALOGW("Configuration went wrong. You will experience issues.");
 
-	/* We're done setting permissions now, let's move back to system context */
+	/*
+	 * Only the init threads need more than that to set permissions:
+	 * let's move back to system context, the server included.
+	 */
 	pwd = getpwnam("system");
 	if (pwd == NULL)
 		ALOGW("failed to get uid for system");
 	else if (setuid(pwd->pw_uid) == -1)
 		ALOGW("Failed to change uid");
 
+	/* No need for root to refresh the calibration and its cache */
+	cashsvr_watch_start();
+
 start:
-	/* All devices opened and configured. Start! */
+	/* Devices are still being set up, but clients can come. Start! */
 	rc = manage_cashsvr(true);
 	if (rc == 0) {
 		ALOGI("Camera Augmented Sensing Helper Server started");
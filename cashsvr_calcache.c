@@ -0,0 +1,272 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * Compiled calibration cache
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG			"CASH_CALCACHE"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <log/log.h>
+
+#include "cash_private.h"
+
+#define CASH_CALCACHE_MAGIC	0x43414348	/* "HCAC" */
+#define CASH_CALCACHE_ALIGN	8
+
+struct cash_calcache_hdr {
+	uint32_t magic;
+	uint32_t version;
+	/* What the cache got compiled from */
+	int64_t src_size;
+	int64_t src_mtime_ns;
+	uint64_t src_hash;
+	uint64_t total_size;
+	struct {
+		uint64_t off;
+		uint64_t len;
+	} blob[CALCACHE_BLOB_MAX];
+};
+
+/*
+ * cash_calcache_src_key - Gets size, modification time and FNV-1a hash
+ *			   of a calibration file.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_calcache_src_key(const char *src_path,
+				 struct cash_calcache_hdr *hdr)
+{
+	unsigned char buf[4096];
+	struct stat st;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	ssize_t i, len;
+	int fd, rc = 0;
+
+	fd = open(src_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		rc = -errno;
+		goto end;
+	}
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < len; i++) {
+			hash ^= buf[i];
+			hash *= 0x100000001b3ULL;
+		}
+	}
+	if (len < 0) {
+		rc = -errno;
+		goto end;
+	}
+
+	hdr->src_size = st.st_size;
+	hdr->src_mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL +
+			    st.st_mtim.tv_nsec;
+	hdr->src_hash = hash;
+end:
+	close(fd);
+	return rc;
+}
+
+/*
+ * cash_calcache_load - Maps a calibration cache read-only, if it was
+ *			compiled out of the current calibration file
+ *			by this very version of the server.
+ *
+ * \param path - Cache file
+ * \param src_path - Calibration file the cache has to match
+ *
+ * \return Returns zero or negative errno, -ESTALE if the cache has
+ *	   to be rebuilt.
+ */
+int cash_calcache_load(const char *path, const char *src_path,
+		       struct cash_calcache *cache)
+{
+	struct cash_calcache_hdr key, *hdr;
+	struct stat st;
+	void *map;
+	int fd, i, rc;
+
+	memset(cache, 0, sizeof(*cache));
+
+	rc = cash_calcache_src_key(src_path, &key);
+	if (rc < 0)
+		return rc;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -ESTALE;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	hdr = map;
+	if (hdr->magic != CASH_CALCACHE_MAGIC ||
+	    hdr->version != CASH_CALCACHE_VERSION ||
+	    hdr->total_size != (uint64_t)st.st_size ||
+	    hdr->src_size != key.src_size ||
+	    hdr->src_mtime_ns != key.src_mtime_ns ||
+	    hdr->src_hash != key.src_hash) {
+		rc = -ESTALE;
+		goto err;
+	}
+
+	for (i = 0; i < CALCACHE_BLOB_MAX; i++) {
+		if (hdr->blob[i].off > hdr->total_size ||
+		    hdr->blob[i].len > hdr->total_size - hdr->blob[i].off) {
+			ALOGE("Corrupted calibration cache %s", path);
+			rc = -ESTALE;
+			goto err;
+		}
+
+		cache->blob[i] = hdr->blob[i].len ?
+				 (char*)map + hdr->blob[i].off : NULL;
+		cache->blob_len[i] = hdr->blob[i].len;
+	}
+
+	cache->map = map;
+	cache->map_len = st.st_size;
+
+	return 0;
+err:
+	munmap(map, st.st_size);
+	return rc;
+}
+
+/*
+ * cash_calcache_store - Compiles the given blobs into a calibration
+ *			 cache for src_path. The file gets replaced
+ *			 atomically: readers see the old or the new one.
+ *
+ * \param blob, blob_len - Contents, NULL or zero length for none
+ *
+ * \return Returns zero or negative errno.
+ */
+int cash_calcache_store(const char *path, const char *src_path,
+			const void *blob[CALCACHE_BLOB_MAX],
+			const size_t blob_len[CALCACHE_BLOB_MAX])
+{
+	static const char pad[CASH_CALCACHE_ALIGN];
+	struct cash_calcache_hdr hdr;
+	char tmp_path[PATH_MAX];
+	uint64_t off;
+	size_t padlen;
+	int fd, i, rc;
+
+	memset(&hdr, 0, sizeof(hdr));
+	rc = cash_calcache_src_key(src_path, &hdr);
+	if (rc < 0)
+		return rc;
+
+	hdr.magic = CASH_CALCACHE_MAGIC;
+	hdr.version = CASH_CALCACHE_VERSION;
+
+	/* Every blob starts aligned, so that it can be used in place */
+	off = sizeof(hdr);
+	for (i = 0; i < CALCACHE_BLOB_MAX; i++) {
+		off = (off + CASH_CALCACHE_ALIGN - 1) &
+		      ~(uint64_t)(CASH_CALCACHE_ALIGN - 1);
+		hdr.blob[i].off = off;
+		hdr.blob[i].len = blob[i] ? blob_len[i] : 0;
+		off += hdr.blob[i].len;
+	}
+	hdr.total_size = off;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ALOGE("Cannot create %s", tmp_path);
+		return -errno;
+	}
+
+	errno = 0;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto err;
+
+	off = sizeof(hdr);
+	for (i = 0; i < CALCACHE_BLOB_MAX; i++) {
+		padlen = hdr.blob[i].off - off;
+		if (padlen && write(fd, pad, padlen) != (ssize_t)padlen)
+			goto err;
+
+		if (hdr.blob[i].len &&
+		    write(fd, blob[i], hdr.blob[i].len) !=
+		    (ssize_t)hdr.blob[i].len)
+			goto err;
+
+		off = hdr.blob[i].off + hdr.blob[i].len;
+	}
+
+	if (fsync(fd) < 0)
+		goto err;
+	close(fd);
+
+	if (rename(tmp_path, path) < 0) {
+		rc = -errno;
+		unlink(tmp_path);
+		return rc;
+	}
+
+	return 0;
+err:
+	rc = errno ? -errno : -EIO;
+	ALOGE("Cannot write the calibration cache %s", path);
+	close(fd);
+	unlink(tmp_path);
+	return rc;
+}
+
+/*
+ * cash_calcache_owns - Tells whether ptr points into the cache, which
+ *			must then never be written or freed.
+ */
+bool cash_calcache_owns(struct cash_calcache *cache, const void *ptr)
+{
+	const char *p = ptr;
+
+	return cache->map != NULL && p >= (const char*)cache->map &&
+	       p < (const char*)cache->map + cache->map_len;
+}
+
+void cash_calcache_release(struct cash_calcache *cache)
+{
+	if (cache->map != NULL)
+		munmap(cache->map, cache->map_len);
+
+	memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,215 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * RGBC-IR color pipeline: lux, color temperature and white balance
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG			"CASH_COLOR"
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <log/log.h>
+
+#include "cash_private.h"
+#include "cash_input_rgbc.h"
+
+/* Channels, in the order MiscTA has them */
+enum cash_color_chan {
+	CHAN_R,
+	CHAN_G,
+	CHAN_B,
+	CHAN_C,
+	CHAN_IR,
+};
+
+/* Reference illuminants of the factory calibration: A and D65 */
+#define COLOR_REF_A_CCT		2856.0
+#define COLOR_REF_D65_CCT	6504.0
+
+/* ln(B/R) under illuminant A of a nominal part, daylight being neutral */
+#define COLOR_NOMINAL_LOG_BR_A	-1.05
+
+#define COLOR_CCT_MIN		1500
+#define COLOR_CCT_MAX		12000
+
+/* Fewer counts than this on a channel, without IR, tell no color */
+#define COLOR_MIN_COUNTS	8.0
+
+/* AMS DN40 lux equation, for the TCS34xx family behind clear glass */
+#define COLOR_LUX_COEF_R	0.136
+#define COLOR_LUX_COEF_G	1.0
+#define COLOR_LUX_COEF_B	-0.444
+#define COLOR_LUX_DF		310.0
+
+/*
+ * cash_color_ir_remove - Takes the IR share out of the R, G and B
+ *			  channels, as estimated by DN40: the clear
+ *			  channel sees the IR once, their sum twice.
+ *
+ * \return Returns the IR share.
+ */
+static double cash_color_ir_remove(double r, double g, double b, double c,
+				   double out[3])
+{
+	double ir = (r + g + b - c) / 2;
+
+	if (ir < 0)
+		ir = 0;
+
+	out[CHAN_R] = r - ir;
+	out[CHAN_G] = g - ir;
+	out[CHAN_B] = b - ir;
+
+	return ir;
+}
+
+static bool cash_color_is_lit(const double ch[3])
+{
+	return ch[CHAN_R] >= COLOR_MIN_COUNTS &&
+	       ch[CHAN_G] >= COLOR_MIN_COUNTS &&
+	       ch[CHAN_B] >= COLOR_MIN_COUNTS;
+}
+
+/*
+ * cash_color_calib_init - Gets the color calibration of the module out
+ *			   of the responses of its sensor to illuminant A
+ *			   (rgbcir_caps1) and D65 (rgbcir_caps2), which
+ *			   were measured in the factory.
+ *
+ * R and B get scaled so that daylight reads neutral, then the B/R
+ * ratio under A gives the other end of the color temperature scale.
+ * Without a sane calibration nominal values are used instead.
+ */
+void cash_color_calib_init(const struct cash_tamisc_calib_params *calib,
+			   struct cash_color_calib *cc)
+{
+	const uint16_t *a, *d;
+	double ch_a[3], ch_d[3];
+
+	cc->valid = false;
+	cc->chan_gain[CHAN_R] = 1.0;
+	cc->chan_gain[CHAN_G] = 1.0;
+	cc->chan_gain[CHAN_B] = 1.0;
+	cc->log_br_a = COLOR_NOMINAL_LOG_BR_A;
+	cc->log_br_d65 = 0;
+
+	if (calib == NULL) {
+		ALOGW("No color calibration. Using nominal values.");
+		return;
+	}
+
+	a = calib->rgbcir_caps1;
+	d = calib->rgbcir_caps2;
+	cash_color_ir_remove(a[CHAN_R], a[CHAN_G], a[CHAN_B], a[CHAN_C], ch_a);
+	cash_color_ir_remove(d[CHAN_R], d[CHAN_G], d[CHAN_B], d[CHAN_C], ch_d);
+	if (!cash_color_is_lit(ch_a) || !cash_color_is_lit(ch_d))
+		goto bad;
+
+	cc->chan_gain[CHAN_R] = ch_d[CHAN_G] / ch_d[CHAN_R];
+	cc->chan_gain[CHAN_B] = ch_d[CHAN_G] / ch_d[CHAN_B];
+	cc->log_br_a = log((ch_a[CHAN_B] * cc->chan_gain[CHAN_B]) /
+			   (ch_a[CHAN_R] * cc->chan_gain[CHAN_R]));
+
+	/* Incandescent light is way redder than daylight */
+	if (cc->log_br_a > -0.1)
+		goto bad;
+
+	cc->valid = true;
+	ALOGI("Color calibration: R %.3f B %.3f, ln(B/R) at A %.3f",
+		cc->chan_gain[CHAN_R], cc->chan_gain[CHAN_B], cc->log_br_a);
+	return;
+
+bad:
+	ALOGW("Bad color calibration in MiscTA. Using nominal values.");
+	cc->chan_gain[CHAN_R] = 1.0;
+	cc->chan_gain[CHAN_B] = 1.0;
+	cc->log_br_a = COLOR_NOMINAL_LOG_BR_A;
+}
+
+/*
+ * cash_color_process - Translates an RGBC-IR reading into lux, color
+ *			temperature and white balance gains.
+ *
+ * The color temperature is interpolated in mired, which goes about
+ * linearly with ln(B/R), between the two references. Readings that
+ * are too dark for colors to be told still give lux out.
+ *
+ * \return Returns zero or -ENODATA if the reading is incomplete.
+ */
+int cash_color_process(const struct cash_color_calib *cc,
+		       const struct cash_tcs3490 *tcsvl,
+		       struct cash_color *color)
+{
+	double ch[3], ir, cpl, lux, log_br, mired, mired_a, mired_d, cct;
+
+	if (tcsvl->clear < 0 || tcsvl->red < 0 ||
+	    tcsvl->green < 0 || tcsvl->blue < 0)
+		return -ENODATA;
+
+	memset(color, 0, sizeof(*color));
+	color->lux = -1;
+	color->cct = -1;
+	color->awb_gain_r = 1.0f;
+	color->awb_gain_g = 1.0f;
+	color->awb_gain_b = 1.0f;
+	color->calibrated = cc->valid;
+	color->timestamp_ns = tcsvl->timestamp_ns;
+
+	ir = cash_color_ir_remove(tcsvl->red, tcsvl->green, tcsvl->blue,
+				  tcsvl->clear, ch);
+
+	/* The IR channel tells best, when the sensor has one */
+	if (tcsvl->clear > 0)
+		color->ir_ratio = (tcsvl->ir >= 0 ? tcsvl->ir : ir) /
+				  tcsvl->clear;
+
+	/* Counts per lux, out of the settings the counts were taken with */
+	if (tcsvl->again > 0 && tcsvl->itime_us > 0) {
+		cpl = tcsvl->itime_us / 1000.0 * tcsvl->again / COLOR_LUX_DF;
+		lux = (COLOR_LUX_COEF_R * ch[CHAN_R] +
+		       COLOR_LUX_COEF_G * ch[CHAN_G] +
+		       COLOR_LUX_COEF_B * ch[CHAN_B]) / cpl;
+		color->lux = lux > 0 ? (int32_t)lround(lux) : 0;
+	}
+
+	if (!cash_color_is_lit(ch))
+		return 0;
+
+	ch[CHAN_R] *= cc->chan_gain[CHAN_R];
+	ch[CHAN_B] *= cc->chan_gain[CHAN_B];
+
+	color->awb_gain_r = (float)(ch[CHAN_G] / ch[CHAN_R]);
+	color->awb_gain_b = (float)(ch[CHAN_G] / ch[CHAN_B]);
+
+	log_br = log(ch[CHAN_B] / ch[CHAN_R]);
+	mired_a = 1000000.0 / COLOR_REF_A_CCT;
+	mired_d = 1000000.0 / COLOR_REF_D65_CCT;
+	mired = mired_d + (log_br - cc->log_br_d65) * (mired_a - mired_d) /
+			  (cc->log_br_a - cc->log_br_d65);
+
+	cct = mired > 0 ? 1000000.0 / mired : COLOR_CCT_MAX;
+	if (cct < COLOR_CCT_MIN)
+		cct = COLOR_CCT_MIN;
+	else if (cct > COLOR_CCT_MAX)
+		cct = COLOR_CCT_MAX;
+	color->cct = (int32_t)lround(cct);
+
+	return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * Light flicker detection out of bursts of RGBC clear samples
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG			"CASH_FLICKER"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <log/log.h>
+
+#include "cash_private.h"
+#include "cash_input_rgbc.h"
+
+/* Bins left to the offset of the counts, which the window spreads */
+#define FLICKER_BIN_MIN		2
+
+/* Below these, the light is taken as steady */
+#define FLICKER_MIN_CONFIDENCE	0.4f
+#define FLICKER_MIN_MODULATION	0.02f
+
+/* Flicker of lamps on 50Hz and 60Hz mains */
+#define FLICKER_MAINS_50_HZ	100.0f
+#define FLICKER_MAINS_60_HZ	120.0f
+
+/*
+ * cash_flicker_start - Gets the filters ready for a new burst.
+ */
+void cash_flicker_start(struct cash_flicker_dft *dft)
+{
+	int k;
+
+	memset(dft, 0, sizeof(*dft));
+	for (k = 0; k < FLICKER_DFT_BINS; k++)
+		dft->coef[k] = 2.0f * cosf(2.0f * (float)M_PI * k /
+					   FLICKER_DFT_LEN);
+}
+
+/*
+ * cash_flicker_push - Runs the Goertzel filters of all of the bins over
+ *		       one more sample of the burst, through a Hann
+ *		       window: it's cheap enough to be done as the
+ *		       samples come in, rather than all at the end.
+ *
+ * \return Returns true once the burst is complete.
+ */
+bool cash_flicker_push(struct cash_flicker_dft *dft, int32_t clear,
+		       int64_t timestamp_ns)
+{
+	float x, s0;
+	int k;
+
+	if (dft->n >= FLICKER_DFT_LEN)
+		return true;
+
+	if (dft->n == 0) {
+		dft->offset = clear;
+		dft->first_ns = timestamp_ns;
+	}
+
+	x = (clear - dft->offset) *
+	    (0.5f - 0.5f * cosf(2.0f * (float)M_PI * dft->n /
+				FLICKER_DFT_LEN));
+
+	for (k = 0; k < FLICKER_DFT_BINS; k++) {
+		s0 = x + dft->coef[k] * dft->s1[k] - dft->s2[k];
+		dft->s2[k] = dft->s1[k];
+		dft->s1[k] = s0;
+	}
+
+	dft->sum += clear;
+	dft->last_ns = timestamp_ns;
+	dft->n++;
+
+	return dft->n == FLICKER_DFT_LEN;
+}
+
+static inline float cash_flicker_power(const struct cash_flicker_dft *dft,
+				       int k)
+{
+	return dft->s1[k] * dft->s1[k] + dft->s2[k] * dft->s2[k] -
+	       dft->coef[k] * dft->s1[k] * dft->s2[k];
+}
+
+/*
+ * cash_flicker_analyze - Finds the strongest ripple of a complete burst
+ *			  and tells whether it is strong enough to be
+ *			  flicker. The sample rate is measured out of
+ *			  the timestamps of the burst.
+ */
+void cash_flicker_analyze(const struct cash_flicker_dft *dft,
+			  struct cash_flicker *flicker)
+{
+	float pwr[FLICKER_DFT_BINS], total = 0, peak, m0, m1, m2, delta;
+	float rate, freq, bin_hz, mean, ampl;
+	int k, kmax = FLICKER_BIN_MIN;
+
+	memset(flicker, 0, sizeof(*flicker));
+	flicker->timestamp_ns = dft->last_ns;
+
+	if (dft->n < FLICKER_DFT_LEN || dft->last_ns <= dft->first_ns)
+		return;
+
+	rate = (dft->n - 1) * 1000000000.0f /
+	       (float)(dft->last_ns - dft->first_ns);
+	flicker->sample_rate_hz = (int32_t)lroundf(rate);
+
+	for (k = FLICKER_BIN_MIN; k < FLICKER_DFT_BINS; k++) {
+		pwr[k] = cash_flicker_power(dft, k);
+		total += pwr[k];
+		if (pwr[k] > pwr[kmax])
+			kmax = k;
+	}
+
+	if (total <= 0)
+		return;
+
+	/* The window spreads a tone over three bins */
+	peak = pwr[kmax];
+	if (kmax > FLICKER_BIN_MIN)
+		peak += pwr[kmax - 1];
+	if (kmax < FLICKER_DFT_BINS - 1)
+		peak += pwr[kmax + 1];
+	flicker->confidence = peak / total;
+
+	/* Amplitude of the tone, given the coherent gain of the window */
+	mean = dft->sum / dft->n;
+	ampl = 4.0f * sqrtf(pwr[kmax]) / FLICKER_DFT_LEN;
+	flicker->modulation = mean > 0 ? ampl / mean : 0;
+
+	/* Where the tone is, in between the bins around the peak */
+	delta = 0;
+	if (kmax > FLICKER_BIN_MIN && kmax < FLICKER_DFT_BINS - 1) {
+		m0 = sqrtf(pwr[kmax - 1]);
+		m1 = sqrtf(pwr[kmax]);
+		m2 = sqrtf(pwr[kmax + 1]);
+		if (2 * m1 - m0 - m2 > 0)
+			delta = 0.5f * (m2 - m0) / (2 * m1 - m0 - m2);
+	}
+
+	bin_hz = rate / FLICKER_DFT_LEN;
+	freq = (kmax + delta) * bin_hz;
+
+	if (flicker->confidence < FLICKER_MIN_CONFIDENCE ||
+	    flicker->modulation < FLICKER_MIN_MODULATION)
+		return;
+
+	flicker->freq_hz = (int32_t)lroundf(freq);
+	if (fabsf(freq - FLICKER_MAINS_50_HZ) <= bin_hz)
+		flicker->mains_hz = 50;
+	else if (fabsf(freq - FLICKER_MAINS_60_HZ) <= bin_hz)
+		flicker->mains_hz = 60;
+
+	ALOGV("Flicker at %.1fHz, confidence %.2f, modulation %.3f",
+		freq, flicker->confidence, flicker->modulation);
+}
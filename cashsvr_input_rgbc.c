@@ -23,9 +23,6 @@
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <dlfcn.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -33,386 +30,592 @@
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
-#include <linux/input.h>
 
-#include <cutils/android_filesystem_config.h>
 #include <log/log.h>
 
 #include "cash_private.h"
 #include "cash_input_common.h"
+#include "cash_sample_ring.h"
 #include "cash_input_rgbc.h"
 #include "cash_ext.h"
 
-#define TCS3490_STR		"AMS TCS3490 Sensor"
-#define TCS3490_ALS_ITIME	"127"
-#define TCS3490_ALS_GAIN_LOW	"1"
-#define TCS3490_ALS_GAIN_MID	"4"
-#define TCS3490_ALS_GAIN_HIGH	"8"
+/*
+ * Flicker bursts: short integrations, for the sample rate to be high
+ * enough to see 100Hz and 120Hz, at a gain that fills about this share
+ * of their full scale, leaving room for the ripple to swing above it.
+ * The first sample after a switch may straddle it: it's dropped.
+ */
+#define RGBC_FLICKER_ITIME_US	3000
+#define RGBC_FLICKER_FILL_PCT	40
+
+enum cash_rgbc_flicker_state {
+	RGBC_FLICKER_IDLE,
+	RGBC_FLICKER_SETTLE,
+	RGBC_FLICKER_RUN,
+	RGBC_FLICKER_RESTORE,
+};
+
+/*
+ * Auto-ranging: gains and integration times, from the least to the
+ * most sensitive. Readings get normalized to the counts of the default
+ * range, which the enabling sets and the calibration was taken with.
+ * Below the cap of the counts, the full scale goes with the integration
+ * time just like the counts do: only the gain moves the clear channel
+ * within its full scale, so shorter integrations are of no use here.
+ */
+struct cash_rgbc_range {
+	int again;
+	int itime_us;
+};
+
+static const struct cash_rgbc_range cash_rgbc_ranges[] = {
+	{ 1, 127000 },
+	{ 4, 127000 },
+	{ 8, 127000 },
+};
+#define RGBC_RANGE_NUM		(sizeof(cash_rgbc_ranges) / sizeof(cash_rgbc_ranges[0]))
+#define RGBC_RANGE_DEFAULT	0
+
+/*
+ * Switch range when the clear channel stays out of this share of its
+ * full scale for a few samples, or right away when it saturates.
+ * Neighbouring ranges must differ by less than HIGH / LOW times, for
+ * a switch not to land out of the band on the other side.
+ */
+#define RGBC_RANGE_HIGH_PCT	80
+#define RGBC_RANGE_LOW_PCT	10
+#define RGBC_RANGE_DWELL	2
+
+/* Full scale of the TCS34xx family: 1024 counts per 2.78ms cycle */
+#define RGBC_COUNTS_PER_CYCLE	1024
+#define RGBC_CYCLE_US		2780
+#define RGBC_COUNTS_MAX		65535
 
-static int tcsvl_fd;
+/* Per instance state of the color layer */
+struct cash_rgbc_ctx {
+	/* Set as soon as the first valid sample comes in after enabling */
+	atomic_bool ready;
+
+	/*
+	 * Latest sample: written by the RGBC thread only, read by anyone
+	 * through the seqlock, so that fields always come from one sample.
+	 */
+	struct cash_tcs3490 status;
+	struct cash_seqlock lock;
+
+	/* Sample being assembled by the RGBC thread */
+	struct cash_tcs3490 next;
+
+	/* History of the clear samples, for lookups by time */
+	struct cash_sample_ring ring;
+
+	/* Range in use, and how long the readings asked for another */
+	int range;
+	int range_step;
+	int range_dwell;
+	bool range_settle;
+
+	/* Flicker burst in progress, and the settings to go back to */
+	enum cash_rgbc_flicker_state fl_state;
+	int64_t fl_next_ns;
+	int fl_again;
+	int fl_itime_us;
+	struct cash_flicker_dft fl_dft;
+
+	/* Outcome of the last burst, read through the seqlock */
+	struct cash_flicker flicker;
+	struct cash_seqlock fl_lock;
+};
 
-static char *rgbc_chip_power_path;
-static char *rgbc_power_state_path;
-static char *rgbc_gain_path;
-static char *rgbc_Itime_path;
-static bool rgbc_enabled = false;
+/* Time between flicker bursts, zero for no flicker detection */
+static atomic_int cash_rgbc_flicker_ms;
 
-struct cash_tcs3490 tcsvl_status;
+static atomic_bool cash_rgbc_autorange_on = true;
+static atomic_uint cash_rgbc_switches;
 
 #define UNUSED __attribute__((unused))
 
-#define LEN_NAME	4
-#define LEN_CHIP_POW	8
-#define LEN_POWER_STATE	15
-#define LEN_ITIME	9
-#define LEN_GAIN	9
 
-int cash_rgbc_enable(bool enable)
+static void cash_rgbc_status_publish(struct cash_rgbc_ctx *rgbc,
+				     struct cash_tcs3490 *tcsvl)
 {
-	int rc;
+	cash_seqlock_write_begin(&rgbc->lock);
+	rgbc->status = *tcsvl;
+	cash_seqlock_write_end(&rgbc->lock);
+}
 
-	if (rgbc_chip_power_path == NULL || rgbc_power_state_path == NULL)
-		return -1;
+static void cash_rgbc_status_get(struct cash_rgbc_ctx *rgbc,
+				 struct cash_tcs3490 *tcsvl)
+{
+	uint32_t seq;
 
-	/* Reset the readings to start fresh */
-	tcsvl_status.red = -1;
-	tcsvl_status.green = -1;
-	tcsvl_status.blue = -1;
-	tcsvl_status.clear = -1;
-
-	/* enabling/disabling requires writing to sysfs twice
-	 * chip_power to power up/down the chip
-	 * als_power_state to start/stop the work
-	 */
-	if (enable) {
-		rc = cash_set_parameter(rgbc_chip_power_path, "1", 1);
-		if (!rc)
-			rc = cash_set_parameter(rgbc_power_state_path, "1", 1);
-		// set default gain and Itime if sensor was just enabled
-		if (!rc)
-			rc = cash_set_parameter(rgbc_gain_path, TCS3490_ALS_GAIN_LOW, 1);
-		if (!rc)
-			rc = cash_set_parameter(rgbc_Itime_path, TCS3490_ALS_ITIME, 3);
-	} else {
-		rc = cash_set_parameter(rgbc_power_state_path, "0", 1);
-		if (!rc)
-			rc = cash_set_parameter(rgbc_chip_power_path, "0", 1);
-	}
+	do {
+		seq = cash_seqlock_read_begin(&rgbc->lock);
+		*tcsvl = rgbc->status;
+	} while (cash_seqlock_read_retry(&rgbc->lock, seq));
+}
 
-	if (rc) {
-		ALOGW("ERROR! Cannot %sable RGBC!", enable ? "en" : "dis");
-		goto end;
-	}
+/*
+ * cash_rgbc_get - Gets the state of the RGBC the server reads from, as
+ *		   long as it is running and enabled.
+ *
+ * \return Returns the state, or NULL if there is nothing to read.
+ */
+static struct cash_rgbc_ctx *cash_rgbc_get(void)
+{
+	struct cash_sensor *sns = cash_sensor_get(CASH_SENSOR_RGBC);
 
-	rc = 0;
+	/* Thread not running, we'd read nothing good here! */
+	if (sns == NULL || !sns->run)
+		return NULL;
 
-end:
-	usleep(100000);
-	rgbc_enabled = enable;
+	/* Sensor is disabled, what are we trying to read?! */
+	if (!sns->enabled)
+		return NULL;
 
-	return rc;
+	return sns->ctx;
 }
 
-static int cash_rgbc_sys_init(int devno, int plen)
+int cash_rgbc_read_inst(struct cash_tcs3490 *tcsvl_final)
 {
-	int rc = 0;
+	struct cash_rgbc_ctx *rgbc = cash_rgbc_get();
+	struct cash_tcs3490 tcsvl;
 
-	// allocate memory for all paths needed
-	rgbc_chip_power_path = (char*)calloc(plen + LEN_CHIP_POW, sizeof(char));
-	if (rgbc_chip_power_path == NULL) {
-		ALOGE("Memory exhausted. Cannot allocate.");
-		return -3;
-	}
+	if (rgbc == NULL)
+		return -1;
 
-	rgbc_power_state_path = (char*)calloc(plen + LEN_POWER_STATE, sizeof(char));
-	if (rgbc_power_state_path == NULL) {
-		ALOGE("Memory exhausted. Cannot allocate.");
-		return -3;
-	}
+	cash_rgbc_status_get(rgbc, &tcsvl);
 
-	rgbc_Itime_path = (char*)calloc(plen + LEN_ITIME, sizeof(char));
-	if (rgbc_Itime_path == NULL) {
-		ALOGE("Memory exhausted. Cannot allocate.");
-		free(rgbc_Itime_path);
-		return -3;
+	/* No reading available */
+	if (tcsvl.clear < 0) {
+		ALOGE("RGBC: No reading! clear %d", tcsvl.clear);
+		return -1;
 	}
 
-	rgbc_gain_path = (char*)calloc(plen + LEN_GAIN, sizeof(char));
-	if (rgbc_gain_path == NULL) {
-		ALOGE("Memory exhausted. Cannot allocate.");
-		free(rgbc_gain_path);
-		return -3;
-	}
+	*tcsvl_final = tcsvl;
 
-	// populate the paths
-	snprintf(rgbc_chip_power_path, plen + LEN_CHIP_POW,
-		"%s%d/chip_pow", sysfs_input_str, devno);
-	snprintf(rgbc_power_state_path, plen + LEN_POWER_STATE,
-		"%s%d/als_power_state", sysfs_input_str, devno);
-	snprintf(rgbc_Itime_path, plen + LEN_ITIME,
-		"%s%d/als_Itime", sysfs_input_str, devno);
-	snprintf(rgbc_gain_path, plen + LEN_GAIN,
-		"%s%d/als_gain", sysfs_input_str, devno);
-
-	
-	// call chown on the paths to allow access after context switch
-	rc = cash_set_permissions(rgbc_chip_power_path, "system", "input");
-	rc += cash_set_permissions(rgbc_power_state_path, "system", "input");
-	rc += cash_set_permissions(rgbc_Itime_path, "system", "input");
-	rc += cash_set_permissions(rgbc_gain_path, "system", "input");
-	if (rc < 0)
-		return rc;
+	/* Return a fake score of 1 */
+	return 1;
+}
 
-	return 0;
+static void cash_rgbc_ring_push(struct cash_rgbc_ctx *rgbc,
+				struct cash_tcs3490 *tcsvl)
+{
+	int32_t val[5];
+
+	val[0] = tcsvl->red;
+	val[1] = tcsvl->green;
+	val[2] = tcsvl->blue;
+	val[3] = tcsvl->clear;
+	val[4] = tcsvl->ir;
+
+	cash_ring_push(&rgbc->ring, tcsvl->timestamp_ns, val, 5);
 }
 
-/* TODO: Use IOCTL EVIOCGNAME as a waaaay better way */
-static int cash_input_rgbc_find_inputdev(int maxdevs, int idev_len, char* idev_name)
+/*
+ * cash_rgbc_sample_at - Gives back the RGBC reading taken at a given time
+ *
+ * \param timestamp_ns - CLOCK_MONOTONIC time of the wanted reading
+ * \param interpolate - Interpolate the readings around that time,
+ *			instead of taking the nearest one
+ *
+ * \return Returns zero or negative errno.
+ */
+int cash_rgbc_sample_at(int64_t timestamp_ns, bool interpolate,
+			struct cash_tcs3490 *tcsvl_final)
 {
-	int fd, plen, rlen, rc, i;
-	int plen_xtra = 3;
-	char buf[254];
-	char* path;
+	struct cash_rgbc_ctx *rgbc = cash_rgbc_get();
+	struct cash_sample sample;
+	int rc;
 
-	/*
-	 * Avoid checking more than 99 input devices,
-	 * because... really? :)
-	 */
-	if (maxdevs > 99)
-		return -1;
+	if (rgbc == NULL)
+		return -ENODEV;
 
-	if (maxdevs > 9)
-		plen_xtra++;
+	rc = cash_ring_get_at(&rgbc->ring, timestamp_ns,
+			      interpolate, &sample);
+	if (rc < 0)
+		return rc;
 
-	plen = strlen(sysfs_input_str) + plen_xtra;
-	path = (char*) calloc(plen + LEN_NAME, sizeof(char));
-	if (path == NULL) {
-		ALOGE("Out of memory. Cannot allocate.");
-		rc = -1;
-		goto end;
-	}
+	tcsvl_final->red = sample.val[0];
+	tcsvl_final->green = sample.val[1];
+	tcsvl_final->blue = sample.val[2];
+	tcsvl_final->clear = sample.val[3];
+	tcsvl_final->ir = sample.val[4];
+	tcsvl_final->again = cash_rgbc_ranges[RGBC_RANGE_DEFAULT].again;
+	tcsvl_final->itime_us = cash_rgbc_ranges[RGBC_RANGE_DEFAULT].itime_us;
+	tcsvl_final->timestamp_ns = sample.timestamp_ns;
 
-	for (i = 0; i <= maxdevs; i++) {
-		rc = snprintf(path, plen + LEN_NAME, "%s%d/name",
-							sysfs_input_str, i);
+	return 0;
+}
 
-		if (fd > 0)
-			close(fd);
+static void cash_rgbc_reset(struct cash_rgbc_ctx *rgbc)
+{
+	rgbc->next.red = -1;
+	rgbc->next.green = -1;
+	rgbc->next.blue = -1;
+	rgbc->next.clear = -1;
+	rgbc->next.ir = -1;
+	rgbc->next.timestamp_ns = 0;
+	cash_rgbc_status_publish(rgbc, &rgbc->next);
+	atomic_store(&rgbc->ready, false);
+
+	/* Enabling sets the default gain and Itime back anyway */
+	rgbc->range = RGBC_RANGE_DEFAULT;
+	rgbc->range_step = 0;
+	rgbc->range_dwell = 0;
+	rgbc->range_settle = false;
+	rgbc->fl_state = RGBC_FLICKER_IDLE;
+	rgbc->fl_next_ns = 0;
+	cash_seqlock_write_begin(&rgbc->fl_lock);
+	memset(&rgbc->flicker, 0, sizeof(rgbc->flicker));
+	cash_seqlock_write_end(&rgbc->fl_lock);
+}
 
-		fd = open(path, (O_RDONLY | O_NONBLOCK));
-		if (fd < 0) {
-			ALOGD("Cannot open %s", path);
-			continue;
-		}
+static int cash_rgbc_init(struct cash_sensor *sns)
+{
+	/* Nothing to read until it gets enabled */
+	cash_rgbc_reset(sns->ctx);
 
-		rlen = read(fd, buf, idev_len);
-		if (!rlen)
-			continue;
+	return 0;
+}
 
-		/*
-		 * If the string length doesn't match, avoid doing
-		 * expensive stuff, as the string cannot be the same.
-		 * Also consider some mistakes and compare it with
-		 * the name length - 1.
-		 * That will cover corner cases and will not evaluate
-		 * erroneously positive too many times...
-		 */
-		if (rlen < idev_len - 1)
-			continue;
+static int cash_rgbc_power(struct cash_sensor *sns, bool enable)
+{
+	/* Reset the readings to start fresh */
+	cash_rgbc_reset(sns->ctx);
 
-		rc = strncmp(buf, idev_name, idev_len - 1);
-		if (rc == 0) {
-			close(fd);
+	/*
+	 * Don't wait for the sensor to come up: the RGBC thread tells
+	 * when it is ready, as soon as the first clear value comes in.
+	 * A device that is away gets powered up when it comes back.
+	 */
+	sns->enabled = enable;
+	if (sns->evtno < 0)
+		return 0;
 
-			rc = cash_rgbc_sys_init(i, plen);
-			if (rc < 0)
-				goto end;
+	return sns->ops->enable(sns, enable);
+}
 
-			return i;
-		}
-	}
-end:
-	return rc;
+/*
+ * cash_rgbc_set_flicker - Sets the time between flicker bursts, zero
+ *			   disabling the flicker detection. Running
+ *			   RGBC threads switch to it after the burst
+ *			   in progress, if any.
+ */
+void cash_rgbc_set_flicker(int interval_ms)
+{
+	atomic_store(&cash_rgbc_flicker_ms, interval_ms > 0 ? interval_ms : 0);
 }
 
-int cash_input_rgbc_thr_read(struct cash_tcs3490 *tcsvl_cur,
-			int rgbc_fd)
+/*
+ * cash_rgbc_read_flicker - Gives back the outcome of the last flicker
+ *			    burst.
+ *
+ * \return Returns zero, -ENODATA if no burst completed yet, or -ENODEV.
+ */
+int cash_rgbc_read_flicker(struct cash_flicker *flicker)
 {
-	struct input_event evt[16];
-	int i, len, rc;
-	uint16_t type, code;
-	int32_t value;
+	struct cash_rgbc_ctx *rgbc = cash_rgbc_get();
+	uint32_t seq;
 
-	rc = read(rgbc_fd, &evt, sizeof(evt));
-	if (!rc) {
-		return rc;
-	}
+	if (rgbc == NULL)
+		return -ENODEV;
 
-	len = rc / sizeof(struct input_event);
-
-	for (i = 0; i < len; i++) {
-		type = evt[i].type;
-		code = evt[i].code;
-		value = evt[i].value;
-
-		switch (code) {
-			case ABS_MISC:
-				if (value >= 0) {
-					tcsvl_cur->clear = value;
-				}
-				break;
-			case ABS_HAT0X:
-				if (value >= 0) {
-					tcsvl_cur->red = value;
-				}
-				break;
-			case ABS_HAT0Y:
-				if (value >= 0) {
-					tcsvl_cur->green = value;
-				}
-				break;
-			case ABS_HAT1X:
-				if (value >= 0) {
-					tcsvl_cur->blue = value;
-				}
-				break;
-			case ABS_HAT1Y:
-				if (value >= 0) {
-					tcsvl_cur->ir = value;
-				}
-				break;
-			default:
-				break;
-		}
-	}
+	do {
+		seq = cash_seqlock_read_begin(&rgbc->fl_lock);
+		*flicker = rgbc->flicker;
+	} while (cash_seqlock_read_retry(&rgbc->fl_lock, seq));
 
-	ALOGV("RGBC VALUES R:%d G:%d B:%d C:%d IR:%d", tcsvl_cur->red, tcsvl_cur->green, tcsvl_cur->blue, tcsvl_cur->clear, tcsvl_cur->ir);
-	return 0;
+	return flicker->timestamp_ns ? 0 : -ENODATA;
 }
 
-int cash_rgbc_read_inst(struct cash_tcs3490 *tcsvl_final)
+/*
+ * cash_rgbc_flicker_sample - Runs the flicker bursts, as the samples
+ *			      come in: every so often the sensor gets
+ *			      switched to short integrations, and their
+ *			      clear counts fed to the analysis.
+ *
+ * \return Returns true if the sample belongs to a burst, rather than
+ *	   being a regular reading.
+ */
+static bool cash_rgbc_flicker_sample(struct cash_sensor *sns,
+				     struct cash_rgbc_ctx *rgbc,
+				     struct cash_tcs3490 *tcsvl)
 {
-	/* Thread not running, we'd read nothing good here! */
-	if (!cash_thread_run[THREAD_RGBC])
-		return -1;
+	int interval_ms = atomic_load(&cash_rgbc_flicker_ms);
+	struct cash_flicker flicker;
+	int64_t full, fill_pct;
+	int again;
+
+	switch (rgbc->fl_state) {
+	case RGBC_FLICKER_IDLE:
+		if (interval_ms <= 0 || sns->ops->set_integration == NULL ||
+		    tcsvl->timestamp_ns < rgbc->fl_next_ns ||
+		    tcsvl->itime_us <= 0 || tcsvl->clear < 0)
+			return false;
+
+		/* Let the regular readings start first */
+		if (rgbc->fl_next_ns == 0) {
+			rgbc->fl_next_ns = tcsvl->timestamp_ns +
+					   interval_ms * 1000000LL;
+			return false;
+		}
 
-	/* Sensor is disabled, what are we trying to read?! */
-	if (!rgbc_enabled)
-		return -1;
+		rgbc->fl_next_ns = tcsvl->timestamp_ns +
+				   interval_ms * 1000000LL;
+		rgbc->fl_again = tcsvl->again;
+		rgbc->fl_itime_us = tcsvl->itime_us;
 
-	/* No reading available */
-	if (tcsvl_status.clear < 0) {
-		ALOGE("ToF: No reading! clear %d", tcsvl_status.clear);
-		return -1;
+		/*
+		 * Both the counts and the full scale, short of its cap, go
+		 * with the integration time: at the same gain, the burst
+		 * fills as much of its full scale as the reading fills of
+		 * the uncapped one. The gain goes up from the one of the
+		 * reading only as far as that share is below the target.
+		 */
+		full = (int64_t)RGBC_COUNTS_PER_CYCLE * tcsvl->itime_us /
+		       RGBC_CYCLE_US;
+		fill_pct = (int64_t)tcsvl->clear * 100 / full;
+		if (fill_pct < 1)
+			fill_pct = 1;
+		again = (int)(tcsvl->again * RGBC_FLICKER_FILL_PCT / fill_pct);
+		if (again < 1)
+			again = 1;
+		if (sns->ops->set_integration(sns, again,
+					      RGBC_FLICKER_ITIME_US) < 0)
+			return false;
+
+		cash_flicker_start(&rgbc->fl_dft);
+		rgbc->fl_state = RGBC_FLICKER_SETTLE;
+
+		/* This one was taken before the switch */
+		return false;
+	case RGBC_FLICKER_SETTLE:
+		rgbc->fl_state = RGBC_FLICKER_RUN;
+		return true;
+	case RGBC_FLICKER_RUN:
+		if (tcsvl->clear < 0 ||
+		    !cash_flicker_push(&rgbc->fl_dft, tcsvl->clear,
+				       tcsvl->timestamp_ns))
+			return true;
+
+		cash_flicker_analyze(&rgbc->fl_dft, &flicker);
+		cash_seqlock_write_begin(&rgbc->fl_lock);
+		rgbc->flicker = flicker;
+		cash_seqlock_write_end(&rgbc->fl_lock);
+
+		sns->ops->set_integration(sns, rgbc->fl_again,
+					  rgbc->fl_itime_us);
+		rgbc->fl_next_ns = tcsvl->timestamp_ns +
+				   interval_ms * 1000000LL;
+		rgbc->fl_state = RGBC_FLICKER_RESTORE;
+		return true;
+	case RGBC_FLICKER_RESTORE:
+	default:
+		rgbc->fl_state = RGBC_FLICKER_IDLE;
+		return true;
 	}
+}
 
-	tcsvl_final->clear = tcsvl_status.clear;
+/*
+ * cash_rgbc_set_autorange - Turns the auto-ranging on or off. Running
+ *			     RGBC threads go back to the default range
+ *			     when it gets turned off.
+ */
+void cash_rgbc_set_autorange(bool on)
+{
+	atomic_store(&cash_rgbc_autorange_on, on);
+}
 
-	/* Return a fake score of 1 */
-	return 1;
+/*
+ * cash_rgbc_range_switches - Tells how many times the RGBC sensors
+ *			      switched range since the server started.
+ */
+unsigned int cash_rgbc_range_switches(void)
+{
+	return atomic_load(&cash_rgbc_switches);
 }
 
-static void cash_input_rgbc_thread(void)
+/*
+ * cash_rgbc_autorange - Moves to a less sensitive range when the clear
+ *			 channel gets close to saturation, and to a more
+ *			 sensitive one when it sinks to the bottom of its
+ *			 range.
+ *
+ * \return Returns true if the range got switched.
+ */
+static bool cash_rgbc_autorange(struct cash_sensor *sns,
+				struct cash_rgbc_ctx *rgbc,
+				const struct cash_tcs3490 *tcsvl)
 {
-	int ret;
-	int i;
-	struct epoll_event pevt[10];
-
-	cash_rgbc_enable(true);
-
-	ALOGD("RGBC Thread started");
-
-	while (cash_thread_run[THREAD_RGBC]) {
-		ret = epoll_wait(cash_pollfd[FD_RGBC], pevt,
-					10, cash_pfdelay_ms[FD_RGBC]);
-		for (i = 0; i < ret; i++) {
-			if (pevt[i].events & EPOLLERR ||
-			    pevt[i].events & EPOLLHUP ||
-			    !(pevt[i].events & EPOLLIN))
-				continue;
-
-			if (cash_pollevt[FD_RGBC].data.fd)
-				cash_input_rgbc_thr_read(&tcsvl_status,
-					cash_pollevt[FD_RGBC].data.fd);
-		}
+	const struct cash_rgbc_range *next;
+	int64_t full;
+	int step = 0;
+
+	if (sns->ops->set_integration == NULL ||
+	    tcsvl->clear < 0 || tcsvl->itime_us <= 0)
+		return false;
+
+	full = (int64_t)RGBC_COUNTS_PER_CYCLE * tcsvl->itime_us /
+	       RGBC_CYCLE_US;
+	if (full > RGBC_COUNTS_MAX)
+		full = RGBC_COUNTS_MAX;
+
+	if (!atomic_load(&cash_rgbc_autorange_on)) {
+		if (rgbc->range != RGBC_RANGE_DEFAULT)
+			step = RGBC_RANGE_DEFAULT - rgbc->range;
+	} else if ((int64_t)tcsvl->clear * 100 >= full * RGBC_RANGE_HIGH_PCT) {
+		if (rgbc->range > 0)
+			step = -1;
+	} else if ((int64_t)tcsvl->clear * 100 < full * RGBC_RANGE_LOW_PCT) {
+		if (rgbc->range < (int)RGBC_RANGE_NUM - 1)
+			step = 1;
 	}
 
-	cash_rgbc_enable(false);
+	if (step != rgbc->range_step) {
+		rgbc->range_step = step;
+		rgbc->range_dwell = 0;
+	}
 
-	pthread_exit((void*)((int)0));
-}
+	if (step == 0)
+		return false;
+	if (++rgbc->range_dwell < RGBC_RANGE_DWELL && tcsvl->clear < full)
+		return false;
 
-struct thread_data cash_rgbc_thread_data = {
-	.thread_no = THREAD_RGBC,
-	.thread_func = cash_input_rgbc_thread
-};
+	next = &cash_rgbc_ranges[rgbc->range + step];
+	rgbc->range_dwell = 0;
+	if (sns->ops->set_integration(sns, next->again, next->itime_us) < 0)
+		return false;
 
-int cash_input_rgbc_start(bool start)
-{
-	return cash_input_threadman(start, &cash_rgbc_thread_data);
+	rgbc->range += step;
+	rgbc->range_step = 0;
+	atomic_fetch_add(&cash_rgbc_switches, 1);
+
+	ALOGD("RGBC range %d: gain %dx, Itime %dus, at clear %d",
+		rgbc->range, next->again, next->itime_us, tcsvl->clear);
+
+	return true;
 }
 
-bool cash_input_is_rgbc_alive(void)
+/*
+ * cash_rgbc_normalize - Scales a reading to the counts it would have
+ *			 had with the default gain and integration time,
+ *			 for the calibration to apply whatever the range.
+ */
+static void cash_rgbc_normalize(struct cash_tcs3490 *tcsvl)
 {
-	return cash_thread_run[THREAD_RGBC];
+	const struct cash_rgbc_range *ref =
+		&cash_rgbc_ranges[RGBC_RANGE_DEFAULT];
+	int64_t sens = (int64_t)tcsvl->again * tcsvl->itime_us;
+	int64_t ref_sens = (int64_t)ref->again * ref->itime_us;
+	int *ch[] = { &tcsvl->red, &tcsvl->green, &tcsvl->blue,
+		      &tcsvl->clear, &tcsvl->ir };
+	unsigned int i;
+
+	if (sens <= 0 || sens == ref_sens)
+		return;
+
+	for (i = 0; i < sizeof(ch) / sizeof(ch[0]); i++)
+		if (*ch[i] >= 0)
+			*ch[i] = (int)((*ch[i] * ref_sens + sens / 2) / sens);
+
+	tcsvl->again = ref->again;
+	tcsvl->itime_us = ref->itime_us;
 }
 
-int cash_input_rgbc_init(__attribute__((unused))struct cash_tamisc_calib_params *calib_params)
+/*
+ * cash_rgbc_process - Reads the pending RGBC events and publishes the
+ *		       new sample, if they completed one.
+ *		       Runs in the RGBC thread or, in the single threaded
+ *		       mode, in the server event loop.
+ */
+static void cash_rgbc_process(struct cash_sensor *sns)
 {
-	int dlen, evtno, rc;
-	char *devname, *devpath;
+	struct cash_rgbc_ctx *rgbc = sns->ctx;
+	struct cash_tcs3490 tcsvl;
 
-	dlen = strlen(TCS3490_STR);
-	devname = (char*) calloc(dlen, sizeof(char));
-	snprintf(devname, dlen, "%s", TCS3490_STR);
+	if (sns->fd < 0 || sns->ops->decode(sns, &rgbc->next) <= 0)
+		return;
 
-	evtno = cash_input_rgbc_find_inputdev(ITERATE_MAX_DEVS, dlen, devname);
-	if (evtno < 0)
-		return -1;
-
-	dlen = strlen(devfs_input_str) + 3;
-	if (evtno > 9)
-		dlen++;
+	/* Burst samples are taken with other settings: keep them out */
+	if (cash_rgbc_flicker_sample(sns, rgbc, &rgbc->next))
+		return;
 
-	devpath = (char*) calloc(dlen, sizeof(char));
-	if (devpath == NULL)
-		return -1;
+	/* The first sample after a range switch may straddle it */
+	if (rgbc->range_settle) {
+		rgbc->range_settle = false;
+		return;
+	}
 
-	snprintf(devpath, dlen, "%s%d", devfs_input_str, evtno);
+	/* Adapt to the light, unless a burst is about to start instead */
+	if (rgbc->fl_state == RGBC_FLICKER_IDLE)
+		rgbc->range_settle = cash_rgbc_autorange(sns, rgbc,
+							 &rgbc->next);
 
+	/* Channels that didn't change send no event: next keeps them raw */
+	tcsvl = rgbc->next;
+	cash_rgbc_normalize(&tcsvl);
 
-	tcsvl_fd = open(devpath, (O_RDONLY | O_NONBLOCK));
-	if (tcsvl_fd < 0) {
-		ALOGE("Error: cannot open the %s input device at %s.",
-			devname, devpath);
-		return -1;
+	cash_rgbc_status_publish(rgbc, &tcsvl);
+	cash_rgbc_ring_push(rgbc, &tcsvl);
+	if (!atomic_load(&rgbc->ready)) {
+		atomic_store(&rgbc->ready, true);
+		cash_input_notify_ready(CASH_SENSOR_RGBC);
+	} else {
+		cash_input_notify(CASH_SENSOR_RGBC);
 	}
+}
 
-	cash_pollfd[FD_RGBC] = epoll_create1(0);
-	if (cash_pollfd[FD_RGBC] == -1) {
-		ALOGE("Error: Cannot create epoll descriptor");
-		return -1;
-	}
+/* Backends of the color sensors, tried in order */
+static const struct cash_sensor_ops *const cash_rgbc_backends[] = {
+	&cash_tcs3490_ops,
+	NULL
+};
 
-	cash_pfds[FD_RGBC].fd = tcsvl_fd;
-	cash_pfds[FD_RGBC].events = POLLIN;
-	cash_pfdelay_ms[FD_RGBC] = 1000;
+static const struct cash_sensor_class cash_rgbc_class = {
+	.type = CASH_SENSOR_RGBC,
+	.backends = cash_rgbc_backends,
+	.ctx_size = sizeof(struct cash_rgbc_ctx),
+	.init = cash_rgbc_init,
+	.power = cash_rgbc_power,
+	.process = cash_rgbc_process,
+};
 
-	cash_pollevt[FD_RGBC].events = POLLIN;
-	cash_pollevt[FD_RGBC].data.fd = tcsvl_fd;
+int cash_input_rgbc_start(bool start)
+{
+	return cash_sensor_start_type(CASH_SENSOR_RGBC, start);
+}
 
-	rc = epoll_ctl(cash_pollfd[FD_RGBC], EPOLL_CTL_ADD,
-					tcsvl_fd, &cash_pollevt[FD_RGBC]);
-	if (rc) {
-		ALOGE("Cannot add epoll control");
-		return -1;
-	}
+bool cash_input_is_rgbc_alive(void)
+{
+	struct cash_sensor *sns = cash_sensor_get(CASH_SENSOR_RGBC);
 
-	cash_thread_run[THREAD_RGBC] = false;
+	return sns != NULL && sns->run;
+}
 
-	return 0;
+/*
+ * cash_input_is_rgbc_ready - Tells whether the RGBC got enabled and
+ *			      gave its first clear value out.
+ */
+bool cash_input_is_rgbc_ready(void)
+{
+	struct cash_rgbc_ctx *rgbc = cash_rgbc_get();
+
+	return rgbc != NULL && atomic_load(&rgbc->ready);
 }
 
+/*
+ * cash_input_rgbc_init - Gets the RGBC sensors attached, either now or
+ *			  as soon as they show up.
+ *
+ * \return Returns zero, -ENODEV if no sensor is there (yet), or
+ *	   negative errno.
+ */
+int cash_input_rgbc_init(struct cash_tamisc_calib_params *calib_params)
+{
+	return cash_input_discover(&cash_rgbc_class, calib_params);
+}
@@ -33,6 +33,9 @@
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <math.h>
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
@@ -43,380 +46,374 @@
 
 #include "cash_private.h"
 #include "cash_input_common.h"
+#include "cash_sample_ring.h"
 #include "cash_input_tof.h"
 #include "cash_ext.h"
 
-#define VL53L0_STR		"STM VL53L0 proximity sensor"
-#define VL53L0_HIGH_RANGE	"1"
-#define VL53L0_HIGH_ACCURACY	"2"
+/* Per instance state of the ranging layer: owned by the ToF thread */
+struct cash_tof_filter_state {
+	bool primed;
+	int64_t last_ts;
+	double ema;
+	int32_t median_win[TOF_FILTER_MEDIAN_MAX_LEN];
+	int median_head;
+	int median_count;
+	/* Kalman: range (mm), radial speed (mm/s) and their covariance */
+	double kf_x;
+	double kf_v;
+	double kf_p[2][2];
+};
 
-static int stmvl_fd;
+struct cash_tof_ctx {
+	/* Set as soon as the first valid sample comes in after enabling */
+	atomic_bool ready;
 
-static char *cash_tof_enable_path;
-static bool tof_enabled = false;
+	/*
+	 * Latest sample: written by the ToF thread only, read by anyone
+	 * through the seqlock, so that fields always come from one sample.
+	 * Published with it are the last sample that was found to be
+	 * stable and its score, and the newest filtered one.
+	 */
+	struct cash_seqlock lock;
+	struct cash_vl53l0 status;
+	struct cash_vl53l0 stable;
+	int score;
+	struct cash_vl53l0 filtered;
+
+	/* Samples being assembled by the ToF thread */
+	struct cash_vl53l0 next;
+	struct cash_vl53l0 stable_next;
+	struct cash_vl53l0 filtered_next;
+
+	/* History of the range samples, for lookups by time */
+	struct cash_sample_ring ring;
+
+	/* Latest frame of a multi-zone sensor, none if rows is zero */
+	struct cash_seqlock zones_lock;
+	struct cash_tof_zones zones;
+
+	/* Stability window */
+	struct cash_vl53l0 window[TOF_STABILIZATION_MAX_RUNS + 1];
+	int win_head, win_count, unstable_cnt;
+
+	/* Parameters in use, and the generation they were set in */
+	unsigned int params_gen;
+	int runs;
+	int hyst;
+	struct cash_tof_filter_params filter;
+	struct cash_tof_filter_state fstate;
+};
 
-struct cash_vl53l0 stmvl_status;
+/* Parameters of all the ToF sensors, picked up before their next sample */
+static pthread_mutex_t cash_tof_params_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cash_tof_runs = TOF_STABILIZATION_DEF_RUNS;
+static int cash_tof_hyst = TOF_STABILIZATION_HYST_MM;
+static struct cash_tof_filter_params cash_tof_filter = {
+	.type = TOF_FILTER_NONE,
+};
+static atomic_uint cash_tof_params_gen;
 
 #define UNUSED __attribute__((unused))
 
-#define LEN_NAME	4
-#define LEN_ENAB	16
-#define LEN_MODE	12
-#define LEN_REF_SPADS	13
-#define LEN_UM_OFFSET	13
 
-int cash_tof_enable(bool enable)
+static void cash_tof_status_publish(struct cash_tof_ctx *tof,
+				    struct cash_vl53l0 *stmvl,
+				    struct cash_vl53l0 *stable, int score,
+				    struct cash_vl53l0 *filtered)
 {
-	int fd, rc;
+	cash_seqlock_write_begin(&tof->lock);
+	tof->status = *stmvl;
+	tof->stable = *stable;
+	tof->score = score;
+	tof->filtered = *filtered;
+	cash_seqlock_write_end(&tof->lock);
+}
 
-	if (cash_tof_enable_path == NULL)
-		return -1;
+static void cash_tof_status_get(struct cash_tof_ctx *tof,
+				struct cash_vl53l0 *stmvl)
+{
+	uint32_t seq;
 
-	/* Reset the readings to start fresh */
-	stmvl_status.distance = -1;
-	stmvl_status.range_mm = -1;
-	stmvl_status.range_status = -1;
-
-	fd = open(cash_tof_enable_path, O_WRONLY | O_SYNC);
-	if (fd < 0) {
-		ALOGD("Cannot open %s", cash_tof_enable_path);
-		return 1;
-	}
+	do {
+		seq = cash_seqlock_read_begin(&tof->lock);
+		*stmvl = tof->status;
+	} while (cash_seqlock_read_retry(&tof->lock, seq));
+}
 
-	if (enable)
-		rc = write(fd, "1", 1);
-	else
-		rc = write(fd, "0", 1);
+static int cash_tof_stable_get(struct cash_tof_ctx *tof,
+			       struct cash_vl53l0 *stmvl)
+{
+	uint32_t seq;
+	int score;
 
-	if (rc < 1) {
-		ALOGW("ERROR! Cannot %sable ToF!", enable ? "en" : "dis");
-		goto end;
-	}
-	rc = 0;
-end:
-	fsync(fd);
-	close(fd);
-	usleep(100000);
-	tof_enabled = enable;
+	do {
+		seq = cash_seqlock_read_begin(&tof->lock);
+		*stmvl = tof->stable;
+		score = tof->score;
+	} while (cash_seqlock_read_retry(&tof->lock, seq));
 
-	return rc;
+	return score;
 }
 
-static int cash_tof_sys_init(bool high_accuracy, int devno, int plen,
-			     struct cash_tamisc_calib_params *calib_params)
+static void cash_tof_filtered_get(struct cash_tof_ctx *tof,
+				  struct cash_vl53l0 *stmvl)
 {
-	char* sns_mode_path;
-	char* spad_calib_path;
-	char* um_offset_path;
-	char* buf;
-	int rc, cnt;
-
-	cash_tof_enable_path = (char*)calloc(plen + LEN_ENAB, sizeof(char));
-	if (cash_tof_enable_path == NULL) {
-		ALOGE("Memory exhausted. Cannot allocate.");
-		return -3;
-	}
+	uint32_t seq;
 
-	snprintf(cash_tof_enable_path, plen + LEN_ENAB,
-			"%s%d/enable_ps_sensor", sysfs_input_str, devno);
-
-	rc = cash_set_permissions(cash_tof_enable_path, "system", "input");
-	if (rc == -1)
-		return rc;
-
-	if (high_accuracy) {
-		sns_mode_path = (char*)calloc(plen + LEN_MODE, sizeof(char));
-		if (sns_mode_path == NULL) {
-			ALOGE("Memory exhausted. Cannot allocate.");
-			free(cash_tof_enable_path);
-			cash_tof_enable_path = NULL;
-			return -3;
-		}
+	do {
+		seq = cash_seqlock_read_begin(&tof->lock);
+		*stmvl = tof->filtered;
+	} while (cash_seqlock_read_retry(&tof->lock, seq));
+}
 
-		snprintf(sns_mode_path, plen + LEN_MODE,
-			"%s%d/set_use_case", sysfs_input_str, devno);
+/*
+ * cash_tof_get - Gets the state of the ToF the server reads from, as
+ *		  long as it is running and enabled.
+ *
+ * \return Returns the state, or NULL if there is nothing to read.
+ */
+static struct cash_tof_ctx *cash_tof_get(void)
+{
+	struct cash_sensor *sns = cash_sensor_get(CASH_SENSOR_TOF);
 
-		rc = cash_set_permissions(sns_mode_path, "system", "input");
-		if (rc == -1) {
-			free(cash_tof_enable_path);
-			free(sns_mode_path);
-			cash_tof_enable_path = NULL;
-			return rc;
-		}
+	/* Thread not running, we'd read nothing good here! */
+	if (sns == NULL || !sns->run)
+		return NULL;
 
-		rc = cash_set_parameter(sns_mode_path, VL53L0_HIGH_ACCURACY,
-					sizeof(VL53L0_HIGH_ACCURACY) - 1);
-		if (rc < 0)
-			ALOGW("ERROR! Cannot set ToF High Accuracy mode!");
+	/* Sensor is disabled, what are we trying to read?! */
+	if (!sns->enabled)
+		return NULL;
 
-		free(sns_mode_path);
-	}
+	return sns->ctx;
+}
 
-	/* Apply configurations from MiscTA */
-	if (calib_params == NULL) {
-		ALOGE("Calibration is not mandatory. Going on anyway.");
-		return 0;
-	}
+/*
+ * cash_tof_set_filter - Sets the range filter to run on every sample.
+ *			 Running ToF threads switch to it before the
+ *			 next sample, starting the filter over.
+ */
+void cash_tof_set_filter(struct cash_tof_filter_params *params)
+{
+	pthread_mutex_lock(&cash_tof_params_lock);
+	cash_tof_filter = *params;
 
-	buf = (char*)calloc(5, sizeof(char));
-	if (buf == NULL) {
-		ALOGE("Memory exhausted. Cannot allocate.");
-		return 0;
-	}
+	if (cash_tof_filter.median_len < 1)
+		cash_tof_filter.median_len = 1;
+	else if (cash_tof_filter.median_len > TOF_FILTER_MEDIAN_MAX_LEN)
+		cash_tof_filter.median_len = TOF_FILTER_MEDIAN_MAX_LEN;
 
-	spad_calib_path = (char*)calloc(plen + LEN_REF_SPADS, sizeof(char));
-	if (spad_calib_path == NULL)
-		goto calib_err_mem;
+	atomic_fetch_add(&cash_tof_params_gen, 1);
+	pthread_mutex_unlock(&cash_tof_params_lock);
+}
 
-	snprintf(spad_calib_path, plen + LEN_REF_SPADS,
-		"%s%d/set_ref_spads", sysfs_input_str, devno);
+/*
+ * cash_tof_set_stabilization - Sets the parameters of the stability
+ *				estimator. Running ToF threads switch
+ *				to them before the next sample.
+ *
+ * \param runs - Number of past samples to match the newest one against
+ * \param nmatch - Minimum number of samples to match
+ * \param hyst - Hysteresis, relative to the range measurements
+ */
+void cash_tof_set_stabilization(int runs, int nmatch, int hyst)
+{
+	/* Did we get called by someone who didn't read the docs? */
+	if (runs < nmatch)
+		runs = nmatch + 1;
 
-	rc = cash_set_permissions(spad_calib_path, "system", "input");
-	if (rc == -1) {
-		free(spad_calib_path);
-		goto calib_err;
-	}
+	if (runs < 1)
+		runs = 1;
+	else if (runs > TOF_STABILIZATION_MAX_RUNS)
+		runs = TOF_STABILIZATION_MAX_RUNS;
 
-	cnt = snprintf(buf, 5, "%u", calib_params->tof_spad_num);
+	pthread_mutex_lock(&cash_tof_params_lock);
+	cash_tof_runs = runs;
+	cash_tof_hyst = hyst;
+	atomic_fetch_add(&cash_tof_params_gen, 1);
+	pthread_mutex_unlock(&cash_tof_params_lock);
+}
 
-	rc = cash_set_parameter(spad_calib_path, buf, (cnt * sizeof(char)));
-	if (rc < 0)
-		ALOGE("ERROR! Cannot set Reference SPADs!");
-	free(spad_calib_path);
+/*
+ * cash_tof_params_update - Makes a ToF thread use the parameters set
+ *			    meanwhile, if any. The stability window and
+ *			    the filter start over with them.
+ */
+static void cash_tof_params_update(struct cash_tof_ctx *tof)
+{
+	if (atomic_load(&cash_tof_params_gen) == tof->params_gen)
+		return;
+
+	pthread_mutex_lock(&cash_tof_params_lock);
+	tof->params_gen = atomic_load(&cash_tof_params_gen);
+	tof->runs = cash_tof_runs;
+	tof->hyst = cash_tof_hyst;
+	tof->filter = cash_tof_filter;
+	pthread_mutex_unlock(&cash_tof_params_lock);
+
+	tof->win_head = 0;
+	tof->win_count = 0;
+	tof->unstable_cnt = 0;
+	tof->fstate.primed = false;
+}
 
-	um_offset_path = (char*)calloc(plen + LEN_UM_OFFSET, sizeof(char));
-	if (um_offset_path == NULL)
-		goto calib_err_mem;
+/*
+ * cash_tof_zones_publish - Makes a new multi-zone frame the latest one.
+ *			    Called by the backend, in the ToF thread.
+ */
+void cash_tof_zones_publish(struct cash_sensor *sns,
+			    const struct cash_tof_zones *zones)
+{
+	struct cash_tof_ctx *tof = sns->ctx;
 
-	snprintf(um_offset_path, plen + LEN_REF_SPADS,
-		"%s%d/set_um_offset", sysfs_input_str, devno);
+	cash_seqlock_write_begin(&tof->zones_lock);
+	tof->zones = *zones;
+	cash_seqlock_write_end(&tof->zones_lock);
+}
 
-	rc = cash_set_permissions(um_offset_path, "system", "input");
-	if (rc == -1) {
-		free(um_offset_path);
-		goto calib_err;
-	}
+/*
+ * cash_tof_read_zones - Gives back the latest multi-zone frame.
+ *
+ * \return Returns zero, -ENODEV if the ToF is not running, or -ENODATA
+ *	   if there is no frame, as it happens with single zone sensors.
+ */
+int cash_tof_read_zones(struct cash_tof_zones *zones)
+{
+	struct cash_tof_ctx *tof = cash_tof_get();
+	uint32_t seq;
 
-	cnt = snprintf(buf, 5, "%u", calib_params->tof_um_offset);
+	if (tof == NULL)
+		return -ENODEV;
 
-	rc = cash_set_parameter(um_offset_path, buf, (cnt * sizeof(char)));
-	if (rc < 0)
-		ALOGE("ERROR! Cannot set micrometer offset!");
-	free(um_offset_path);
+	do {
+		seq = cash_seqlock_read_begin(&tof->zones_lock);
+		*zones = tof->zones;
+	} while (cash_seqlock_read_retry(&tof->zones_lock, seq));
 
-	free(buf);
-	return 0;
+	if (zones->rows <= 0 || zones->cols <= 0)
+		return -ENODATA;
 
-calib_err_mem:
-	ALOGE("Memory exhausted. Cannot allocate.");
-calib_err:
-	ALOGE("Calibration is not mandatory. Going on anyway.");
-	free(buf);
 	return 0;
 }
 
-/* TODO: Use IOCTL EVIOCGNAME as a waaaay better way */
-static int cash_find_inputdev(int maxdevs, int idev_len, char* idev_name,
-				struct cash_tamisc_calib_params *calib_params)
+/*
+ * cash_tof_roi_cover - Gets how much of each zone along one axis the
+ *			region covers, as a Q10 fraction.
+ *
+ * \param start, len - Region along the axis, empty for all of it
+ */
+static void cash_tof_roi_cover(float start, float len, int nzones,
+			       int32_t *cover)
 {
-	int fd, plen, rlen, rc, i;
-	int plen_xtra = 3;
-	char buf[254];
-	char* path;
-
-	/*
-	 * Avoid checking more than 99 input devices,
-	 * because... really? :)
-	 */
-	if (maxdevs > 99)
-		return -1;
-
-	if (maxdevs > 9)
-		plen_xtra++;
+	float lo, hi;
+	int i;
 
-	plen = strlen(sysfs_input_str) + plen_xtra;
-	path = (char*) calloc(plen + LEN_NAME, sizeof(char));
-	if (path == NULL) {
-		ALOGE("Out of memory. Cannot allocate.");
-		rc = -1;
-		goto end;
+	if (!(len > 0)) {
+		start = 0;
+		len = 1;
 	}
 
-	for (i = 0; i <= maxdevs; i++) {
-		rc = snprintf(path, plen + LEN_NAME, "%s%d/name",
-							sysfs_input_str, i);
+	for (i = 0; i < nzones; i++) {
+		lo = (float)i / nzones;
+		hi = (float)(i + 1) / nzones;
+		if (start > lo)
+			lo = start;
+		if (start + len < hi)
+			hi = start + len;
 
-		if (fd > 0)
-			close(fd);
-
-		fd = open(path, (O_RDONLY | O_NONBLOCK));
-		if (fd < 0) {
-			ALOGD("Cannot open %s", path);
-			continue;
-		}
-
-		rlen = read(fd, buf, idev_len);
-		if (!rlen)
-			continue;
-
-		/*
-		 * If the string length doesn't match, avoid doing
-		 * expensive stuff, as the string cannot be the same.
-		 * Also consider some mistakes and compare it with
-		 * the name length - 1.
-		 * That will cover corner cases and will not evaluate
-		 * erroneously positive too many times...
-		 */
-		if (rlen < idev_len - 1)
-			continue;
-
-		rc = strncmp(buf, idev_name, idev_len - 1);
-		if (rc == 0) {
-			close(fd);
-
-			rc = cash_tof_sys_init(VL53L0_HIGH_ACCURACY, i,
-							plen, calib_params);
-			if (rc < 0)
-				goto end;
-
-			return i;
-		}
+		cover[i] = hi > lo ? (int32_t)lroundf((hi - lo) * nzones * 1024)
+				   : 0;
 	}
-end:
-	return rc;
 }
 
-/* TODO: Move me to background thread!! */
-int cash_input_tof_read(struct cash_vl53l0 *stmvl_cur,
-			uint16_t want_code)
+/*
+ * cash_tof_zones_reduce - Gets the range to focus at over a region of a
+ *			   multi-zone frame.
+ *
+ * Each zone weighs as much as the region covers of it. Zones within
+ * TOF_ZONES_CLUSTER_MM of the nearest valid one make a cluster, which
+ * is passed over if it weighs less than TOF_ZONES_CLUSTER_MIN_PCT of
+ * the region, so that a stray reflection can't pull the focus, and
+ * the next nearest one is tried. The range is the weighted mean of
+ * the cluster that was picked, or of the heaviest one found.
+ *
+ * The work per zone is done by plain loops over the arrays of the
+ * frame in fixed point, that the compiler vectorizes: an 8x8 frame
+ * costs about as much as a single zone.
+ *
+ * \param roi - Region, normalized to the field of view
+ * \param zones_used - Number of zones the range came out of
+ *
+ * \return Returns the range in mm, or -ENODATA if no zone is valid.
+ */
+int cash_tof_zones_reduce(const struct cash_tof_zones *zones,
+			  const struct cash_roi *roi, int *zones_used)
 {
-	struct input_event evt[64];
-	int retry = 0, i, len, rc;
-	bool rd, rr, rs;
-	uint16_t type, code;
-	int32_t value;
-
-	if (stmvl_fd < 0)
-		return -1;
-
-	stmvl_cur->range_status = 0;
-
-again:
-	rd = false;
-	rr = false;
-	rs = false;
-
-	do {
-		fsync(stmvl_fd);
-
-		rc = read(stmvl_fd, &evt, sizeof(evt));
-		if (!rc) {
-			return rc;
-		}
-
-		len = rc / sizeof(struct input_event);
-
-		for (i = 0; i < len; i++) {
-			type = evt[i].type;
-			code = evt[i].code;
-			value = evt[i].value;
-
-			if (type != EV_ABS)
-				continue;
-
-			switch (code)
-			{
-				case ABS_DISTANCE:
-					if (value < 900 && value >= 0) {
-						stmvl_cur->distance = value;
-						rd = true;
-					}
-					break;
-				case ABS_HAT1X:
-					if (value < 9000 && value > 0) {
-						stmvl_cur->range_mm = value;
-						rr = true;
-					}
-					break;
-				case ABS_HAT1Y:
-					stmvl_cur->range_status = value;
-					rs = true;
-					break;
-				default:
-					break;
-			}
-
-			if ((rr && rd && rs) || (want_code == code))
-				goto done;
+	int32_t w[TOF_ZONES_MAX] __attribute__((aligned(16)));
+	int32_t wx[TOF_ZONES_SIDE_MAX], wy[TOF_ZONES_SIDE_MAX];
+	const int32_t *range = zones->range_mm;
+	const int32_t *status = zones->status;
+	int32_t total = 0, past = 0, near, lim, v, cw, cwr, cnt;
+	int32_t best_w = 0, best_range = -ENODATA, best_cnt = 0;
+	int n = zones->rows * zones->cols;
+	int i, r, c, pass;
+
+	if (zones->rows <= 0 || zones->rows > TOF_ZONES_SIDE_MAX ||
+	    zones->cols <= 0 || zones->cols > TOF_ZONES_SIDE_MAX)
+		return -ENODATA;
+
+	cash_tof_roi_cover(roi->left, roi->width, zones->cols, wx);
+	cash_tof_roi_cover(roi->top, roi->height, zones->rows, wy);
+
+	for (r = 0; r < zones->rows; r++)
+		for (c = 0; c < zones->cols; c++)
+			w[r * zones->cols + c] = (wx[c] * wy[r] + 1023) >> 10;
+
+	/* Invalid zones weigh nothing */
+	for (i = 0; i < n; i++) {
+		v = status[i] == 0 && range[i] > 0 &&
+		    range[i] < TOF_ZONES_RANGE_MAX_MM;
+		w[i] = v ? w[i] : 0;
+		total += w[i];
+	}
+	if (total == 0)
+		return -ENODATA;
+
+	for (pass = 0; pass < TOF_ZONES_CLUSTER_PASSES; pass++) {
+		/* Nearest zone past the clusters passed over */
+		near = INT32_MAX;
+		for (i = 0; i < n; i++) {
+			v = w[i] > 0 && range[i] > past ? range[i] : INT32_MAX;
+			near = v < near ? v : near;
 		}
-	} while (!rd || !rr || !rs);
-
-done:
-	if (stmvl_cur->range_status != 0) {
-		if (retry < 4) {
-			retry++;
-			goto again;
-		} else {
-			return -1;
+		if (near == INT32_MAX)
+			break;
+
+		lim = near + TOF_ZONES_CLUSTER_MM;
+		cw = 0;
+		cwr = 0;
+		cnt = 0;
+		for (i = 0; i < n; i++) {
+			v = range[i] >= near && range[i] <= lim ? w[i] : 0;
+			cw += v;
+			cwr += v * range[i];
+			cnt += v > 0;
 		}
-	}
 
-	return 0;
-}
-
-int cash_input_tof_thr_read(struct cash_vl53l0 *stmvl_cur,
-			int tof_fd)
-{
-	struct input_event evt[16];
-	int i, len, rc;
-	bool rd, rr, rs;
-	uint16_t type, code;
-	int32_t value;
-
-	stmvl_cur->range_status = 0;
+		if (cw > best_w) {
+			best_w = cw;
+			best_range = cwr / cw;
+			best_cnt = cnt;
+		}
 
-	rd = false;
-	rr = false;
-	rs = false;
+		if (cw * 100 >= total * TOF_ZONES_CLUSTER_MIN_PCT)
+			break;
 
-	rc = read(tof_fd, &evt, sizeof(evt));
-	if (!rc) {
-		return rc;
+		past = lim;
 	}
 
-	len = rc / sizeof(struct input_event);
-
-	for (i = 0; i < len; i++) {
-		type = evt[i].type;
-		code = evt[i].code;
-		value = evt[i].value;
-
-		if (type != EV_ABS)
-			continue;
-
-		switch (code) {
-			case ABS_DISTANCE:
-				if (value < 900 && value >= 0) {
-					stmvl_cur->distance = value;
-					rd = true;
-				}
-				break;
-			case ABS_HAT1X:
-				if (value < 9000 && value > 0) {
-					stmvl_cur->range_mm = value;
-					rr = true;
-				}
-				break;
-			case ABS_HAT1Y:
-				stmvl_cur->range_status = value;
-				rs = true;
-				break;
-			default:
-				break;
-		}
-	}
+	*zones_used = best_cnt;
 
-	return 0;
+	return best_range;
 }
 
 static inline bool cash_tof_is_val_ok(int d1, int d2, int hysteresis)
@@ -432,244 +429,489 @@ static inline bool cash_tof_is_val_ok(int d1, int d2, int hysteresis)
 
 int cash_tof_read_inst(struct cash_vl53l0 *stmvl_final)
 {
-	/* Thread not running, we'd read nothing good here! */
-	if (!cash_thread_run[THREAD_TOF])
-		return -1;
+	struct cash_tof_ctx *tof = cash_tof_get();
+	struct cash_vl53l0 stmvl;
 
-	/* Sensor is disabled, what are we trying to read?! */
-	if (!tof_enabled)
+	if (tof == NULL)
 		return -1;
 
+	cash_tof_status_get(tof, &stmvl);
+
 	/* No reading available */
-	if (stmvl_status.range_mm < 0 || stmvl_status.distance < 0) {
+	if (stmvl.range_mm < 0 || stmvl.distance < 0) {
 		ALOGE("ToF: No reading! %dmm dist%d",
-			stmvl_status.range_mm, stmvl_status.distance);
+			stmvl.range_mm, stmvl.distance);
 		return -1;
 	}
 
-	stmvl_final->distance = stmvl_status.distance;
-	stmvl_final->range_mm = stmvl_status.range_mm;
+	*stmvl_final = stmvl;
 
 	/* Return a fake score of 1 */
 	return 1;
 }
 
+static void cash_tof_ring_push(struct cash_tof_ctx *tof,
+			       struct cash_vl53l0 *stmvl)
+{
+	int32_t val[3];
+
+	val[0] = stmvl->range_mm;
+	val[1] = stmvl->distance;
+	val[2] = stmvl->range_status;
+
+	cash_ring_push(&tof->ring, stmvl->timestamp_ns, val, 3);
+}
+
 /*
- * cash_tof_thr_read_stabilized - Reads the ToF parameters and tries to
- *			       give back a value only if it is stable.
+ * cash_tof_sample_at - Gives back the ToF reading taken at a given time
  *
- * \param stmvl_final - Final structure with ToF values
- * \param runs - Maximum number of times to read the ToF
- * \param nmatch - Number of times to match readings
- * \param sleep_ms - Delay between each read
- * \param hyst - Hysteresis, relative to the distance measurements
+ * \param timestamp_ns - CLOCK_MONOTONIC time of the wanted reading
+ * \param interpolate - Interpolate the readings around that time,
+ *			instead of taking the nearest one
  *
- * \return Returns reliability of the measurement or -INT_MAX for error;
+ * \return Returns zero or negative errno.
  */
-int cash_tof_thr_read_stabilized(
-	struct cash_vl53l0 *stmvl_final,
-	int runs, int nmatch, int sleep_ms, int hyst)
+int cash_tof_sample_at(int64_t timestamp_ns, bool interpolate,
+		       struct cash_vl53l0 *stmvl_final)
 {
-	int retry = 0, cur_dst, range, score, i;
+	struct cash_tof_ctx *tof = cash_tof_get();
+	struct cash_sample sample;
+	int rc;
 
-	/* Thread not running, we'd read nothing good here! */
-	if (!cash_thread_run[THREAD_TOF])
-		return -1;
+	if (tof == NULL)
+		return -ENODEV;
 
-	/* Sensor is disabled, what are we trying to read?! */
-	if (!tof_enabled)
-		return -1;
+	rc = cash_ring_get_at(&tof->ring, timestamp_ns,
+			      interpolate, &sample);
+	if (rc < 0)
+		return rc;
 
-	/* Did we get called by someone who didn't read the docs? */
-	if (runs < nmatch)
-		runs = nmatch + 1;
+	stmvl_final->range_mm = sample.val[0];
+	stmvl_final->distance = sample.val[1];
+	stmvl_final->range_status = sample.val[2];
+	stmvl_final->timestamp_ns = sample.timestamp_ns;
+
+	return 0;
+}
+
+/*
+ * cash_tof_predict - Estimates the range at a given time, out of a
+ *		      least squares line fit of the recent samples.
+ *
+ * Only samples taken within TOF_PREDICT_WINDOW_NS of the newest one
+ * are used, so that the speed follows the subject quickly, and the
+ * range is never extrapolated more than TOF_PREDICT_MAX_AHEAD_NS
+ * past the newest sample, nor before the oldest sample of the fit.
+ *
+ * \param timestamp_ns - CLOCK_MONOTONIC time to predict the range at
+ * \param stmvl_final - Newest reading, with the predicted range and
+ *			the time it was predicted at
+ * \param speed_mm_s - Radial speed, positive when moving away
+ *
+ * \return Returns zero or negative errno.
+ */
+int cash_tof_predict(int64_t timestamp_ns, struct cash_vl53l0 *stmvl_final,
+		     int32_t *speed_mm_s)
+{
+	struct cash_tof_ctx *tof = cash_tof_get();
+	struct cash_sample samples[TOF_PREDICT_MAX_SAMPLES], *last;
+	double t, st = 0, sr = 0, stt = 0, str = 0, den, a, b = 0;
+	int64_t ahead_ns;
+	int n, i, first;
+
+	if (tof == NULL)
+		return -ENODEV;
+
+	n = cash_ring_get_recent(&tof->ring, samples,
+				 TOF_PREDICT_MAX_SAMPLES);
+	if (n < 0)
+		return n;
+	if (n == 0)
+		return -ENODATA;
+
+	last = &samples[n - 1];
+	for (first = 0; first < n - 1; first++)
+		if (last->timestamp_ns - samples[first].timestamp_ns <=
+		    TOF_PREDICT_WINDOW_NS)
+			break;
+
+	/* Seconds relative to the newest sample keep the sums small */
+	for (i = first; i < n; i++) {
+		t = (samples[i].timestamp_ns - last->timestamp_ns) /
+		    1000000000.0;
+		st += t;
+		sr += samples[i].val[0];
+		stt += t * t;
+		str += t * samples[i].val[0];
+	}
+	n -= first;
+
+	den = n * stt - st * st;
+	if (n > 1 && den > 0)
+		b = (n * str - st * sr) / den;
+	a = (sr - b * st) / n;
+
+	ahead_ns = timestamp_ns - last->timestamp_ns;
+	if (ahead_ns > TOF_PREDICT_MAX_AHEAD_NS)
+		ahead_ns = TOF_PREDICT_MAX_AHEAD_NS;
+	else if (ahead_ns < samples[first].timestamp_ns - last->timestamp_ns)
+		ahead_ns = samples[first].timestamp_ns - last->timestamp_ns;
+
+	stmvl_final->range_mm = (int)lround(a + b * ahead_ns / 1000000000.0);
+	if (stmvl_final->range_mm < 0)
+		stmvl_final->range_mm = 0;
+	stmvl_final->distance = last->val[1];
+	stmvl_final->range_status = last->val[2];
+	stmvl_final->timestamp_ns = last->timestamp_ns + ahead_ns;
+	*speed_mm_s = (int32_t)lround(b);
 
-again:
-	score = 0;
-	cur_dst = stmvl_status.distance;
-	range = stmvl_status.range_mm;
+	return 0;
+}
 
-	for (i = 0; i < runs; i++) {
-		usleep(sleep_ms*1000);
+/*
+ * cash_tof_stability_update - Pushes a new sample in the stability
+ *			       window and scores it against the
+ *			       previous ones.
+ *
+ * Each past sample within the hysteresis of the new one adds one
+ * point, each one outside takes one away. A sample with a non
+ * negative score becomes the stable one; if the readings keep being
+ * unstable for as long as five full windows, just like the old five
+ * tries of the sleeping reader, the newest sample is taken anyway.
+ *
+ * \param stmvl - Newest sample
+ * \param stable - Stable sample, updated only when one is found
+ *
+ * \return Returns the score of the newest sample.
+ */
+static int cash_tof_stability_update(struct cash_tof_ctx *tof,
+				     struct cash_vl53l0 *stmvl,
+				     struct cash_vl53l0 *stable)
+{
+	int len = tof->runs + 1;
+	int score = 0, i, idx;
 
-		if (cash_tof_is_val_ok(range, stmvl_status.range_mm, hyst))
+	for (i = 0; i < tof->win_count; i++) {
+		idx = (tof->win_head + len - 1 - i) % len;
+		if (cash_tof_is_val_ok(tof->window[idx].range_mm,
+				       stmvl->range_mm, tof->hyst))
 			score++;
 		else
 			score--;
 	}
 
-	/* Readings are very unstable! */
-	if (score < 0 && retry < 4) {
-		retry++;
-		goto again;
-	}
+	tof->window[tof->win_head] = *stmvl;
+	tof->win_head = (tof->win_head + 1) % len;
+	if (tof->win_count < tof->runs)
+		tof->win_count++;
 
-	stmvl_final->distance = cur_dst;
-	stmvl_final->range_mm = range;
+	if (score >= 0 || ++tof->unstable_cnt > 5 * tof->runs) {
+		*stable = *stmvl;
+		tof->unstable_cnt = 0;
+	}
 
 	return score;
 }
 
 /*
- * cash_tof_read_stabilized - Reads the ToF parameters and tries to
- *			       give back a value only if it is stable.
- *
- * \param stmvl_final - Final structure with ToF values
- * \param runs - Maximum number of times to read the ToF
- * \param nmatch - Number of times to match readings
- * \param sleep_ms - Delay between each read
- * \param hyst - Hysteresis, relative to the distance measurements
+ * cash_tof_read_filtered - Gives back the newest ToF reading, with the
+ *			    range passed through the configured filter.
  *
- * \return Returns reliability of the measurement or -INT_MAX for error;
+ * \return Returns 1 or -1 for error.
  */
-int cash_tof_read_stabilized(
-	struct cash_vl53l0 *stmvl_final,
-	int runs, int nmatch, int sleep_ms, int hyst)
+int cash_tof_read_filtered(struct cash_vl53l0 *stmvl_final)
 {
-	struct cash_vl53l0 stmvl_cur;
-	int rc, retry = 0, cur_dst, range, score = 0, i;
-
-	/* Did we get called by someone who didn't read the docs? */
-	if (runs < nmatch)
-		runs = nmatch + 1;
+	struct cash_tof_ctx *tof = cash_tof_get();
+	struct cash_vl53l0 stmvl;
 
-again:
-	rc = cash_input_tof_read(&stmvl_cur, ABS_HAT1X);
-	if (rc < 0) {
-		ALOGE("ToF read failed");
-		//return -INT_MAX;
-	}
+	if (tof == NULL)
+		return -1;
 
-	cur_dst = stmvl_cur.distance;
-	range = stmvl_cur.range_mm;
+	cash_tof_filtered_get(tof, &stmvl);
 
-	/* First run done before looping! */
-	for (i = 0; i < runs; i++) {
-		usleep(sleep_ms*1000);
-		rc = cash_input_tof_read(&stmvl_cur, ABS_HAT1X);
-		if (rc < 0)
-			continue;
-		if (cash_tof_is_val_ok(cur_dst, stmvl_cur.distance, hyst))
-			score++;
-		else
-			score--;
-	}
-
-	/* Readings are very unstable! */
-	if (score < 0 && retry < 4) {
-		retry++;
-		goto again;
-	}
+	/* No reading available */
+	if (stmvl.range_mm < 0 || stmvl.distance < 0)
+		return -1;
 
-	stmvl_final->distance = cur_dst;
-	stmvl_final->range_mm = range;
+	*stmvl_final = stmvl;
 
-	return score;
+	return 1;
 }
 
-static void cash_input_tof_thread(void)
+/*
+ * cash_tof_thr_read_stabilized - Gives back the last ToF reading that
+ *				  was found to be stable by the ToF thread.
+ *
+ * \param stmvl_final - Final structure with ToF values
+ *
+ * \return Returns reliability of the measurement or -INT_MAX for error;
+ */
+int cash_tof_thr_read_stabilized(struct cash_vl53l0 *stmvl_final)
 {
-	int ret;
-	int i;
-	struct epoll_event pevt[10];
-
-	cash_tof_enable(true);
+	struct cash_tof_ctx *tof = cash_tof_get();
+	struct cash_vl53l0 stmvl;
+	int score;
 
-	ALOGD("ToF Thread started");
+	if (tof == NULL)
+		return -INT_MAX;
 
-	while (cash_thread_run[THREAD_TOF]) {
-		ret = epoll_wait(cash_pollfd[FD_TOF], pevt,
-					10, cash_pfdelay_ms[FD_TOF]);
-		for (i = 0; i < ret; i++) {
-			if (pevt[i].events & EPOLLERR ||
-			    pevt[i].events & EPOLLHUP ||
-			    !(pevt[i].events & EPOLLIN))
-				continue;
+	score = cash_tof_stable_get(tof, &stmvl);
 
-			if (cash_pollevt[FD_TOF].data.fd)
-				cash_input_tof_thr_read(&stmvl_status,
-					cash_pollevt[FD_TOF].data.fd);
-		}
-	}
+	/* No reading available */
+	if (stmvl.range_mm < 0 || stmvl.distance < 0)
+		return -INT_MAX;
 
-	cash_tof_enable(false);
+	*stmvl_final = stmvl;
 
-	pthread_exit((void*)((int)0));
+	return score;
 }
 
-struct thread_data cash_tof_thread_data = {
-	.thread_no = THREAD_TOF,
-	.thread_func = cash_input_tof_thread
-};
+static double cash_tof_filter_median(struct cash_tof_ctx *tof,
+				     int32_t range_mm)
+{
+	struct cash_tof_filter_state *fs = &tof->fstate;
+	int32_t sorted[TOF_FILTER_MEDIAN_MAX_LEN], val;
+	int i, j;
+
+	fs->median_win[fs->median_head] = range_mm;
+	fs->median_head = (fs->median_head + 1) % tof->filter.median_len;
+	if (fs->median_count < tof->filter.median_len)
+		fs->median_count++;
+
+	/* Few enough samples for insertion sort to be the fastest */
+	for (i = 0; i < fs->median_count; i++) {
+		val = fs->median_win[i];
+		for (j = i; j > 0 && sorted[j - 1] > val; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = val;
+	}
 
-int cash_input_tof_start(bool start)
+	return sorted[(fs->median_count - 1) / 2];
+}
+
+static double cash_tof_filter_kalman(struct cash_tof_ctx *tof,
+				     int32_t range_mm, double dt)
 {
-	return cash_input_threadman(start, &cash_tof_thread_data);
+	struct cash_tof_filter_state *fs = &tof->fstate;
+	double q = tof->filter.kalman_q, r = tof->filter.kalman_r;
+	double p00, p01, p10, p11, s, k0, k1, y;
+
+	/* Predict: constant speed, white noise acceleration */
+	fs->kf_x += fs->kf_v * dt;
+	p00 = fs->kf_p[0][0] + dt * (fs->kf_p[0][1] + fs->kf_p[1][0]) +
+	      dt * dt * fs->kf_p[1][1] + q * dt * dt * dt / 3;
+	p01 = fs->kf_p[0][1] + dt * fs->kf_p[1][1] + q * dt * dt / 2;
+	p10 = fs->kf_p[1][0] + dt * fs->kf_p[1][1] + q * dt * dt / 2;
+	p11 = fs->kf_p[1][1] + q * dt;
+
+	/* Update with the measured range */
+	y = range_mm - fs->kf_x;
+	s = p00 + r;
+	k0 = p00 / s;
+	k1 = p10 / s;
+
+	fs->kf_x += k0 * y;
+	fs->kf_v += k1 * y;
+	fs->kf_p[0][0] = (1 - k0) * p00;
+	fs->kf_p[0][1] = (1 - k0) * p01;
+	fs->kf_p[1][0] = p10 - k1 * p00;
+	fs->kf_p[1][1] = p11 - k1 * p01;
+
+	return fs->kf_x;
 }
 
-bool cash_input_is_tof_alive(void)
+/*
+ * cash_tof_filter_update - Runs the configured range filter on the
+ *			    newest sample.
+ *
+ * The filter starts over from the sample itself when the sensor is
+ * enabled and after a gap of more than TOF_FILTER_MAX_GAP_NS, since
+ * whatever it knew about the scene may not hold anymore.
+ *
+ * \param stmvl - Newest sample
+ * \param filtered - Newest sample, with the range filtered
+ */
+static void cash_tof_filter_update(struct cash_tof_ctx *tof,
+				   struct cash_vl53l0 *stmvl,
+				   struct cash_vl53l0 *filtered)
 {
-	return cash_thread_run[THREAD_TOF];
+	struct cash_tof_filter_state *fs = &tof->fstate;
+	int64_t dt_ns = stmvl->timestamp_ns - fs->last_ts;
+	double val = stmvl->range_mm;
+
+	*filtered = *stmvl;
+
+	if (tof->filter.type == TOF_FILTER_NONE)
+		return;
+
+	if (!fs->primed || dt_ns <= 0 || dt_ns > TOF_FILTER_MAX_GAP_NS) {
+		fs->primed = true;
+		fs->ema = val;
+		fs->median_head = 0;
+		fs->median_count = 0;
+		fs->kf_x = val;
+		fs->kf_v = 0;
+		fs->kf_p[0][0] = tof->filter.kalman_r;
+		fs->kf_p[0][1] = 0;
+		fs->kf_p[1][0] = 0;
+		fs->kf_p[1][1] = TOF_FILTER_KALMAN_SPEED_VAR;
+		dt_ns = 0;
+	}
+	fs->last_ts = stmvl->timestamp_ns;
+
+	switch (tof->filter.type) {
+	case TOF_FILTER_EMA:
+		fs->ema += tof->filter.ema_alpha * (val - fs->ema);
+		val = fs->ema;
+		break;
+	case TOF_FILTER_MEDIAN:
+		val = cash_tof_filter_median(tof, stmvl->range_mm);
+		break;
+	case TOF_FILTER_KALMAN:
+		if (dt_ns > 0)
+			val = cash_tof_filter_kalman(tof, stmvl->range_mm,
+						     dt_ns / 1000000000.0);
+		break;
+	default:
+		break;
+	}
+
+	filtered->range_mm = (int)lround(val);
 }
 
-int cash_input_tof_init(struct cash_tamisc_calib_params *calib_params)
+static int cash_tof_init(struct cash_sensor *sns)
 {
-	int dlen, evtno, rc;
-	char *devname, *devpath;
+	struct cash_tof_ctx *tof = sns->ctx;
 
-	dlen = strlen(VL53L0_STR);
-	devname = (char*) calloc(dlen, sizeof(char));
-	snprintf(devname, dlen, "%s", VL53L0_STR);
+	tof->runs = TOF_STABILIZATION_DEF_RUNS;
+	tof->hyst = TOF_STABILIZATION_HYST_MM;
+	tof->filter.type = TOF_FILTER_NONE;
+	tof->filter.median_len = 1;
 
-	evtno = cash_find_inputdev(ITERATE_MAX_DEVS, dlen,
-					devname, calib_params);
-	if (evtno < 0)
-		return -1;
+	/* Nothing to read until it gets enabled */
+	tof->next.distance = -1;
+	tof->next.range_mm = -1;
+	tof->next.range_status = -1;
+	cash_tof_status_publish(tof, &tof->next, &tof->next, 0, &tof->next);
 
-	dlen = strlen(devfs_input_str) + 3;
-	if (evtno > 9)
-		dlen++;
+	return 0;
+}
 
-	devpath = (char*) calloc(dlen, sizeof(char));
-	if (devpath == NULL)
-		return -1;
+static int cash_tof_power(struct cash_sensor *sns, bool enable)
+{
+	struct cash_tof_ctx *tof = sns->ctx;
+	int rc;
 
-	snprintf(devpath, dlen, "%s%d", devfs_input_str, evtno);
+	if (enable)
+		cash_tof_params_update(tof);
 
+	/* Reset the readings to start fresh */
+	tof->next.distance = -1;
+	tof->next.range_mm = -1;
+	tof->next.range_status = -1;
+	tof->next.timestamp_ns = 0;
+	tof->win_head = 0;
+	tof->win_count = 0;
+	tof->unstable_cnt = 0;
+	tof->fstate.primed = false;
+	cash_tof_status_publish(tof, &tof->next, &tof->next, 0, &tof->next);
+	atomic_store(&tof->ready, false);
+
+	cash_seqlock_write_begin(&tof->zones_lock);
+	tof->zones.rows = 0;
+	tof->zones.cols = 0;
+	cash_seqlock_write_end(&tof->zones_lock);
 
-	stmvl_fd = open(devpath, (O_RDONLY | O_NONBLOCK));
-	if (stmvl_fd < 0) {
-		ALOGE("Error: cannot open the %s input device at %s.",
-			devname, devpath);
-		return -1;
-	}
+	/*
+	 * Don't wait for the sensor to come up: the ToF thread tells
+	 * when it is ready, as soon as the first range comes in.
+	 * A device that is away gets powered up when it comes back.
+	 */
+	sns->enabled = enable;
+	rc = sns->evtno >= 0 ? sns->ops->enable(sns, enable) : 0;
 
-	cash_pollfd[FD_TOF] = epoll_create1(0);
-	if (cash_pollfd[FD_TOF] == -1) {
-		ALOGE("Error: Cannot create epoll descriptor");
-		return -1;
+	if (enable)
+		tof->stable_next = tof->next;
+
+	return rc;
+}
+
+/*
+ * cash_tof_process - Reads the pending ToF events and publishes the
+ *		      new sample, if they completed one.
+ *		      Runs in the ToF thread or, in the single threaded
+ *		      mode, in the server event loop.
+ */
+static void cash_tof_process(struct cash_sensor *sns)
+{
+	struct cash_tof_ctx *tof = sns->ctx;
+	int score;
+
+	cash_tof_params_update(tof);
+
+	if (sns->fd < 0 || sns->ops->decode(sns, &tof->next) <= 0)
+		return;
+
+	score = cash_tof_stability_update(tof, &tof->next, &tof->stable_next);
+	cash_tof_filter_update(tof, &tof->next, &tof->filtered_next);
+	cash_tof_status_publish(tof, &tof->next, &tof->stable_next, score,
+				&tof->filtered_next);
+	cash_tof_ring_push(tof, &tof->next);
+	if (!atomic_load(&tof->ready)) {
+		atomic_store(&tof->ready, true);
+		cash_input_notify_ready(CASH_SENSOR_TOF);
+	} else {
+		cash_input_notify(CASH_SENSOR_TOF);
 	}
+}
 
-	cash_pfds[FD_TOF].fd = stmvl_fd;
-	cash_pfds[FD_TOF].events = POLLIN;
-	cash_pfdelay_ms[FD_TOF] = 1000;
+/* Backends of the ranging sensors, tried in order */
+static const struct cash_sensor_ops *const cash_tof_backends[] = {
+	&cash_vl53l0_ops,
+	&cash_vl53l5_ops,
+	NULL
+};
 
-	cash_pollevt[FD_TOF].events = POLLIN; // | EPOLLET;
-	cash_pollevt[FD_TOF].data.fd = stmvl_fd;
+static const struct cash_sensor_class cash_tof_class = {
+	.type = CASH_SENSOR_TOF,
+	.backends = cash_tof_backends,
+	.ctx_size = sizeof(struct cash_tof_ctx),
+	.init = cash_tof_init,
+	.power = cash_tof_power,
+	.process = cash_tof_process,
+};
 
-	rc = epoll_ctl(cash_pollfd[FD_TOF], EPOLL_CTL_ADD,
-					stmvl_fd, &cash_pollevt[FD_TOF]);
-	if (rc) {
-		ALOGE("Cannot add epoll control");
-		return -1;
-	}
+int cash_input_tof_start(bool start)
+{
+	return cash_sensor_start_type(CASH_SENSOR_TOF, start);
+}
+
+bool cash_input_is_tof_alive(void)
+{
+	struct cash_sensor *sns = cash_sensor_get(CASH_SENSOR_TOF);
+
+	return sns != NULL && sns->run;
+}
 
-	cash_thread_run[THREAD_TOF] = false;
 /*
-	rc = cash_input_threadman(true, THREAD_TOF);
-	if (rc < 0)
-		return rc;
-*/
-	return 0;
+ * cash_input_is_tof_ready - Tells whether the ToF got enabled and gave
+ *			     its first range out.
+ */
+bool cash_input_is_tof_ready(void)
+{
+	struct cash_tof_ctx *tof = cash_tof_get();
+
+	return tof != NULL && atomic_load(&tof->ready);
 }
 
+/*
+ * cash_input_tof_init - Gets the ToF sensors attached, either now or
+ *			 as soon as they show up.
+ *
+ * \return Returns zero, -ENODEV if no sensor is there (yet), or
+ *	   negative errno.
+ */
+int cash_input_tof_init(struct cash_tamisc_calib_params *calib_params)
+{
+	return cash_input_discover(&cash_tof_class, calib_params);
+}
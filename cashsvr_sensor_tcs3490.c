@@ -0,0 +1,272 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * AMS TCS3490 RGBC-IR sensor backend
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG			"CASH_TCS3490"
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+#include <log/log.h>
+
+#include "cash_private.h"
+#include "cash_input_common.h"
+#include "cash_input_rgbc.h"
+
+#define TCS3490_STR		"AMS TCS3490 Sensor"
+#define TCS3490_ALS_ITIME	"127"
+#define TCS3490_ALS_GAIN_LOW	"1"
+/* What the strings above stand for */
+#define TCS3490_ALS_ITIME_US	127000
+#define TCS3490_ALS_AGAIN_LOW	1
+
+/* Analog gains the sensor has, the way als_gain takes them */
+static const int tcs3490_again[] = { 1, 4, 8 };
+#define TCS3490_AGAIN_NUM	(sizeof(tcs3490_again) / sizeof(tcs3490_again[0]))
+
+/*
+ * Attributes of the input device: it may come and go, so they may move.
+ * One lock for all the instances is plenty, they are seldom written.
+ */
+static pthread_mutex_t tcs3490_sys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct tcs3490_priv {
+	char chip_power_path[PATH_MAX];
+	char power_state_path[PATH_MAX];
+	char gain_path[PATH_MAX];
+	char Itime_path[PATH_MAX];
+	/* Settings the counts get taken with */
+	int again;
+	int itime_us;
+};
+
+/*
+ * tcs3490_probe - Finds the attributes of the input device and makes
+ *		   them accessible.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int tcs3490_probe(struct cash_sensor *sns,
+			 const struct cash_input_dev *dev)
+{
+	struct tcs3490_priv *tcs = sns->priv;
+	int rc;
+
+	pthread_mutex_lock(&tcs3490_sys_lock);
+	snprintf(tcs->chip_power_path, sizeof(tcs->chip_power_path),
+		"%s/chip_pow", dev->sysfs);
+	snprintf(tcs->power_state_path, sizeof(tcs->power_state_path),
+		"%s/als_power_state", dev->sysfs);
+	snprintf(tcs->Itime_path, sizeof(tcs->Itime_path),
+		"%s/als_Itime", dev->sysfs);
+	snprintf(tcs->gain_path, sizeof(tcs->gain_path),
+		"%s/als_gain", dev->sysfs);
+
+	// call chown on the paths to allow access after context switch
+	rc = cash_set_permissions(tcs->chip_power_path, "system", "input");
+	rc += cash_set_permissions(tcs->power_state_path, "system", "input");
+	rc += cash_set_permissions(tcs->Itime_path, "system", "input");
+	rc += cash_set_permissions(tcs->gain_path, "system", "input");
+	pthread_mutex_unlock(&tcs3490_sys_lock);
+	if (rc < 0)
+		return -EACCES;
+
+	return 0;
+}
+
+/*
+ * tcs3490_enable - Powers the sensor up or down.
+ *
+ * \return Returns zero or -EIO.
+ */
+static int tcs3490_enable(struct cash_sensor *sns, bool enable)
+{
+	struct tcs3490_priv *tcs = sns->priv;
+	int rc;
+
+	pthread_mutex_lock(&tcs3490_sys_lock);
+
+	/* enabling/disabling requires writing to sysfs twice
+	 * chip_power to power up/down the chip
+	 * als_power_state to start/stop the work
+	 */
+	if (enable) {
+		rc = cash_set_parameter(tcs->chip_power_path, "1", 1);
+		if (!rc)
+			rc = cash_set_parameter(tcs->power_state_path, "1", 1);
+		// set default gain and Itime if sensor was just enabled
+		if (!rc)
+			rc = cash_set_parameter(tcs->gain_path, TCS3490_ALS_GAIN_LOW, 1);
+		if (!rc)
+			rc = cash_set_parameter(tcs->Itime_path, TCS3490_ALS_ITIME, 3);
+	} else {
+		rc = cash_set_parameter(tcs->power_state_path, "0", 1);
+		if (!rc)
+			rc = cash_set_parameter(tcs->chip_power_path, "0", 1);
+	}
+
+	if (!rc && enable) {
+		tcs->again = TCS3490_ALS_AGAIN_LOW;
+		tcs->itime_us = TCS3490_ALS_ITIME_US;
+	}
+
+	pthread_mutex_unlock(&tcs3490_sys_lock);
+
+	if (rc) {
+		ALOGW("ERROR! Cannot %sable RGBC!", enable ? "en" : "dis");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * tcs3490_set_integration - Sets the analog gain and integration time
+ *			     the next counts get taken with. The gain is
+ *			     rounded down to one the sensor has and the
+ *			     integration time up to a millisecond.
+ *
+ * \return Returns zero or -EIO.
+ */
+static int tcs3490_set_integration(struct cash_sensor *sns, int again,
+				   int itime_us)
+{
+	struct tcs3490_priv *tcs = sns->priv;
+	char buf[12];
+	int i, cnt, itime_ms, rc;
+
+	for (i = TCS3490_AGAIN_NUM - 1; i > 0; i--)
+		if (tcs3490_again[i] <= again)
+			break;
+
+	itime_ms = (itime_us + 999) / 1000;
+	if (itime_ms < 1)
+		itime_ms = 1;
+
+	pthread_mutex_lock(&tcs3490_sys_lock);
+	cnt = snprintf(buf, sizeof(buf), "%d", tcs3490_again[i]);
+	rc = cash_set_parameter(tcs->gain_path, buf, cnt);
+	if (!rc)
+		tcs->again = tcs3490_again[i];
+
+	cnt = snprintf(buf, sizeof(buf), "%d", itime_ms);
+	if (!rc)
+		rc = cash_set_parameter(tcs->Itime_path, buf, cnt);
+	if (!rc)
+		tcs->itime_us = itime_ms * 1000;
+	pthread_mutex_unlock(&tcs3490_sys_lock);
+
+	if (rc) {
+		ALOGW("ERROR! Cannot set RGBC gain %d and Itime %dms",
+			tcs3490_again[i], itime_ms);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * tcs3490_decode - Reads the pending events into a struct cash_tcs3490.
+ *
+ * \return Returns 1 when a new clear value came in, zero otherwise.
+ */
+static int tcs3490_decode(struct cash_sensor *sns, void *sample)
+{
+	struct tcs3490_priv *tcs = sns->priv;
+	struct cash_tcs3490 *tcsvl_cur = sample;
+	struct input_event evt[16];
+	int i, len, rc;
+	bool rc_clear = false;
+	uint16_t code;
+	int32_t value;
+
+	rc = read(sns->fd, &evt, sizeof(evt));
+	if (rc <= 0)
+		return 0;
+
+	len = rc / sizeof(struct input_event);
+
+	for (i = 0; i < len; i++) {
+		code = evt[i].code;
+		value = evt[i].value;
+
+		switch (code) {
+			case ABS_MISC:
+				if (value >= 0) {
+					tcsvl_cur->clear = value;
+					tcsvl_cur->again = tcs->again;
+					tcsvl_cur->itime_us = tcs->itime_us;
+					tcsvl_cur->timestamp_ns =
+						CASH_EVT_TIME_NS(evt[i]);
+					rc_clear = true;
+				}
+				break;
+			case ABS_HAT0X:
+				if (value >= 0) {
+					tcsvl_cur->red = value;
+				}
+				break;
+			case ABS_HAT0Y:
+				if (value >= 0) {
+					tcsvl_cur->green = value;
+				}
+				break;
+			case ABS_HAT1X:
+				if (value >= 0) {
+					tcsvl_cur->blue = value;
+				}
+				break;
+			case ABS_HAT1Y:
+				if (value >= 0) {
+					tcsvl_cur->ir = value;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	ALOGV("RGBC VALUES R:%d G:%d B:%d C:%d IR:%d", tcsvl_cur->red, tcsvl_cur->green, tcsvl_cur->blue, tcsvl_cur->clear, tcsvl_cur->ir);
+
+	/* Tell whether a new clear sample came in */
+	return rc_clear ? 1 : 0;
+}
+
+/* Input devices this backend can drive */
+static const struct cash_input_id tcs3490_ids[] = {
+	{ .name = TCS3490_STR },
+	{ }
+};
+
+const struct cash_sensor_ops cash_tcs3490_ops = {
+	.name = "TCS3490",
+	.type = CASH_SENSOR_RGBC,
+	.ids = tcs3490_ids,
+	.priv_size = sizeof(struct tcs3490_priv),
+	.probe = tcs3490_probe,
+	.enable = tcs3490_enable,
+	.set_integration = tcs3490_set_integration,
+	.decode = tcs3490_decode,
+};
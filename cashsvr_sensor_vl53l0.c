@@ -0,0 +1,255 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * STMicroelectronics VL53L0 ranging sensor backend
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG			"CASH_VL53L0"
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+#include <log/log.h>
+
+#include "cash_private.h"
+#include "cash_input_common.h"
+#include "cash_input_tof.h"
+
+#define VL53L0_STR		"STM VL53L0 proximity sensor"
+#define VL53L0_HIGH_RANGE	"1"
+#define VL53L0_HIGH_ACCURACY	"2"
+
+/*
+ * Attributes of the input device: it may come and go, so they may move.
+ * One lock for all the instances is plenty, they are seldom written.
+ */
+static pthread_mutex_t vl53l0_sys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct vl53l0_priv {
+	char sysfs[PATH_MAX];
+	char enable_path[PATH_MAX];
+};
+
+/*
+ * vl53l0_probe - Sets the sensor up through the attributes of its
+ *		  input device.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int vl53l0_probe(struct cash_sensor *sns,
+			const struct cash_input_dev *dev)
+{
+	struct vl53l0_priv *vl = sns->priv;
+	char path[PATH_MAX];
+	int rc;
+
+	pthread_mutex_lock(&vl53l0_sys_lock);
+	snprintf(vl->sysfs, sizeof(vl->sysfs), "%s", dev->sysfs);
+	snprintf(vl->enable_path, sizeof(vl->enable_path),
+		 "%s/enable_ps_sensor", vl->sysfs);
+
+	rc = cash_set_permissions(vl->enable_path, "system", "input");
+	if (rc == -1)
+		goto err;
+
+	snprintf(path, sizeof(path), "%s/set_use_case", vl->sysfs);
+
+	rc = cash_set_permissions(path, "system", "input");
+	if (rc == -1)
+		goto err;
+
+	rc = cash_set_parameter(path, VL53L0_HIGH_ACCURACY,
+				sizeof(VL53L0_HIGH_ACCURACY) - 1);
+	if (rc < 0)
+		ALOGW("ERROR! Cannot set ToF High Accuracy mode!");
+
+	pthread_mutex_unlock(&vl53l0_sys_lock);
+	return 0;
+err:
+	vl->enable_path[0] = '\0';
+	pthread_mutex_unlock(&vl53l0_sys_lock);
+	return -EACCES;
+}
+
+/*
+ * vl53l0_calibrate - Applies the reference SPADs and the offset found
+ *		      in MiscTA, if any.
+ *
+ * \return Returns zero: the calibration is not mandatory.
+ */
+static int vl53l0_calibrate(struct cash_sensor *sns,
+			    const struct cash_tamisc_calib_params *calib)
+{
+	struct vl53l0_priv *vl = sns->priv;
+	char path[PATH_MAX];
+	char buf[12];
+	int rc, cnt;
+
+	if (calib == NULL) {
+		ALOGE("Calibration is not mandatory. Going on anyway.");
+		return 0;
+	}
+
+	pthread_mutex_lock(&vl53l0_sys_lock);
+	snprintf(path, sizeof(path), "%s/set_ref_spads", vl->sysfs);
+
+	rc = cash_set_permissions(path, "system", "input");
+	if (rc == -1)
+		goto calib_err;
+
+	cnt = snprintf(buf, sizeof(buf), "%u", calib->tof_spad_num);
+
+	rc = cash_set_parameter(path, buf, cnt);
+	if (rc < 0)
+		ALOGE("ERROR! Cannot set Reference SPADs!");
+
+	snprintf(path, sizeof(path), "%s/set_um_offset", vl->sysfs);
+
+	rc = cash_set_permissions(path, "system", "input");
+	if (rc == -1)
+		goto calib_err;
+
+	cnt = snprintf(buf, sizeof(buf), "%u", calib->tof_um_offset);
+
+	rc = cash_set_parameter(path, buf, cnt);
+	if (rc < 0)
+		ALOGE("ERROR! Cannot set micrometer offset!");
+
+	pthread_mutex_unlock(&vl53l0_sys_lock);
+	return 0;
+
+calib_err:
+	pthread_mutex_unlock(&vl53l0_sys_lock);
+	ALOGE("Calibration is not mandatory. Going on anyway.");
+	return 0;
+}
+
+/*
+ * vl53l0_enable - Powers the sensor up or down.
+ *
+ * \return Returns zero, -ENODEV if it cannot be reached, or -EIO.
+ */
+static int vl53l0_enable(struct cash_sensor *sns, bool enable)
+{
+	struct vl53l0_priv *vl = sns->priv;
+	int fd, rc;
+
+	pthread_mutex_lock(&vl53l0_sys_lock);
+	fd = open(vl->enable_path, O_WRONLY);
+	if (fd < 0) {
+		ALOGD("Cannot open %s", vl->enable_path);
+		rc = -ENODEV;
+		goto end;
+	}
+
+	if (enable)
+		rc = write(fd, "1", 1);
+	else
+		rc = write(fd, "0", 1);
+
+	close(fd);
+	if (rc < 1) {
+		ALOGW("ERROR! Cannot %sable ToF!", enable ? "en" : "dis");
+		rc = -EIO;
+		goto end;
+	}
+	rc = 0;
+end:
+	pthread_mutex_unlock(&vl53l0_sys_lock);
+	return rc;
+}
+
+/*
+ * vl53l0_decode - Reads the pending events into a struct cash_vl53l0.
+ *
+ * \return Returns 1 when a new range came in, zero otherwise.
+ */
+static int vl53l0_decode(struct cash_sensor *sns, void *sample)
+{
+	struct cash_vl53l0 *stmvl_cur = sample;
+	struct input_event evt[16];
+	int i, len, rc;
+	bool rr = false;
+	uint16_t type, code;
+	int32_t value;
+
+	stmvl_cur->range_status = 0;
+
+	rc = read(sns->fd, &evt, sizeof(evt));
+	if (rc <= 0)
+		return 0;
+
+	len = rc / sizeof(struct input_event);
+
+	for (i = 0; i < len; i++) {
+		type = evt[i].type;
+		code = evt[i].code;
+		value = evt[i].value;
+
+		if (type != EV_ABS)
+			continue;
+
+		switch (code) {
+			case ABS_DISTANCE:
+				if (value < 900 && value >= 0)
+					stmvl_cur->distance = value;
+				break;
+			case ABS_HAT1X:
+				if (value < 9000 && value > 0) {
+					stmvl_cur->range_mm = value;
+					stmvl_cur->timestamp_ns =
+						CASH_EVT_TIME_NS(evt[i]);
+					rr = true;
+				}
+				break;
+			case ABS_HAT1Y:
+				stmvl_cur->range_status = value;
+				break;
+			default:
+				break;
+		}
+	}
+
+	/* Tell whether a new range sample came in */
+	return rr ? 1 : 0;
+}
+
+/* Input devices this backend can drive */
+static const struct cash_input_id vl53l0_ids[] = {
+	{ .name = VL53L0_STR },
+	{ }
+};
+
+const struct cash_sensor_ops cash_vl53l0_ops = {
+	.name = "VL53L0",
+	.type = CASH_SENSOR_TOF,
+	.ids = vl53l0_ids,
+	.priv_size = sizeof(struct vl53l0_priv),
+	.probe = vl53l0_probe,
+	.calibrate = vl53l0_calibrate,
+	.enable = vl53l0_enable,
+	.decode = vl53l0_decode,
+};
@@ -0,0 +1,336 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * STMicroelectronics VL53L5 multi-zone ranging sensor backend
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG			"CASH_VL53L5"
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+#include <log/log.h>
+
+#include "cash_private.h"
+#include "cash_input_common.h"
+#include "cash_input_tof.h"
+
+#define VL53L5_STR		"STM VL53L5 multi-zone ranging sensor"
+
+/*
+ * The driver reports a frame as a multi-touch like sequence: a zone
+ * number followed by its range and target status, for every zone,
+ * then a SYN_REPORT. The zone count is the number of slots.
+ */
+#define VL53L5_ABS_ZONE		ABS_MT_SLOT
+#define VL53L5_ABS_RANGE	ABS_MT_DISTANCE
+#define VL53L5_ABS_STATUS	ABS_MT_BLOB_ID
+
+/* Target status of a valid range, or of a valid one with a wide pulse */
+#define VL53L5_STATUS_VALID	5
+#define VL53L5_STATUS_VALID_WIDE 9
+
+/* Zones the single range, for those who want one, comes out of */
+static const struct cash_roi vl53l5_center = {
+	.left = 0.25f,
+	.top = 0.25f,
+	.width = 0.5f,
+	.height = 0.5f,
+};
+
+/*
+ * Attributes of the input device: it may come and go, so they may move.
+ * One lock for all the instances is plenty, they are seldom written.
+ */
+static pthread_mutex_t vl53l5_sys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Like the input core, only changes get reported: the zones and the
+ * current slot keep their values from frame to frame.
+ */
+struct vl53l5_priv {
+	char enable_path[PATH_MAX];
+	/* Frame being assembled by the ToF thread */
+	struct cash_tof_zones frame;
+	int zone;
+	/* Events got lost: skip the rest of the frame, then resync */
+	bool dropped;
+};
+
+/* Zero for a valid zone, whatever else otherwise */
+static inline int32_t vl53l5_status(int32_t target_status)
+{
+	if (target_status == VL53L5_STATUS_VALID ||
+	    target_status == VL53L5_STATUS_VALID_WIDE)
+		return 0;
+
+	return target_status ? target_status : -1;
+}
+
+/*
+ * vl53l5_slots_get - Gets the current values of the zones, as the input
+ *		      core has them: they won't be reported again until
+ *		      they change.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int vl53l5_slots_get(int fd, struct vl53l5_priv *vl, int nzones)
+{
+	struct {
+		uint32_t code;
+		int32_t values[TOF_ZONES_MAX];
+	} slots;
+	int i;
+
+	slots.code = VL53L5_ABS_RANGE;
+	if (ioctl(fd, EVIOCGMTSLOTS(sizeof(slots)), &slots) < 0)
+		return -errno;
+	for (i = 0; i < nzones; i++)
+		vl->frame.range_mm[i] = slots.values[i];
+
+	slots.code = VL53L5_ABS_STATUS;
+	if (ioctl(fd, EVIOCGMTSLOTS(sizeof(slots)), &slots) < 0)
+		return -errno;
+	for (i = 0; i < nzones; i++)
+		vl->frame.status[i] = vl53l5_status(slots.values[i]);
+
+	return 0;
+}
+
+/*
+ * vl53l5_resync - Gets the current slot and zones back after the input
+ *		   core dropped events.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int vl53l5_resync(int fd, struct vl53l5_priv *vl, int nzones)
+{
+	struct input_absinfo abs;
+
+	if (ioctl(fd, EVIOCGABS(VL53L5_ABS_ZONE), &abs) < 0)
+		return -errno;
+
+	vl->zone = abs.value >= 0 && abs.value < nzones ? abs.value : -1;
+
+	return vl53l5_slots_get(fd, vl, nzones);
+}
+
+/*
+ * vl53l5_probe - Finds out the zone layout, along with the current
+ *		  values of the zones, and makes the attributes of the
+ *		  input device accessible.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int vl53l5_probe(struct cash_sensor *sns,
+			const struct cash_input_dev *dev)
+{
+	struct vl53l5_priv *vl = sns->priv;
+	struct input_absinfo abs;
+	char path[PATH_MAX];
+	int fd, rc, side;
+
+	snprintf(path, sizeof(path), "%s%d", devfs_input_str, dev->evtno);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	rc = ioctl(fd, EVIOCGABS(VL53L5_ABS_ZONE), &abs);
+	if (rc < 0) {
+		rc = -errno;
+		close(fd);
+		return rc;
+	}
+
+	/* Square layouts only: 4x4 or 8x8 */
+	for (side = 1; side < TOF_ZONES_SIDE_MAX; side++)
+		if (side * side >= abs.maximum + 1)
+			break;
+	if (side * side != abs.maximum + 1) {
+		ALOGE("Unsupported layout of %d zones", abs.maximum + 1);
+		close(fd);
+		return -EINVAL;
+	}
+
+	vl->frame.rows = side;
+	vl->frame.cols = side;
+	vl->zone = abs.value >= 0 && abs.value <= abs.maximum ?
+		   abs.value : -1;
+
+	/* Without them, steady zones would stay unknown */
+	rc = vl53l5_slots_get(fd, vl, side * side);
+	close(fd);
+	if (rc < 0) {
+		ALOGE("Cannot get the zones: %d", rc);
+		return rc;
+	}
+
+	pthread_mutex_lock(&vl53l5_sys_lock);
+	snprintf(vl->enable_path, sizeof(vl->enable_path),
+		 "%s/enable_ps_sensor", dev->sysfs);
+
+	rc = cash_set_permissions(vl->enable_path, "system", "input");
+	if (rc == -1)
+		vl->enable_path[0] = '\0';
+	pthread_mutex_unlock(&vl53l5_sys_lock);
+	if (rc == -1)
+		return -EACCES;
+
+	ALOGI("Found %dx%d zones", side, side);
+
+	return 0;
+}
+
+/*
+ * vl53l5_enable - Powers the sensor up or down.
+ *
+ * \return Returns zero, -ENODEV if it cannot be reached, or -EIO.
+ */
+static int vl53l5_enable(struct cash_sensor *sns, bool enable)
+{
+	struct vl53l5_priv *vl = sns->priv;
+	int fd, rc;
+
+	pthread_mutex_lock(&vl53l5_sys_lock);
+	fd = open(vl->enable_path, O_WRONLY);
+	if (fd < 0) {
+		ALOGD("Cannot open %s", vl->enable_path);
+		rc = -ENODEV;
+		goto end;
+	}
+
+	rc = write(fd, enable ? "1" : "0", 1);
+	close(fd);
+	if (rc < 1) {
+		ALOGW("ERROR! Cannot %sable ToF!", enable ? "en" : "dis");
+		rc = -EIO;
+		goto end;
+	}
+	rc = 0;
+end:
+	pthread_mutex_unlock(&vl53l5_sys_lock);
+	return rc;
+}
+
+/*
+ * vl53l5_decode - Reads the pending events into the frame being put
+ *		   together. Complete frames get published as they are,
+ *		   and reduced over the center of the field of view into
+ *		   a struct cash_vl53l0, for the single range readers.
+ *		   Zones without events kept their range and status.
+ *
+ * \return Returns 1 when a new range came out of a frame, zero otherwise.
+ */
+static int vl53l5_decode(struct cash_sensor *sns, void *sample)
+{
+	struct vl53l5_priv *vl = sns->priv;
+	struct cash_vl53l0 *stmvl_cur = sample;
+	struct input_event evt[128];
+	int i, len, rc, range, used, ret = 0;
+	int nzones = vl->frame.rows * vl->frame.cols;
+
+	rc = read(sns->fd, &evt, sizeof(evt));
+	if (rc <= 0)
+		return 0;
+
+	len = rc / sizeof(struct input_event);
+
+	for (i = 0; i < len; i++) {
+		if (evt[i].type == EV_SYN && evt[i].code == SYN_DROPPED) {
+			vl->dropped = true;
+			continue;
+		}
+
+		if (vl->dropped) {
+			if (evt[i].type != EV_SYN || evt[i].code != SYN_REPORT)
+				continue;
+
+			vl->dropped = false;
+			if (vl53l5_resync(sns->fd, vl, nzones) < 0)
+				ALOGW("Cannot resync the zones");
+			continue;
+		}
+
+		if (evt[i].type == EV_SYN && evt[i].code == SYN_REPORT) {
+			vl->frame.timestamp_ns = CASH_EVT_TIME_NS(evt[i]);
+			cash_tof_zones_publish(sns, &vl->frame);
+
+			range = cash_tof_zones_reduce(&vl->frame,
+						      &vl53l5_center, &used);
+			if (range < 0)
+				continue;
+
+			stmvl_cur->range_mm = range;
+			/* In cm, like the single zone sensors do */
+			stmvl_cur->distance = (range + 5) / 10;
+			stmvl_cur->range_status = 0;
+			stmvl_cur->timestamp_ns = vl->frame.timestamp_ns;
+			ret = 1;
+			continue;
+		}
+
+		if (evt[i].type != EV_ABS)
+			continue;
+
+		switch (evt[i].code) {
+			case VL53L5_ABS_ZONE:
+				if (evt[i].value >= 0 && evt[i].value < nzones)
+					vl->zone = evt[i].value;
+				else
+					vl->zone = -1;
+				break;
+			case VL53L5_ABS_RANGE:
+				if (vl->zone >= 0)
+					vl->frame.range_mm[vl->zone] =
+						evt[i].value;
+				break;
+			case VL53L5_ABS_STATUS:
+				if (vl->zone >= 0)
+					vl->frame.status[vl->zone] =
+						vl53l5_status(evt[i].value);
+				break;
+			default:
+				break;
+		}
+	}
+
+	return ret;
+}
+
+/* Input devices this backend can drive */
+static const struct cash_input_id vl53l5_ids[] = {
+	{ .name = VL53L5_STR },
+	{ }
+};
+
+const struct cash_sensor_ops cash_vl53l5_ops = {
+	.name = "VL53L5",
+	.type = CASH_SENSOR_TOF,
+	.ids = vl53l5_ids,
+	.priv_size = sizeof(struct vl53l5_priv),
+	.probe = vl53l5_probe,
+	.enable = vl53l5_enable,
+	.decode = vl53l5_decode,
+};
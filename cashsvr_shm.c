@@ -0,0 +1,144 @@
+/*
+ * CASH! Camera Augmented Sensing Helper
+ * a multi-sensor camera helper server
+ *
+ * Shared memory snapshot of the latest readings
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG			"CASH_SHM"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <log/log.h>
+
+#include "cash_private.h"
+
+/* Linux 5.1, not known to older headers */
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+
+static struct cash_shm_snapshot *cash_shm;
+static int cash_shm_ro_fd = -1;
+
+/*
+ * cash_shm_init - Creates the memfd holding the snapshot and a read
+ *		   only descriptor of it, which is what clients get.
+ *		   Reopening that one for writing is allowed, so the
+ *		   memfd gets sealed against writes: nobody but the
+ *		   server mapping, made beforehand, can write there.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int cash_shm_init(void)
+{
+	char path[32];
+	int fd, rc;
+
+	fd = memfd_create("cashsvr_snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		ALOGE("Cannot create the snapshot memfd");
+		return -errno;
+	}
+
+	rc = ftruncate(fd, sizeof(struct cash_shm_snapshot));
+	if (rc < 0) {
+		rc = -errno;
+		goto end;
+	}
+
+	cash_shm = mmap(NULL, sizeof(struct cash_shm_snapshot),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (cash_shm == MAP_FAILED) {
+		cash_shm = NULL;
+		rc = -errno;
+		goto end;
+	}
+
+	/*
+	 * Neither the size nor the contents change from now on, but for
+	 * the mapping above. Without that guarantee, the snapshot isn't
+	 * handed out at all: clients can still ask the server.
+	 */
+	rc = fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+		   F_SEAL_FUTURE_WRITE | F_SEAL_SEAL);
+	if (rc < 0) {
+		rc = -errno;
+		munmap(cash_shm, sizeof(struct cash_shm_snapshot));
+		cash_shm = NULL;
+		goto end;
+	}
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	cash_shm_ro_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (cash_shm_ro_fd < 0) {
+		rc = -errno;
+		munmap(cash_shm, sizeof(struct cash_shm_snapshot));
+		cash_shm = NULL;
+		goto end;
+	}
+
+	cash_shm->version = CASH_SHM_VERSION;
+	cash_shm->owner_pid = getpid();
+	rc = 0;
+end:
+	if (rc < 0)
+		ALOGE("Cannot setup the shared snapshot: %d", rc);
+
+	/* The mapping and the read-only fd keep the memfd alive */
+	close(fd);
+	return rc;
+}
+
+/*
+ * cash_shm_get_fd - Gets the read-only snapshot descriptor to hand
+ *		     out to clients, creating the snapshot if needed.
+ *
+ * \return Returns the descriptor or negative errno.
+ */
+int cash_shm_get_fd(void)
+{
+	int rc;
+
+	if (cash_shm == NULL) {
+		rc = cash_shm_init();
+		if (rc < 0)
+			return rc;
+	}
+
+	return cash_shm_ro_fd;
+}
+
+/*
+ * cash_shm_publish - Publishes new readings. Single writer only.
+ */
+void cash_shm_publish(struct cash_shm_data *data)
+{
+	if (cash_shm == NULL)
+		return;
+
+	cash_seqlock_write_begin(&cash_shm->lock);
+	memcpy(&cash_shm->data, data, sizeof(struct cash_shm_data));
+	cash_seqlock_write_end(&cash_shm->lock);
+}
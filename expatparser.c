@@ -22,10 +22,11 @@
 #define LOG_TAG "CASH-XMLParser"
 
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
-#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -38,403 +39,525 @@
 
 #define UNUSED __attribute__((unused))
 
-#define CASH_MAX_POLYREG_TBL_ENTRIES	500
+#define CASH_MAX_POLYREG_TBL_ENTRIES	16384
 
-static short xml_depth = 0;
-static short parse = -1;
-static char* main_node;
+/* The file is fed to expat in chunks of this size */
+#define CASH_XML_CHUNK_SZ		4096
+#define CASH_XML_MAX_FILE_SZ		(1 << 20)
 
-static char millimeters[255];
-static char focus_steps[255];
-static char tof_min[50], tof_max[50], tof_hyst[4], tof_max_runs[4];
-static char tof_polyreg_degree[3], tof_polyreg_extra[3];
-static char clear_values[255];
-static char iso_values[255];
-static char exposure_times[255];
-static char rgbc_clear_min[50], rgbc_clear_max[50];
-static char rgbc_polyreg_degree[3], rgbc_polyreg_extra[3];
+/*
+ * List of numbers out of one attribute. Like it always was, the list
+ * ends at the end of the string or at the first zero.
+ */
+struct cash_xml_list {
+	int64_t *val;
+	uint32_t len;
+	uint32_t alloc_len;
+};
+
+struct cash_xml_ctx {
+	const char *main_node;
+	short depth;
+	short parse;
+	int err;
+
+	/* focus or rgbc_clear_iso_exptime */
+	struct cash_xml_list in_vals;
+	struct cash_xml_list out_vals;
+	struct cash_xml_list exptimes;
+
+	int32_t tof_min, tof_max, tof_hyst, tof_max_runs;
+	int32_t tof_polyreg_degree, tof_polyreg_extra;
+	char tof_filter_type[8], tof_filter_median_len[4];
+	char tof_filter_ema_alpha[16];
+	char tof_filter_kalman_q[16], tof_filter_kalman_r[16];
+
+	int32_t rgbc_clear_min, rgbc_clear_max;
+	int32_t rgbc_polyreg_degree, rgbc_polyreg_extra;
+};
+
+/*
+ * xml_parse_list - Tokenizes a list of numbers, separated by blanks
+ *		    and/or commas, straight into a growing array.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int xml_parse_list(struct cash_xml_list *list, const char *str,
+			  const char *name)
+{
+	int64_t *tmp;
+	long long val;
+	char *end;
+
+	list->len = 0;
+
+	for (;;) {
+		str += strspn(str, " \t\r\n,");
+		if (*str == '\0')
+			break;
 
-struct cash_polyreg_params focus_params;
-struct cash_polyreg_params clear_iso_params;
+		val = strtoll(str, &end, 10);
+		if (end == str) {
+			ALOGE("Bad value in %s: %.16s", name, str);
+			return -EINVAL;
+		}
+		str = end;
+
+		/* We've reached the end, farewell! */
+		if (val == 0)
+			break;
+
+		if (list->len == list->alloc_len) {
+			if (list->alloc_len >= CASH_MAX_POLYREG_TBL_ENTRIES) {
+				ALOGE("Too many values in %s, max %d", name,
+					CASH_MAX_POLYREG_TBL_ENTRIES);
+				return -E2BIG;
+			}
+
+			tmp = realloc(list->val, (list->alloc_len ?
+					list->alloc_len * 2 : 64) *
+					sizeof(*tmp));
+			if (tmp == NULL) {
+				ALOGE("Out of memory. Cannot allocate.");
+				return -ENOMEM;
+			}
+			list->val = tmp;
+			list->alloc_len = list->alloc_len ?
+					  list->alloc_len * 2 : 64;
+		}
+
+		list->val[list->len++] = val;
+	}
+
+	return 0;
+}
 
-void parseElm(const char *elm, const char **attr)
+/* Not mandatory: zero, as in not configured, if absent or malformed */
+static void xml_parse_int(int32_t *out, const char *str, const char *name)
+{
+	char *end;
+	long val;
+
+	val = strtol(str, &end, 10);
+	if (end == str || *end != '\0' || val > INT32_MAX || val < INT32_MIN) {
+		ALOGW("Bad value for %s: %.16s, ignored", name, str);
+		return;
+	}
+
+	*out = (int32_t)val;
+}
+
+static void xml_parse_list_attr(struct cash_xml_ctx *ctx,
+				struct cash_xml_list *list,
+				const char *str, const char *name)
+{
+	int rc;
+
+	rc = xml_parse_list(list, str, name);
+	if (rc < 0 && ctx->err == 0)
+		ctx->err = rc;
+}
+
+static void parseElm(struct cash_xml_ctx *ctx, const char *elm,
+		     const char **attr)
 {
 	int i;
 
 	if (strcmp("focus", elm) == 0) {
 		for (i = 0; attr[i]; i += 2) {
 			if (strcmp("millimeters", attr[i]) == 0)
-				strcpy(millimeters, attr[i+1]);
+				xml_parse_list_attr(ctx, &ctx->in_vals,
+						    attr[i+1], attr[i]);
 			else if (strcmp("focus_step", attr[i]) == 0)
-				strcpy(focus_steps, attr[i+1]);
+				xml_parse_list_attr(ctx, &ctx->out_vals,
+						    attr[i+1], attr[i]);
 		}
 	}
 
 	if (strcmp("polyreg_tuning", elm) == 0) {
 		for (i = 0; attr[i]; i += 2) {
 			if (strcmp("degree", attr[i]) == 0)
-				strcpy(tof_polyreg_degree, attr[i+1]);
+				xml_parse_int(&ctx->tof_polyreg_degree,
+					      attr[i+1], attr[i]);
 			else if (strcmp("extra", attr[i]) == 0)
-				strcpy(tof_polyreg_extra, attr[i+1]);
+				xml_parse_int(&ctx->tof_polyreg_extra,
+					      attr[i+1], attr[i]);
 		}
 	}
 
 	if (strcmp("ranging_limits", elm) == 0) {
 		for (i = 0; attr[i]; i += 2) {
 			if (strcmp("min_range", attr[i]) == 0)
-				strcpy(tof_min, attr[i+1]);
+				xml_parse_int(&ctx->tof_min,
+					      attr[i+1], attr[i]);
 			else if (strcmp("max_range", attr[i]) == 0)
-				strcpy(tof_max, attr[i+1]);
+				xml_parse_int(&ctx->tof_max,
+					      attr[i+1], attr[i]);
 		}
 	}
 
 	if (strcmp("ranging_params", elm) == 0) {
 		for (i = 0; attr[i]; i += 2) {
 			if (strcmp("hysteresis", attr[i]) == 0)
-				strcpy(tof_hyst, attr[i+1]);
+				xml_parse_int(&ctx->tof_hyst,
+					      attr[i+1], attr[i]);
 			else if (strcmp("max_runs", attr[i]) == 0)
-				strcpy(tof_max_runs, attr[i+1]);
+				xml_parse_int(&ctx->tof_max_runs,
+					      attr[i+1], attr[i]);
+		}
+	}
+
+	if (strcmp("range_filter", elm) == 0) {
+		for (i = 0; attr[i]; i += 2) {
+			if (strcmp("type", attr[i]) == 0)
+				snprintf(ctx->tof_filter_type,
+					sizeof(ctx->tof_filter_type),
+					"%s", attr[i+1]);
+			else if (strcmp("ema_alpha", attr[i]) == 0)
+				snprintf(ctx->tof_filter_ema_alpha,
+					sizeof(ctx->tof_filter_ema_alpha),
+					"%s", attr[i+1]);
+			else if (strcmp("median_len", attr[i]) == 0)
+				snprintf(ctx->tof_filter_median_len,
+					sizeof(ctx->tof_filter_median_len),
+					"%s", attr[i+1]);
+			else if (strcmp("kalman_q", attr[i]) == 0)
+				snprintf(ctx->tof_filter_kalman_q,
+					sizeof(ctx->tof_filter_kalman_q),
+					"%s", attr[i+1]);
+			else if (strcmp("kalman_r", attr[i]) == 0)
+				snprintf(ctx->tof_filter_kalman_r,
+					sizeof(ctx->tof_filter_kalman_r),
+					"%s", attr[i+1]);
 		}
 	}
 
 	if (strcmp("rgbc_clear_iso_exptime", elm) == 0) {
 		for (i = 0; attr[i]; i += 2) {
 			if (strcmp("clear_values", attr[i]) == 0)
-				strcpy(clear_values, attr[i+1]);
+				xml_parse_list_attr(ctx, &ctx->in_vals,
+						    attr[i+1], attr[i]);
 			else if (strcmp("iso_values", attr[i]) == 0)
-				strcpy(iso_values, attr[i+1]);
+				xml_parse_list_attr(ctx, &ctx->out_vals,
+						    attr[i+1], attr[i]);
 			else if (strcmp("exposure_times", attr[i]) == 0)
-				strcpy(exposure_times, attr[i+1]);
+				xml_parse_list_attr(ctx, &ctx->exptimes,
+						    attr[i+1], attr[i]);
 		}
 	}
 
 	if (strcmp("rgbc_clear_limits", elm) == 0) {
 		for (i = 0; attr[i]; i += 2) {
 			if (strcmp("min_range", attr[i]) == 0)
-				strcpy(rgbc_clear_min, attr[i+1]);
+				xml_parse_int(&ctx->rgbc_clear_min,
+					      attr[i+1], attr[i]);
 			else if (strcmp("max_range", attr[i]) == 0)
-				strcpy(rgbc_clear_max, attr[i+1]);
+				xml_parse_int(&ctx->rgbc_clear_max,
+					      attr[i+1], attr[i]);
 		}
 	}
 
 	if (strcmp("rgbc_polyreg_tuning", elm) == 0) {
 		for (i = 0; attr[i]; i += 2) {
 			if (strcmp("degree", attr[i]) == 0)
-				strcpy(rgbc_polyreg_degree, attr[i+1]);
+				xml_parse_int(&ctx->rgbc_polyreg_degree,
+					      attr[i+1], attr[i]);
 			else if (strcmp("extra", attr[i]) == 0)
-				strcpy(rgbc_polyreg_extra, attr[i+1]);
+				xml_parse_int(&ctx->rgbc_polyreg_extra,
+					      attr[i+1], attr[i]);
 		}
 	}
 }
 
-void startElm(void *data UNUSED, const char *elm, const char **attr)
+static void startElm(void *data, const char *elm, const char **attr)
 {
-	xml_depth++;
+	struct cash_xml_ctx *ctx = data;
+
+	ctx->depth++;
 
-	if (strncmp(main_node, elm, strlen(main_node)) == 0)
-		parse = xml_depth;
+	if (strncmp(ctx->main_node, elm, strlen(ctx->main_node)) == 0)
+		ctx->parse = ctx->depth;
 
-	if (parse > 0)
-		parseElm(elm, attr);
+	if (ctx->parse > 0)
+		parseElm(ctx, elm, attr);
 }
 
-void endElm(void *data UNUSED, const char *elm UNUSED)
+static void endElm(void *data, const char *elm UNUSED)
 {
-	if ((parse > 0) && (parse == xml_depth))
-		parse = -1;
+	struct cash_xml_ctx *ctx = data;
 
-	xml_depth--;
+	if ((ctx->parse > 0) && (ctx->parse == ctx->depth))
+		ctx->parse = -1;
+
+	ctx->depth--;
 }
 
-void str_handler(void *data, const char *str, int len)
+static void xml_ctx_free(struct cash_xml_ctx *ctx)
 {
-	char *buf = malloc(len+1);
-
-	strncpy(buf, str, len);
-	buf[len+1] = '\0';
-
-	data = (void*)buf;
+	free(ctx->in_vals.val);
+	free(ctx->out_vals.val);
+	free(ctx->exptimes.val);
 }
 
-int parse_cash_tof_xml_data(char* filepath, char* node,
-			struct cash_polyreg_params *cash_focus,
-			struct cash_configuration *cash_config)
+/*
+ * xml_parse_file - Streams a configuration file through expat, one
+ *		    chunk at a time: lists get tokenized while parsing
+ *		    and the file itself is never held in memory.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int xml_parse_file(const char *filepath, struct cash_xml_ctx *ctx)
 {
-	int ret, fd, count, sz, tmp;
-	char *buf, *mend, *fend;
 	struct stat st;
 	XML_Parser pa;
-	struct cash_polyreg_tbl_entry *tbl_entry = NULL;
+	ssize_t count;
+	void *buf;
+	int ret = 0, fd;
 
-	fd = open(filepath, O_RDONLY);
+	fd = open(filepath, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		ALOGE("Cannot open configuration file!!!");
 		return -ENOENT;
 	}
 
-	pa = XML_ParserCreate(NULL);
-
-	stat(filepath, &st);
-	sz = st.st_size;
-
 	/* Security check: do NOT parse too big files */
-	if (sz > 131072) {
+	if (fstat(fd, &st) < 0 || st.st_size > CASH_XML_MAX_FILE_SZ) {
 		ALOGE("File is huge. Preventing parse as a security measure.");
-		ret = -E2BIG;
-		goto secfail;
+		close(fd);
+		return -E2BIG;
 	}
 
-	buf = malloc(sizeof(char)*sz);
-
-	memset(buf, 0, sz);
-	count = read(fd, buf, (sz - 1));
-	if (count < 0) {
-		ALOGE("Cannot read configuration file!!!");
-		ret = -EIO;
-		goto end;
-	}
-
-	focus_params.table = malloc(CASH_MAX_POLYREG_TBL_ENTRIES *
-			sizeof(struct cash_polyreg_tbl_entry));
-	if (focus_params.table == NULL) {
-		ALOGE("Out of memory. Cannot allocate.");
-		ret = -ENOMEM;
-		goto end;
+	pa = XML_ParserCreate(NULL);
+	if (pa == NULL) {
+		close(fd);
+		return -ENOMEM;
 	}
-	focus_params.num_steps = 0;
 
+	XML_SetUserData(pa, ctx);
 	XML_SetElementHandler(pa, startElm, endElm);
-	XML_SetCharacterDataHandler(pa, str_handler);
-
-	main_node = node;
-
-	if (XML_Parse(pa, buf, strlen(buf), XML_TRUE) == XML_STATUS_ERROR) {
-		ALOGE("XML Parse error: %s\n", XML_ErrorString(
-						XML_GetErrorCode(pa)));
-		ret = -EINVAL;
-		goto end;
-	}
-	ret = 0;
 
-	/* Check values and fill the temporary struct */
-	tbl_entry = &focus_params.table[focus_params.num_steps];
-
-	tbl_entry->input_val = (int32_t)strtol(millimeters, &mend, 10);
-	tbl_entry->output_val = (int32_t)strtol(focus_steps, &fend, 10);
-
-	if (tbl_entry->input_val == 0 || tbl_entry->output_val == 0) {
-		ret = -EINVAL;
-		free(focus_params.table);
-		goto end;
-	}
-
-	do {
-		focus_params.num_steps++;
-		tbl_entry = &focus_params.table[focus_params.num_steps];
-
-		tbl_entry->input_val = (int)strtol(mend, &mend, 10);
-		tbl_entry->output_val = (int)strtol(fend, &fend, 10);
-
-		/* We've reached the end, farewell! */
-		if (tbl_entry->input_val == 0 || tbl_entry->output_val == 0) {
+	for (;;) {
+		buf = XML_GetBuffer(pa, CASH_XML_CHUNK_SZ);
+		if (buf == NULL) {
+			ret = -ENOMEM;
 			break;
 		}
-	} while (focus_params.num_steps < CASH_MAX_POLYREG_TBL_ENTRIES);
 
-	/* All ok! */
-	cash_focus->num_steps = focus_params.num_steps;
-	cash_focus->table = focus_params.table;
-
-	/* These configurations are not mandatory */
-	tmp = (int32_t)strtol(tof_min, NULL, 10);
-	if (tmp != 0) {
-		cash_config->tof_min = tmp;
-	}
-
-	tmp = (int32_t)strtol(tof_max, NULL, 10);
-	if (tmp != 0) {
-		cash_config->tof_max = tmp;
-	}
-
-	tmp = (int32_t)strtol(tof_hyst, NULL, 10);
-	if (tmp != 0) {
-		cash_config->tof_hyst = tmp;
-	}
+		count = read(fd, buf, CASH_XML_CHUNK_SZ);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("Cannot read configuration file!!!");
+			ret = -EIO;
+			break;
+		}
 
-	tmp = (int32_t)strtol(tof_max_runs, NULL, 10);
-	if (tmp != 0) {
-		cash_config->tof_max_runs = tmp;
-	}
+		if (XML_ParseBuffer(pa, (int)count, count == 0) ==
+							XML_STATUS_ERROR) {
+			ALOGE("XML Parse error at line %lu: %s\n",
+				XML_GetCurrentLineNumber(pa),
+				XML_ErrorString(XML_GetErrorCode(pa)));
+			ret = -EINVAL;
+			break;
+		}
 
-	tmp = (int32_t)strtol(tof_polyreg_degree, NULL, 10);
-	if (tmp != 0) {
-		cash_config->tof_polyreg_degree = tmp;
-	}
+		if (ctx->err < 0) {
+			ret = ctx->err;
+			break;
+		}
 
-	tmp = (int32_t)strtol(tof_polyreg_extra, NULL, 10);
-	if (tmp != 0) {
-		cash_config->tof_polyreg_extra = tmp;
+		if (count == 0)
+			break;
 	}
 
-end:
-	free(buf);
-secfail:
 	close(fd);
 	XML_ParserFree(pa);
 
 	return ret;
 }
 
-int parse_cash_rgbc_xml_data(char* filepath, char* node,
-			struct cash_polyreg_params *cash_rgbc_clear_iso,
-			struct cash_configuration *cash_config)
+/*
+ * xml_build_table - Pairs up the input and output lists into a
+ *		     polynomial regression table. Like before, the table
+ *		     ends with a zeroed entry at table[num_steps].
+ *
+ * \return Returns zero or negative errno.
+ */
+static int xml_build_table(struct cash_xml_ctx *ctx,
+			   struct cash_polyreg_params *params)
 {
-	int ret, fd, count, sz, tmp;
-	char *buf, *mend, *fend;
-	struct stat st;
-	XML_Parser pa;
-	struct cash_polyreg_tbl_entry *tbl_entry = NULL;
-	int64_t *exposure_time = NULL;
+	struct cash_polyreg_tbl_entry *tbl;
+	uint32_t i;
 
-	fd = open(filepath, O_RDONLY);
-	if (fd < 0) {
-		ALOGE("Cannot open configuration file!!!");
-		return -ENOENT;
+	if (ctx->in_vals.len == 0 || ctx->out_vals.len == 0) {
+		ALOGE("Empty calibration table");
+		return -EINVAL;
 	}
 
-	pa = XML_ParserCreate(NULL);
-
-	stat(filepath, &st);
-	sz = st.st_size;
-
-	/* Security check: do NOT parse too big files */
-	if (sz > 131072) {
-		ALOGE("File is huge. Preventing parse as a security measure.");
-		ret = -E2BIG;
-		goto rgbc_secfail;
-	}
-
-	buf = malloc(sizeof(char)*sz);
-
-	memset(buf, 0, sz);
-	count = read(fd, buf, (sz - 1));
-	if (count < 0) {
-		ALOGE("Cannot read configuration file!!!");
-		ret = -EIO;
-		goto rgbc_end;
+	if (ctx->in_vals.len != ctx->out_vals.len) {
+		ALOGE("Calibration table has %u inputs but %u outputs",
+			ctx->in_vals.len, ctx->out_vals.len);
+		return -EINVAL;
 	}
 
-	clear_iso_params.table = malloc(CASH_MAX_POLYREG_TBL_ENTRIES *
-			sizeof(struct cash_polyreg_tbl_entry));
-	if (clear_iso_params.table == NULL) {
+	tbl = calloc(ctx->in_vals.len + 1, sizeof(*tbl));
+	if (tbl == NULL) {
 		ALOGE("Out of memory. Cannot allocate.");
-		ret = -ENOMEM;
-		goto rgbc_end;
+		return -ENOMEM;
 	}
-	clear_iso_params.num_steps = 0;
-
-	cash_config->exposure_times = malloc(CASH_MAX_POLYREG_TBL_ENTRIES *
-			sizeof(int64_t));
-	if (cash_config->exposure_times == NULL) {
-		ALOGE("Out of memory. Cannot allocate.");
-		ret = -ENOMEM;
-		goto rgbc_end;
-	}
-	cash_config->nexposure_times = 0;
-
-	XML_SetElementHandler(pa, startElm, endElm);
-	XML_SetCharacterDataHandler(pa, str_handler);
 
-	main_node = node;
-
-	if (XML_Parse(pa, buf, strlen(buf), XML_TRUE) == XML_STATUS_ERROR) {
-		ALOGE("XML Parse error: %s\n", XML_ErrorString(
-						XML_GetErrorCode(pa)));
-		ret = -EINVAL;
-		goto rgbc_end;
+	for (i = 0; i < ctx->in_vals.len; i++) {
+		if (ctx->in_vals.val[i] > INT32_MAX ||
+		    ctx->in_vals.val[i] < INT32_MIN ||
+		    ctx->out_vals.val[i] > INT32_MAX ||
+		    ctx->out_vals.val[i] < INT32_MIN) {
+			ALOGE("Calibration table value out of range");
+			free(tbl);
+			return -ERANGE;
+		}
+		tbl[i].input_val = (int32_t)ctx->in_vals.val[i];
+		tbl[i].output_val = (int32_t)ctx->out_vals.val[i];
 	}
-	ret = 0;
 
-	/* Check values and fill the temporary struct */
-	tbl_entry = &clear_iso_params.table[clear_iso_params.num_steps];
+	params->table = tbl;
+	params->num_steps = ctx->in_vals.len;
 
-	tbl_entry->input_val = (int32_t)strtol(clear_values, &mend, 10);
-	tbl_entry->output_val = (int32_t)strtol(iso_values, &fend, 10);
+	return 0;
+}
 
-	if (tbl_entry->input_val == 0 || tbl_entry->output_val == 0) {
-		ret = -EINVAL;
-		free(clear_iso_params.table);
-		free(cash_config->exposure_times);
-		goto rgbc_end;
+/*
+ * parse_tof_filter - Validates the range_filter element, if any.
+ *		      Bad parameters leave the defaults in place, a bad
+ *		      filter type leaves the filter disabled.
+ */
+static void parse_tof_filter(struct cash_xml_ctx *ctx,
+			     struct cash_tof_filter_params *filter)
+{
+	double dtmp;
+	int tmp;
+
+	if (ctx->tof_filter_type[0] == '\0')
+		return;
+
+	if (strcmp("ema", ctx->tof_filter_type) == 0) {
+		filter->type = TOF_FILTER_EMA;
+	} else if (strcmp("median", ctx->tof_filter_type) == 0) {
+		filter->type = TOF_FILTER_MEDIAN;
+	} else if (strcmp("kalman", ctx->tof_filter_type) == 0) {
+		filter->type = TOF_FILTER_KALMAN;
+	} else if (strcmp("none", ctx->tof_filter_type) == 0) {
+		filter->type = TOF_FILTER_NONE;
+	} else {
+		ALOGE("Unknown range filter %s", ctx->tof_filter_type);
+		filter->type = TOF_FILTER_NONE;
+		return;
 	}
 
-	do {
-		clear_iso_params.num_steps++;
-		tbl_entry = &clear_iso_params.table[clear_iso_params.num_steps];
-
-		tbl_entry->input_val = (int)strtol(mend, &mend, 10);
-		tbl_entry->output_val = (int)strtol(fend, &fend, 10);
-
-		/* We've reached the end, farewell! */
-		if (tbl_entry->input_val == 0 || tbl_entry->output_val == 0) {
-			break;
-		}
-	} while (clear_iso_params.num_steps < CASH_MAX_POLYREG_TBL_ENTRIES);
+	dtmp = strtod(ctx->tof_filter_ema_alpha, NULL);
+	if (dtmp > 0 && dtmp <= 1)
+		filter->ema_alpha = dtmp;
+	else if (ctx->tof_filter_ema_alpha[0] != '\0')
+		ALOGW("Range filter EMA alpha out of (0, 1]: ignored");
+
+	tmp = (int)strtol(ctx->tof_filter_median_len, NULL, 10);
+	if (tmp > 0 && tmp <= TOF_FILTER_MEDIAN_MAX_LEN && (tmp & 1))
+		filter->median_len = tmp;
+	else if (ctx->tof_filter_median_len[0] != '\0')
+		ALOGW("Range filter median length must be odd, up to %d",
+			TOF_FILTER_MEDIAN_MAX_LEN);
+
+	dtmp = strtod(ctx->tof_filter_kalman_q, NULL);
+	if (dtmp > 0)
+		filter->kalman_q = dtmp;
+
+	dtmp = strtod(ctx->tof_filter_kalman_r, NULL);
+	if (dtmp > 0)
+		filter->kalman_r = dtmp;
+}
 
-	/*
-	 * Store exposure times found in the XML
-	 * The times are stored in a list similar to clear and ISO values
-	 */
-	exposure_time = &cash_config->exposure_times[cash_config->nexposure_times];
-	*exposure_time = (int32_t)strtol(exposure_times, &mend, 10);
-	if (exposure_time == 0) {
-		ret = -EINVAL;
-		free(clear_iso_params.table);
-		free(cash_config->exposure_times);
-		goto rgbc_end;
-	}
+/*
+ * parse_cash_tof_xml_data, parse_cash_rgbc_xml_data - Parse the
+ *		calibration files. All of the parser state is on the
+ *		stack: safe to call from concurrent threads.
+ *
+ * \return Returns zero or negative errno.
+ */
+int parse_cash_tof_xml_data(char* filepath, char* node,
+			struct cash_polyreg_params *cash_focus,
+			struct cash_configuration *cash_config)
+{
+	struct cash_xml_ctx ctx;
+	int ret;
 
-	do {
-		cash_config->nexposure_times++;
-		exposure_time = &cash_config->exposure_times[cash_config->nexposure_times];
-		*exposure_time = (int32_t)strtol(mend, &mend, 10);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.main_node = node;
+	ctx.parse = -1;
 
-		/* We've reached the end, farewell! */
-		if (exposure_time == 0) {
-			break;
-		}
-	} while (cash_config->nexposure_times < CASH_MAX_POLYREG_TBL_ENTRIES);
+	ret = xml_parse_file(filepath, &ctx);
+	if (ret < 0)
+		goto end;
 
-	/* All ok! */
-	cash_rgbc_clear_iso->num_steps = clear_iso_params.num_steps;
-	cash_rgbc_clear_iso->table = clear_iso_params.table;
+	ret = xml_build_table(&ctx, cash_focus);
+	if (ret < 0)
+		goto end;
 
 	/* These configurations are not mandatory */
-	tmp = (int32_t)strtol(rgbc_clear_min, NULL, 10);
-	if (tmp != 0) {
-		cash_config->rgbc_clear_min = tmp;
-	}
+	if (ctx.tof_min != 0)
+		cash_config->tof_min = ctx.tof_min;
+	if (ctx.tof_max != 0)
+		cash_config->tof_max = ctx.tof_max;
+	if (ctx.tof_hyst != 0)
+		cash_config->tof_hyst = ctx.tof_hyst;
+	if (ctx.tof_max_runs != 0)
+		cash_config->tof_max_runs = ctx.tof_max_runs;
+	if (ctx.tof_polyreg_degree != 0)
+		cash_config->tof_polyreg_degree = ctx.tof_polyreg_degree;
+	if (ctx.tof_polyreg_extra != 0)
+		cash_config->tof_polyreg_extra = ctx.tof_polyreg_extra;
+
+	parse_tof_filter(&ctx, &cash_config->tof_filter);
+end:
+	xml_ctx_free(&ctx);
+	return ret;
+}
 
-	tmp = (int32_t)strtol(rgbc_clear_max, NULL, 10);
-	if (tmp != 0) {
-		cash_config->rgbc_clear_max = tmp;
-	}
+int parse_cash_rgbc_xml_data(char* filepath, char* node,
+			struct cash_polyreg_params *cash_rgbc_clear_iso,
+			struct cash_configuration *cash_config)
+{
+	struct cash_xml_ctx ctx;
+	int ret;
 
-	tmp = (int32_t)strtol(rgbc_polyreg_degree, NULL, 10);
-	if (tmp != 0) {
-		cash_config->rgbc_polyreg_degree = tmp;
-	}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.main_node = node;
+	ctx.parse = -1;
 
-	tmp = (int32_t)strtol(rgbc_polyreg_extra, NULL, 10);
-	if (tmp != 0) {
-		cash_config->rgbc_polyreg_extra = tmp;
-	}
+	ret = xml_parse_file(filepath, &ctx);
+	if (ret < 0)
+		goto end;
 
-rgbc_end:
-	free(buf);
-rgbc_secfail:
-	close(fd);
-	XML_ParserFree(pa);
+	ret = xml_build_table(&ctx, cash_rgbc_clear_iso);
+	if (ret < 0)
+		goto end;
 
+	/*
+	 * Store exposure times found in the XML: the list is handed
+	 * over as it is, nanoseconds are already 64 bits wide.
+	 */
+	cash_config->exposure_times = ctx.exptimes.val;
+	cash_config->nexposure_times = ctx.exptimes.len;
+	ctx.exptimes.val = NULL;
+
+	/* These configurations are not mandatory */
+	if (ctx.rgbc_clear_min != 0)
+		cash_config->rgbc_clear_min = ctx.rgbc_clear_min;
+	if (ctx.rgbc_clear_max != 0)
+		cash_config->rgbc_clear_max = ctx.rgbc_clear_max;
+	if (ctx.rgbc_polyreg_degree != 0)
+		cash_config->rgbc_polyreg_degree = ctx.rgbc_polyreg_degree;
+	if (ctx.rgbc_polyreg_extra != 0)
+		cash_config->rgbc_polyreg_extra = ctx.rgbc_polyreg_extra;
+end:
+	xml_ctx_free(&ctx);
 	return ret;
 }
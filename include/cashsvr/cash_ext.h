@@ -20,11 +20,48 @@
 #ifndef CASHSVR_EXT_H
 #define CASHSVR_EXT_H
 
+#include <stdint.h>
+
 struct exptime_iso_tpl {
 	int64_t exptime;
 	int32_t iso;
 };
 
+/* Sensors to subscribe to or wait for, for cash_subscribe() and cash_wait_ready() */
+#define CASH_SUBSCRIBE_TOF	(1 << 0)
+#define CASH_SUBSCRIBE_RGBC	(1 << 1)
+
+struct cash_snapshot {
+	int32_t focus_step;
+	int64_t exptime;
+	int32_t iso;
+	int tof_in_range;
+	int rgbc_in_range;
+};
+
+/* Clocks and modes for cash_get_sample_at() */
+#define CASH_CLOCK_MONOTONIC		0
+#define CASH_CLOCK_BOOTTIME		1
+
+#define CASH_SAMPLE_NEAREST		0
+#define CASH_SAMPLE_INTERPOLATE		1
+
+/*
+ * Readings taken at a given time and what they translate to.
+ * A range_mm or clear of -1 means that the sensor had no reading;
+ * timestamps are on the clock that the readings were asked on.
+ */
+struct cash_sample_at {
+	struct cash_snapshot snap;
+	int32_t range_mm;
+	int32_t clear;
+	int64_t tof_timestamp_ns;
+	int64_t rgbc_timestamp_ns;
+};
+
+int cash_session_open(void);
+void cash_session_close(void);
+
 int cash_tof_start(int value);
 int cash_is_tof_in_range(void);
 int32_t cash_get_focus(void);
@@ -33,4 +70,119 @@ int cash_rgbc_start(int value);
 int cash_is_rgbc_in_range(void);
 struct exptime_iso_tpl cash_get_exptime_iso(void);
 
+/*
+ * Focus for a range predicted at a given time, out of the radial
+ * speed of the subject, positive when it moves away.
+ */
+struct cash_focus_prediction {
+	int32_t focus_step;
+	int32_t range_mm;
+	int32_t speed_mm_s;
+	int64_t timestamp_ns;
+};
+
+int cash_get_focus_at(int64_t timestamp_ns, int clock_id,
+		      struct cash_focus_prediction *pred);
+
+/*
+ * Region of interest, such as a face or a tap to focus area, as a
+ * fraction of the field of view from its top left corner.
+ * An empty one stands for the whole field of view.
+ */
+struct cash_roi {
+	float left;
+	float top;
+	float width;
+	float height;
+};
+
+/*
+ * Focus over a region: the range comes out of the nearest group of
+ * zones at about the same distance that covers enough of it, so that
+ * the background doesn't pull the focus off a subject.
+ */
+struct cash_focus_roi {
+	int32_t focus_step;
+	int32_t range_mm;
+	int32_t zones;			/* zones used, 1 for single zone ToFs */
+	int64_t timestamp_ns;		/* CLOCK_MONOTONIC */
+};
+
+int cash_get_focus_roi(const struct cash_roi *roi, struct cash_focus_roi *focus);
+
+/*
+ * Light seen by the RGBC-IR sensor. White balance gains are relative
+ * to daylight (D65), with green as unity: the ISP scales its own
+ * daylight gains by them. A cct of -1 means too little light to tell.
+ */
+struct cash_color {
+	int32_t lux;
+	int32_t cct;			/* kelvin */
+	float awb_gain_r;
+	float awb_gain_g;
+	float awb_gain_b;
+	float ir_ratio;			/* IR share of the clear channel */
+	int32_t calibrated;		/* nonzero with the factory calibration */
+	int64_t timestamp_ns;		/* CLOCK_MONOTONIC */
+};
+
+int cash_get_color(struct cash_color *color);
+
+/*
+ * Flicker of the light, as seen by the RGBC sensor sampling in short
+ * bursts: lamps on AC mains flicker at twice the mains frequency.
+ * Flicker faster than half of sample_rate_hz shows up folded back.
+ * A freq_hz of zero means that the light looks steady.
+ */
+struct cash_flicker {
+	int32_t freq_hz;
+	int32_t mains_hz;		/* 50 or 60 for anti-banding, or zero */
+	float confidence;		/* share of the ripple at freq_hz, 0 to 1 */
+	float modulation;		/* ripple amplitude over the mean */
+	int32_t sample_rate_hz;
+	int64_t timestamp_ns;		/* CLOCK_MONOTONIC, end of the burst */
+};
+
+int cash_get_flicker(struct cash_flicker *flicker);
+
+int cash_wait_ready(int sensors, int timeout_ms);
+
+/*
+ * Power management counters of a sensor, since the server started.
+ * Sensors get powered up by the first query after being idle and
+ * powered down once nobody queried them for the idle timeout.
+ */
+struct cash_sensor_stats {
+	uint32_t enables;		/* power ups, of any kind */
+	uint32_t auto_enables;		/* power ups caused by a query */
+	uint32_t warm_restarts;		/* starts that found it still powered */
+	uint32_t disables;		/* power downs after a stop */
+	uint32_t idle_disables;		/* power downs for lack of queries */
+	uint32_t ready_latency_us;	/* last power up to first sample */
+	uint32_t range_switches;	/* gain and integration time changes */
+	uint64_t queries;
+	uint64_t on_time_ms;		/* total powered time */
+};
+
+struct cash_stats {
+	struct cash_sensor_stats tof;
+	struct cash_sensor_stats rgbc;
+	/* Whole server: nonzero if sensors are served by the event loop */
+	uint32_t single_thread;
+	uint64_t wakeups;		/* of all event loops and workers */
+	uint64_t vol_ctx_switches;
+	uint64_t invol_ctx_switches;
+};
+
+int cash_get_stats(struct cash_stats *stats);
+
+int cash_get_snapshot(struct cash_snapshot *snap);
+int cash_get_snapshot_shm(struct cash_snapshot *snap);
+int cash_get_sample_at(int64_t timestamp_ns, int clock_id, int mode,
+		       struct cash_sample_at *sample);
+
+int cash_subscribe(int sensors, int32_t focus_delta, int32_t iso_delta);
+int cash_subscription_read(int fd, struct cash_snapshot *snap);
+void cash_unsubscribe(int fd);
+
 #endif